@@ -0,0 +1,380 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "log.h"
+#include "postprocess.h"
+#include "stats.h"
+#include "utils.h"
+
+#include "accesslog.h"
+
+using namespace std;
+
+struct ACCESS_EVENT_T
+{
+	string obj;
+	string store_path1;
+	string store_path2;
+	time_t atime;
+	unsigned long seq;
+};
+
+/*
+ * Single producer (the owning FUSE thread), single consumer (whoever holds
+ * _accesslog_flush_mutex). head only moves forward in the producer, tail
+ * only in the consumer.
+ */
+struct ACCESS_RING_T
+{
+	ACCESS_EVENT_T * slots[ACCESSLOG_RING_SIZE];
+	volatile unsigned long head;
+	volatile unsigned long tail;
+	volatile int dead; // owning thread exited, free once drained
+	ACCESS_RING_T * next;
+};
+
+static pthread_key_t _accesslog_key;
+static pthread_once_t _accesslog_key_once = PTHREAD_ONCE_INIT;
+
+// Protects the ring list, taken only when a thread registers its ring
+static pthread_mutex_t _accesslog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ACCESS_RING_T * _accesslog_rings = NULL;
+
+// Serializes consumers: the flusher thread and accesslog_flush() callers
+static pthread_mutex_t _accesslog_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t _accesslog_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _accesslog_wait_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t _accesslog_thread;
+static volatile int _accesslog_running = 0;
+
+// Orders events against tombstones
+static volatile unsigned long _accesslog_seq = 0;
+
+/*
+ * Unlinked and renamed names. The flusher drops the events recorded before
+ * the tombstone, or moves them to newobj, instead of writing the old name
+ * back into the DBs. A tombstone is kept for two flushes, enough to drain
+ * whatever was recorded before it.
+ */
+struct ACCESS_TOMB_T
+{
+	unsigned long seq;
+	unsigned long flush;
+	string newobj; // empty when unlinked
+};
+
+static pthread_mutex_t _accesslog_tomb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _accesslog_tomb_cond = PTHREAD_COND_INITIALIZER;
+static map<string, ACCESS_TOMB_T> _accesslog_tombs;
+static unsigned long _accesslog_flushes = 0;
+// Objects the flusher is writing out right now
+static set<string> _accesslog_writing;
+
+static void accesslog_thread_exit(void * data)
+{
+	ACCESS_RING_T * ring = (ACCESS_RING_T *)data;
+	__sync_synchronize();
+	ring->dead = 1;
+}
+
+static void accesslog_make_key()
+{
+	pthread_key_create(&_accesslog_key, accesslog_thread_exit);
+}
+
+static ACCESS_RING_T * get_ring()
+{
+	pthread_once(&_accesslog_key_once, accesslog_make_key);
+
+	ACCESS_RING_T * ring = (ACCESS_RING_T *)pthread_getspecific(_accesslog_key);
+	if(ring) {
+		return ring;
+	}
+
+	ring = new ACCESS_RING_T();
+	pthread_setspecific(_accesslog_key, ring);
+
+	AutoLock lock(&_accesslog_mutex);
+	ring->next = _accesslog_rings;
+	_accesslog_rings = ring;
+
+	return ring;
+}
+
+static int ring_push(ACCESS_RING_T * ring, ACCESS_EVENT_T * event)
+{
+	unsigned long head = ring->head;
+	if(head - ring->tail >= ACCESSLOG_RING_SIZE) {
+		return -1;
+	}
+
+	ring->slots[head & (ACCESSLOG_RING_SIZE - 1)] = event;
+	// Publish the slot before the new head
+	__sync_synchronize();
+	ring->head = head + 1;
+
+	return 0;
+}
+
+static void record_sync(const char * obj, time_t atime, const string &store_path1, const string &store_path2)
+{
+	char timestamp[128];
+	snprintf(timestamp, 128, "%d", (unsigned)atime);
+	stats_set(obj, timestamp);
+	postprocess_set(obj, 0, store_path1, store_path2);
+}
+
+void accesslog_record(const char * obj, const char * store_path1, const char * store_path2)
+{
+	if(!_accesslog_running) {
+		record_sync(obj, time(NULL), store_path1, store_path2);
+		return;
+	}
+
+	ACCESS_EVENT_T * event = new ACCESS_EVENT_T();
+	event->obj = obj;
+	event->store_path1 = store_path1;
+	event->store_path2 = store_path2;
+	event->atime = time(NULL);
+	event->seq = __sync_add_and_fetch(&_accesslog_seq, 1);
+
+	if(ring_push(get_ring(), event) != 0) {
+		log_msg(LOG_LEVEL_DEBUG, "accesslog_record: ring full, writing %s inline\n", obj);
+		record_sync(obj, event->atime, event->store_path1, event->store_path2);
+		delete event;
+	}
+}
+
+/*
+ * Take every queued event off the rings, keeping only the latest per object.
+ * Rings of exited threads are unlinked and freed once they are empty.
+ */
+static void drain_rings(map<string, ACCESS_EVENT_T *> &events)
+{
+	AutoLock lock(&_accesslog_mutex);
+
+	ACCESS_RING_T ** prev = &_accesslog_rings;
+	while(*prev) {
+		ACCESS_RING_T * ring = *prev;
+		int dead = ring->dead;
+		unsigned long tail = ring->tail;
+		unsigned long head = ring->head;
+		// Pairs with the barrier in ring_push()
+		__sync_synchronize();
+
+		for(; tail != head; tail++) {
+			ACCESS_EVENT_T * event = ring->slots[tail & (ACCESSLOG_RING_SIZE - 1)];
+			map<string, ACCESS_EVENT_T *>::iterator mit = events.find(event->obj);
+			if(mit == events.end()) {
+				events[event->obj] = event;
+			} else {
+				delete mit->second;
+				mit->second = event;
+			}
+		}
+		__sync_synchronize();
+		ring->tail = tail;
+
+		if(dead) {
+			*prev = ring->next;
+			delete ring;
+		} else {
+			prev = &ring->next;
+		}
+	}
+}
+
+/*
+ * Drops the events of unlinked names, moves those of renamed ones to the
+ * new name and marks the rest as being written.
+ */
+static void resolve_tombs(map<string, ACCESS_EVENT_T *> &events)
+{
+	AutoLock lock(&_accesslog_tomb_mutex);
+	_accesslog_flushes++;
+
+	map<string, ACCESS_EVENT_T *> resolved;
+	for(map<string, ACCESS_EVENT_T *>::iterator mit = events.begin(); mit != events.end(); mit++) {
+		ACCESS_EVENT_T * event = mit->second;
+		// seq only grows along the chain, rename cycles end
+		while(event) {
+			map<string, ACCESS_TOMB_T>::const_iterator tit = _accesslog_tombs.find(event->obj);
+			if(tit == _accesslog_tombs.end() || event->seq > tit->second.seq) {
+				break;
+			}
+			if(tit->second.newobj.empty()) {
+				log_msg(LOG_LEVEL_DEBUG, "accesslog_flush: dropping unlinked %s\n", event->obj.c_str());
+				delete event;
+				event = NULL;
+			} else {
+				// As if recorded for the new name right at the rename
+				event->obj = tit->second.newobj;
+				event->seq = tit->second.seq;
+			}
+		}
+		if(!event) {
+			continue;
+		}
+
+		ACCESS_EVENT_T *& slot = resolved[event->obj];
+		if(slot && slot->seq > event->seq) {
+			delete event;
+		} else {
+			delete slot;
+			slot = event;
+		}
+		_accesslog_writing.insert(event->obj);
+	}
+	events.swap(resolved);
+
+	map<string, ACCESS_TOMB_T>::iterator tit = _accesslog_tombs.begin();
+	while(tit != _accesslog_tombs.end()) {
+		if(tit->second.flush + 2 <= _accesslog_flushes) {
+			_accesslog_tombs.erase(tit++);
+		} else {
+			tit++;
+		}
+	}
+}
+
+static void done_writing()
+{
+	AutoLock lock(&_accesslog_tomb_mutex);
+	_accesslog_writing.clear();
+	pthread_cond_broadcast(&_accesslog_tomb_cond);
+}
+
+static void set_tomb(const char * obj, const char * newobj)
+{
+	if(!_accesslog_running) {
+		return;
+	}
+
+	AutoLock lock(&_accesslog_tomb_mutex);
+	// Already past the filter, the caller's update has to come after the write
+	while(_accesslog_writing.count(obj)) {
+		pthread_cond_wait(&_accesslog_tomb_cond, &_accesslog_tomb_mutex);
+	}
+
+	ACCESS_TOMB_T &tomb = _accesslog_tombs[obj];
+	tomb.seq = __sync_add_and_fetch(&_accesslog_seq, 1);
+	tomb.flush = _accesslog_flushes;
+	tomb.newobj = newobj ? newobj : "";
+}
+
+void accesslog_forget(const char * obj)
+{
+	set_tomb(obj, NULL);
+}
+
+void accesslog_rename(const char * obj, const char * newobj)
+{
+	set_tomb(obj, newobj);
+}
+
+int accesslog_flush()
+{
+	AutoLock lock(&_accesslog_flush_mutex);
+
+	map<string, ACCESS_EVENT_T *> events;
+	drain_rings(events);
+	resolve_tombs(events);
+
+	if(events.empty()) {
+		return 0;
+	}
+
+	map<string, string> stats_batch;
+	// Grouped by (store_path1, store_path2), in practice there's one group
+	map<pair<string, string>, vector<string> > pp_batches;
+
+	for(map<string, ACCESS_EVENT_T *>::iterator mit = events.begin(); mit != events.end(); mit++) {
+		ACCESS_EVENT_T * event = mit->second;
+		char timestamp[128];
+		snprintf(timestamp, 128, "%d", (unsigned)event->atime);
+		stats_batch[event->obj] = timestamp;
+		pp_batches[make_pair(event->store_path1, event->store_path2)].push_back(event->obj);
+		delete event;
+	}
+
+	int retstat = stats_set_batch(stats_batch);
+
+	map<pair<string, string>, vector<string> >::const_iterator pit;
+	for(pit = pp_batches.begin(); pit != pp_batches.end(); pit++) {
+		if(postprocess_set_batch(pit->second, 0, pit->first.first, pit->first.second) != 0) {
+			retstat = -1;
+		}
+	}
+	done_writing();
+
+	log_msg(LOG_LEVEL_DEBUG, "accesslog_flush: %u objects\n", (unsigned)stats_batch.size());
+
+	return retstat;
+}
+
+static void * accesslog_thread(void * data)
+{
+	while(_accesslog_running) {
+		struct timeval now;
+		struct timespec deadline;
+		gettimeofday(&now, NULL);
+		long nsec = now.tv_usec * 1000L + (ACCESSLOG_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+		deadline.tv_sec = now.tv_sec + ACCESSLOG_FLUSH_INTERVAL_MS / 1000 + nsec / 1000000000L;
+		deadline.tv_nsec = nsec % 1000000000L;
+
+		pthread_mutex_lock(&_accesslog_wait_mutex);
+		if(_accesslog_running) {
+			pthread_cond_timedwait(&_accesslog_wait_cond, &_accesslog_wait_mutex, &deadline);
+		}
+		pthread_mutex_unlock(&_accesslog_wait_mutex);
+
+		accesslog_flush();
+	}
+
+	return NULL;
+}
+
+int accesslog_start()
+{
+	if(_accesslog_running) {
+		return 0;
+	}
+
+	_accesslog_running = 1;
+	int rc = pthread_create(&_accesslog_thread, NULL, accesslog_thread, NULL);
+	if(rc != 0) {
+		_accesslog_running = 0;
+		log_msg(LOG_LEVEL_ERROR, "accesslog_start: pthread_create failed: %d\n", rc);
+		return -1;
+	}
+
+	return 0;
+}
+
+void accesslog_stop()
+{
+	if(!_accesslog_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&_accesslog_wait_mutex);
+	_accesslog_running = 0;
+	pthread_cond_signal(&_accesslog_wait_cond);
+	pthread_mutex_unlock(&_accesslog_wait_mutex);
+
+	pthread_join(_accesslog_thread, NULL);
+
+	// Anything recorded while we were shutting down
+	accesslog_flush();
+}
@@ -0,0 +1,30 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <string>
+
+using namespace std;
+
+// Open events are queued on per-thread rings and written to the stats and
+// postprocess DBs by a background flusher, one WriteBatch per interval.
+#define ACCESSLOG_RING_SIZE 1024 // power of two
+#define ACCESSLOG_FLUSH_INTERVAL_MS 200
+
+extern int accesslog_start();
+extern void accesslog_stop();
+/*
+ * Never blocks on the DBs. Falls back to the synchronous stats_set() and
+ * postprocess_set() when the flusher isn't running or the ring is full.
+ */
+extern void accesslog_record(const char * obj, const char * store_path1, const char * store_path2);
+// Write out everything queued so far
+extern int accesslog_flush();
+/*
+ * obj was unlinked, its events recorded so far are dropped instead of
+ * written. Only waits when the flusher is writing obj at that moment.
+ */
+extern void accesslog_forget(const char * obj);
+// obj was renamed, its events recorded so far are written for newobj
+extern void accesslog_rename(const char * obj, const char * newobj);
+
+#endif
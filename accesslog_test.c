@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "accesslog.h"
+#include "postprocess.h"
+#include "store.h"
+
+using namespace std;
+
+static int _failed = 0;
+
+static void expect_queued(const char * obj, int queued)
+{
+	PP_ENTRY_T pp_entry;
+	int found = (postprocess_get(obj, pp_entry) == 0);
+	if(found != queued) {
+		fprintf(stderr, "FAIL: %s %s\n", obj, queued ? "not queued" : "still queued");
+		_failed++;
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	char root[] = "/tmp/accesslog_test.XXXXXX";
+	if(mkdtemp(root) == NULL || store_init(root) != 0 || postprocess_init() != 0 || accesslog_start() != 0) {
+		fprintf(stderr, "accesslog_test: setup failed\n");
+		return 1;
+	}
+
+	// Unlink right after the write, as ifs_unlink does it
+	accesslog_record("/unlinked", "s1", "s2");
+	accesslog_forget("/unlinked");
+	postprocess_cancel("/unlinked", 0);
+
+	// Unlinked and created again, the new file is queued
+	accesslog_record("/recreated", "s1", "s2");
+	accesslog_forget("/recreated");
+	postprocess_cancel("/recreated", 0);
+	accesslog_record("/recreated", "s1", "s2");
+
+	// Renamed twice over a replaced target, as ifs_rename does it
+	accesslog_record("/a", "s1", "s2");
+	accesslog_record("/c", "s1", "s2");
+	accesslog_rename("/a", "/b");
+	postprocess_rename("/a", "/b");
+	accesslog_forget("/c");
+	postprocess_cancel("/c", 0);
+	accesslog_rename("/b", "/c");
+	postprocess_rename("/b", "/c");
+
+	// Written out by the flusher thread
+	accesslog_stop();
+
+	expect_queued("/unlinked", 0);
+	expect_queued("/recreated", 1);
+	expect_queued("/a", 0);
+	expect_queued("/b", 0);
+	expect_queued("/c", 1);
+
+	string cmd = string("rm -rf ") + root;
+	if(system(cmd.c_str()) != 0) {
+		fprintf(stderr, "accesslog_test: cannot remove %s\n", root);
+	}
+
+	printf("accesslog_test: %s\n", _failed ? "FAILED" : "OK");
+	return _failed ? 1 : 0;
+}
@@ -11,6 +11,7 @@
 #include <sys/ioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include "ifsctl.h"
@@ -18,14 +19,19 @@ const char *usage =
 	"Usage: ifsctl FIOC_FILE COMMAND\n"
 	"\n"
 	"COMMANDS\n"
+	"  p print the databases to the log\n"
 	"  e evict L1 cache\n"
+	"  t STORE RATE limit migrations from and to STORE (\"*\" for\n"
+	"    all others) to RATE bytes per second, 0 removes the limit\n"
+	"  a TARGET_US back migrations off while foreground reads and\n"
+	"    writes take longer than TARGET_US, 0 turns it off\n"
 	"\n";
 
 int main(int argc, char **argv)
 {
 	char cmd;
 	int fd;
-	if (argc < 2)
+	if (argc < 3)
 	    goto usage;
 	fd = open(argv[1], O_RDWR | O_CREAT, S_IRWXU);
 	if (fd < 0)
@@ -36,6 +42,8 @@ int main(int argc, char **argv)
 	cmd = tolower(argv[2][0]);
 	
 	struct ifs_ioctl_arg arg;
+	struct ifs_throttle_arg throttle_arg;
+	memset(&throttle_arg, 0, sizeof(throttle_arg));
 	switch (cmd)
 	{
 	case 'p':
@@ -55,6 +63,34 @@ int main(int argc, char **argv)
 		}
 		printf("IFSIOC_EVICT done.\n");
 		return 0;
+
+	case 't':
+		if (argc < 5)
+			goto usage;
+		snprintf(throttle_arg.store, sizeof(throttle_arg.store), "%s", argv[3]);
+		throttle_arg.rate = strtoull(argv[4], NULL, 10);
+		throttle_arg.target_us = -1;
+		if (ioctl(fd, IFSIOC_THROTTLE, &throttle_arg))
+		{
+			perror("ioctl IFSIOC_THROTTLE");
+			return 1;
+		}
+		printf("IFSIOC_THROTTLE done.\n");
+		return 0;
+
+	case 'a':
+		if (argc < 4)
+			goto usage;
+		throttle_arg.target_us = strtol(argv[3], NULL, 10);
+		if (throttle_arg.target_us < 0)
+			goto usage;
+		if (ioctl(fd, IFSIOC_THROTTLE, &throttle_arg))
+		{
+			perror("ioctl IFSIOC_THROTTLE");
+			return 1;
+		}
+		printf("IFSIOC_THROTTLE done.\n");
+		return 0;
 		}
 
 usage:
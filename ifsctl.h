@@ -2,10 +2,19 @@
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 
+// Migration bandwidth, see throttle.h
+struct ifs_throttle_arg
+{
+    char                store[1024];    // store root, "*" for the default, "" leaves the rates alone
+    unsigned long long  rate;           // bytes per second, 0 = no limit of its own
+    long                target_us;      // adaptive latency target, 0 = off, -1 leaves it alone
+};
+
 enum
 {
 	IFSIOC_PRINTDB = _IOW('E', 0, size_t),
 	IFSIOC_EVICT   = _IOW('E', 1, size_t),
+	IFSIOC_THROTTLE = _IOW('E', 2, struct ifs_throttle_arg),
 };
 
 struct ifs_ioctl_arg
@@ -4,6 +4,7 @@
 #include "objmap.h"
 #include "postprocess.h"
 #include "stats.h"
+#include "metadb.h"
 
 #include "leveldb/db.h"
 
@@ -60,20 +61,9 @@ void dump_ldb(const char * db_name)
 
 int main(int argc, char** argv)
 {
-	cout << "=========OBJMAP L1============" << endl;
-	dump_ldb(OBJMAP_DB);
-	cout << endl;
-
-	cout << "=========OBJMAP L2============" << endl;
-	dump_ldb(OBJMAP_DB2);
-	cout << endl;
-
-	cout << "=========POSTPROCESSING============" << endl;
-	dump_ldb(POSTPROCESS_DB);
-	cout << endl;
-
-	cout << "=========STATS_DB============" << endl;
-	dump_ldb(STATS_DB);
+	// One DB now, keys carry their table prefix (o1, o2, pp, st)
+	cout << "=========METADB============" << endl;
+	dump_ldb(METADB_DB.c_str());
 	cout << endl;
 
 	return 0;
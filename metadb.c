@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#include "leveldb/cache.h"
+#include "leveldb/db.h"
+#include "leveldb/iterator.h"
+#include "leveldb/write_batch.h"
+#include "log.h"
+#include "utils.h"
+
+#include "metadb.h"
+
+using namespace std;
+
+static const char * METADB_TABLE_PREFIX[METADB_TABLE_MAX] = {
+	"o1", // METADB_OBJMAP_L1
+	"o2", // METADB_OBJMAP_L2
+	"pp", // METADB_POSTPROCESS
+	"st", // METADB_STATS
+	"sr", // METADB_STOREREG
+	"cs", // METADB_CHECKSUM
+	"lt", // METADB_LIFETIME
+};
+
+// Outside every table, set once the old databases are imported
+static const char * METADB_VERSION_KEY = "mv";
+static const char * METADB_VERSION = "1";
+
+#define METADB_IMPORT_BATCH 4096
+
+static leveldb::DB* _metadb = NULL;
+static leveldb::Cache* _metadb_cache = NULL;
+static pthread_mutex_t _metadb_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static string table_key(METADB_TABLE_T table, const string &key)
+{
+	string tkey = METADB_TABLE_PREFIX[table];
+	tkey += key;
+	return tkey;
+}
+
+/*
+ * Bounds a DB iterator to one table and strips the prefix off the keys
+ */
+class MetaTableIterator: public leveldb::Iterator
+{
+public:
+	MetaTableIterator(leveldb::Iterator * it, const string &prefix):
+		it_(it),
+		prefix_(prefix)
+	{
+	}
+
+	virtual ~MetaTableIterator()
+	{
+		delete it_;
+	}
+
+	virtual bool Valid() const
+	{
+		return it_->Valid() && it_->key().starts_with(prefix_);
+	}
+
+	virtual void SeekToFirst()
+	{
+		it_->Seek(prefix_);
+	}
+
+	virtual void SeekToLast()
+	{
+		// First key past the table, then one back
+		string end = prefix_;
+		end[end.size() - 1]++;
+		it_->Seek(end);
+		if(it_->Valid()) {
+			it_->Prev();
+		} else {
+			it_->SeekToLast();
+		}
+	}
+
+	virtual void Seek(const leveldb::Slice& target)
+	{
+		it_->Seek(prefix_ + target.ToString());
+	}
+
+	virtual void Next()
+	{
+		it_->Next();
+	}
+
+	virtual void Prev()
+	{
+		it_->Prev();
+	}
+
+	virtual leveldb::Slice key() const
+	{
+		leveldb::Slice key = it_->key();
+		key.remove_prefix(prefix_.size());
+		return key;
+	}
+
+	virtual leveldb::Slice value() const
+	{
+		return it_->value();
+	}
+
+	virtual leveldb::Status status() const
+	{
+		return it_->status();
+	}
+
+private:
+	leveldb::Iterator * it_;
+	string prefix_;
+};
+
+// Copy one of the old per-table databases in, if it is still around
+static int metadb_import(const string &path, METADB_TABLE_T table)
+{
+	struct stat statbuf;
+	if(stat(path.c_str(), &statbuf) != 0) {
+		return 0;
+	}
+
+	leveldb::DB* old_db = NULL;
+	leveldb::Options options;
+	options.create_if_missing = false;
+	leveldb::Status status = leveldb::DB::Open(options, path, &old_db);
+	if(false == status.ok()) {
+		log_msg(LOG_LEVEL_ERROR, "metadb_import: cannot open %s: %s\n", path.c_str(), status.ToString().c_str());
+		return -1;
+	}
+
+	unsigned long count = 0;
+	leveldb::WriteBatch batch;
+	leveldb::Iterator* it = old_db->NewIterator(leveldb::ReadOptions());
+	for (it->SeekToFirst(); it->Valid(); it->Next())
+	{
+		metadb_batch_put(&batch, table, it->key().ToString(), it->value().ToString());
+		if(++count % METADB_IMPORT_BATCH == 0) {
+			status = metadb_write(&batch);
+			batch.Clear();
+			if(false == status.ok()) {
+				break;
+			}
+		}
+	}
+	if(status.ok()) {
+		status = it->status();
+	}
+	if(status.ok()) {
+		status = metadb_write(&batch);
+	}
+	delete it;
+	delete old_db;
+
+	if(false == status.ok()) {
+		log_msg(LOG_LEVEL_ERROR, "metadb_import: %s: %s\n", path.c_str(), status.ToString().c_str());
+		return -1;
+	}
+
+	log_msg(LOG_LEVEL_ERROR, "metadb_import: %lu keys from %s\n", count, path.c_str());
+	return 0;
+}
+
+/*
+ * The version key only goes in once every table is copied, a crash half
+ * way just redoes the (idempotent) import on the next start.
+ */
+static int metadb_upgrade()
+{
+	string version;
+	if(_metadb->Get(leveldb::ReadOptions(), METADB_VERSION_KEY, &version).ok()) {
+		return 0;
+	}
+
+	// In table order, newer tables never had a database of their own
+	const string old_dbs[] = {
+		STORE_ROOT + "/.objmap",
+		STORE_ROOT + "/.objmap2",
+		STORE_ROOT + "/.postprocess",
+		STORE_ROOT + "/.stats",
+	};
+	const int n_old_dbs = sizeof(old_dbs) / sizeof(old_dbs[0]);
+
+	for(int i = 0; i < n_old_dbs; i++) {
+		if(metadb_import(old_dbs[i], (METADB_TABLE_T)i) != 0) {
+			return -1;
+		}
+	}
+
+	leveldb::WriteOptions writeOptions;
+	writeOptions.sync = true;
+	leveldb::Status status = _metadb->Put(writeOptions, METADB_VERSION_KEY, METADB_VERSION);
+	if(false == status.ok()) {
+		log_msg(LOG_LEVEL_ERROR, "metadb_upgrade: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	// Keep the old copies around, just out of the way
+	for(int i = 0; i < n_old_dbs; i++) {
+		string imported = old_dbs[i] + ".imported";
+		if(rename(old_dbs[i].c_str(), imported.c_str()) != 0 && errno != ENOENT) {
+			log_msg(LOG_LEVEL_ERROR, "metadb_upgrade: cannot rename %s: %s\n", old_dbs[i].c_str(), strerror(errno));
+		}
+	}
+
+	return 0;
+}
+
+int metadb_init()
+{
+	AutoLock lock(&_metadb_mutex);
+
+	if(_metadb) {
+		return 0;
+	}
+
+	// One block cache for every table
+	_metadb_cache = leveldb::NewLRUCache(METADB_BLOCK_CACHE_SIZE);
+
+	leveldb::Options options;
+	options.create_if_missing = true;
+	options.block_cache = _metadb_cache;
+
+	leveldb::Status status = leveldb::DB::Open(options, METADB_DB, &_metadb);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "Unable to open metadata database %s: %s\n", METADB_DB.c_str(), status.ToString().c_str());
+		_metadb = NULL;
+		return -1;
+	}
+
+	if(metadb_upgrade() != 0) {
+		delete _metadb;
+		_metadb = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+leveldb::Status metadb_get(METADB_TABLE_T table, const string &key, string * value)
+{
+	return _metadb->Get(leveldb::ReadOptions(), table_key(table, key), value);
+}
+
+leveldb::Status metadb_put(METADB_TABLE_T table, const string &key, const string &value)
+{
+	return _metadb->Put(leveldb::WriteOptions(), table_key(table, key), value);
+}
+
+leveldb::Status metadb_delete(METADB_TABLE_T table, const string &key)
+{
+	return _metadb->Delete(leveldb::WriteOptions(), table_key(table, key));
+}
+
+void metadb_batch_put(leveldb::WriteBatch * batch, METADB_TABLE_T table, const string &key, const string &value)
+{
+	batch->Put(table_key(table, key), value);
+}
+
+void metadb_batch_delete(leveldb::WriteBatch * batch, METADB_TABLE_T table, const string &key)
+{
+	batch->Delete(table_key(table, key));
+}
+
+leveldb::Status metadb_write(leveldb::WriteBatch * batch)
+{
+	return _metadb->Write(leveldb::WriteOptions(), batch);
+}
+
+leveldb::Iterator * metadb_iterator(METADB_TABLE_T table)
+{
+	return new MetaTableIterator(_metadb->NewIterator(leveldb::ReadOptions()), METADB_TABLE_PREFIX[table]);
+}
@@ -0,0 +1,50 @@
+#ifndef __META_DB_H__
+#define __META_DB_H__
+
+#include <string>
+
+#include "store.h"
+
+using namespace std;
+
+namespace leveldb { class Iterator; class Status; class WriteBatch; }
+
+/*
+ * All metadata lives in one LevelDB: one WAL, one memtable and one block
+ * cache. Each former database is a table, a key range under its own
+ * two-byte prefix ("o1" + path for the L1 objmap, and so on).
+ */
+#define METADB_DB (STORE_ROOT + "/.metadb")
+#define METADB_BLOCK_CACHE_SIZE (64 * 1048576)
+
+enum METADB_TABLE_T {
+	METADB_OBJMAP_L1 = 0,
+	METADB_OBJMAP_L2,
+	METADB_POSTPROCESS,
+	METADB_STATS,
+	METADB_STOREREG,
+	METADB_CHECKSUM,
+	METADB_LIFETIME,
+	METADB_TABLE_MAX
+};
+
+/*
+ * Opens the DB once per process, every module init calls it.
+ * The first open imports the old .objmap/.objmap2/.postprocess/.stats
+ * databases and renames them to *.imported.
+ */
+extern int metadb_init();
+
+extern leveldb::Status metadb_get(METADB_TABLE_T table, const string &key, string * value);
+extern leveldb::Status metadb_put(METADB_TABLE_T table, const string &key, const string &value);
+extern leveldb::Status metadb_delete(METADB_TABLE_T table, const string &key);
+
+extern void metadb_batch_put(leveldb::WriteBatch * batch, METADB_TABLE_T table, const string &key, const string &value);
+extern void metadb_batch_delete(leveldb::WriteBatch * batch, METADB_TABLE_T table, const string &key);
+// Batches may mix tables, they still go out as one log append
+extern leveldb::Status metadb_write(leveldb::WriteBatch * batch);
+
+// Iterates one table, keys come back without the table prefix
+extern leveldb::Iterator * metadb_iterator(METADB_TABLE_T table);
+
+#endif
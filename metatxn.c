@@ -0,0 +1,62 @@
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "log.h"
+#include "objmap.h"
+
+#include "metatxn.h"
+
+using namespace std;
+
+struct META_TXN_T
+{
+	leveldb::WriteBatch batch;
+	bool dirty;
+	vector<pair<META_TXN_HOOK_FN, string> > hooks;
+};
+
+META_TXN_T * metatxn_begin()
+{
+	META_TXN_T * txn = new META_TXN_T();
+	txn->dirty = false;
+	return txn;
+}
+
+leveldb::WriteBatch * metatxn_batch(META_TXN_T * txn)
+{
+	txn->dirty = true;
+	return &txn->batch;
+}
+
+void metatxn_on_commit(META_TXN_T * txn, META_TXN_HOOK_FN fn, const string &key)
+{
+	txn->hooks.push_back(make_pair(fn, key));
+}
+
+int metatxn_commit(META_TXN_T * txn)
+{
+	int retstat = 0;
+
+	// Goes through the objmap, it may have to wait for the index migration
+	if(txn->dirty) {
+		retstat = objmap_write_batch(&txn->batch);
+	}
+
+	// Even after a failed write, dropping cached state is always safe
+	vector<pair<META_TXN_HOOK_FN, string> >::const_iterator vit;
+	for(vit = txn->hooks.begin(); vit != txn->hooks.end(); vit++) {
+		vit->first(vit->second);
+	}
+
+	delete txn;
+
+	return retstat;
+}
+
+void metatxn_abort(META_TXN_T * txn)
+{
+	delete txn;
+}
@@ -0,0 +1,28 @@
+#ifndef __META_TXN_H__
+#define __META_TXN_H__
+
+#include <string>
+
+using namespace std;
+
+namespace leveldb { class WriteBatch; }
+
+/*
+ * Collects the metadata mutations of one FUSE op and commits them together.
+ * Everything goes into a single WriteBatch on the metadata DB, so e.g. a
+ * rename's objmap set + del can never be seen half done. Commits from
+ * concurrent FUSE threads queue up in LevelDB's writer queue and go out as
+ * one log write (group commit).
+ */
+struct META_TXN_T;
+typedef void (*META_TXN_HOOK_FN)(const string &key);
+
+extern META_TXN_T * metatxn_begin();
+extern leveldb::WriteBatch * metatxn_batch(META_TXN_T * txn);
+// fn(key) runs once the txn is written, e.g. to drop cached copies
+extern void metatxn_on_commit(META_TXN_T * txn, META_TXN_HOOK_FN fn, const string &key);
+// Writes the batch and frees txn
+extern int metatxn_commit(META_TXN_T * txn);
+extern void metatxn_abort(META_TXN_T * txn);
+
+#endif
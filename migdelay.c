@@ -0,0 +1,243 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "leveldb/db.h"
+#include "log.h"
+#include "metadb.h"
+#include "store.h"
+#include "utils.h"
+
+#include "migdelay.h"
+
+using namespace std;
+
+// Config and the stats read-modify-write
+static pthread_mutex_t _migdelay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<string, unsigned long> _migdelay_min_age;
+static unsigned long _migdelay_default_age = 0;
+static time_t _migdelay_next_reload = 0;
+static struct timespec _migdelay_file_mtime;
+
+// with _migdelay_mutex held, re-reads MIGDELAY_FILE if it changed
+static void migdelay_load()
+{
+	time_t now = time(NULL);
+	if(now < _migdelay_next_reload) {
+		return;
+	}
+	_migdelay_next_reload = now + MIGDELAY_RELOAD_INTERVAL;
+
+	struct stat statbuf;
+	if(stat(MIGDELAY_FILE.c_str(), &statbuf) != 0) {
+		_migdelay_min_age.clear();
+		_migdelay_default_age = 0;
+		return;
+	}
+	if(statbuf.st_mtim.tv_sec == _migdelay_file_mtime.tv_sec
+		&& statbuf.st_mtim.tv_nsec == _migdelay_file_mtime.tv_nsec) {
+		return;
+	}
+	_migdelay_file_mtime = statbuf.st_mtim;
+
+	ifstream file;
+	file.open(MIGDELAY_FILE.c_str());
+	if(file.fail()) {
+		return;
+	}
+
+	_migdelay_min_age.clear();
+	_migdelay_default_age = 0;
+
+	string line;
+	while(getline(file, line)) {
+		size_t pos1 = line.find(',');
+		if(pos1 == string::npos) {
+			continue;
+		}
+		string type = line.substr(0, pos1);
+		unsigned long age = strtoul(line.substr(pos1 + 1).c_str(), NULL, 10);
+		if(type == MIGDELAY_DEFAULT_TYPE) {
+			_migdelay_default_age = age;
+		} else {
+			for(size_t i = 0; i < type.size(); i++) {
+				type[i] = tolower(type[i]);
+			}
+			_migdelay_min_age[type] = age;
+		}
+	}
+
+	log_msg(LOG_LEVEL_ERROR, "migdelay_load: %lu types, default %lu s\n",
+		(unsigned long)_migdelay_min_age.size(), _migdelay_default_age);
+}
+
+void migdelay_type(const char * obj, string &type)
+{
+	const char * name = strrchr(obj, '/');
+	name = name ? name + 1 : obj;
+
+	if(strncmp(name, "~$", 2) == 0) {
+		type = "~$";
+		return;
+	}
+
+	// A leading dot is a hidden file, not a suffix
+	const char * dot = strrchr(name, '.');
+	if(!dot || dot == name || strlen(dot) > MIGDELAY_TYPE_MAX) {
+		type = MIGDELAY_NO_SUFFIX;
+		return;
+	}
+
+	type = dot;
+	for(size_t i = 0; i < type.size(); i++) {
+		type[i] = tolower(type[i]);
+	}
+}
+
+static int stats_decode(const string &value, MIGDELAY_STATS_T &stats)
+{
+	const char * p = value.data();
+	const char * limit = value.data() + value.size();
+
+	if(value.empty() || *p++ != MIGDELAY_STATS_VERSION
+		|| !get_varint64(p, limit, stats.lifetime)
+		|| !get_varint64(p, limit, stats.ended)
+		|| !get_varint64(p, limit, stats.migrated)
+		|| !get_varint64(p, limit, stats.avoided_files)
+		|| !get_varint64(p, limit, stats.avoided_bytes)) {
+		return -1;
+	}
+	return 0;
+}
+
+static void stats_get(const string &type, MIGDELAY_STATS_T &stats)
+{
+	string value;
+	if(false == metadb_get(METADB_LIFETIME, type, &value).ok() || stats_decode(value, stats) != 0) {
+		stats = MIGDELAY_STATS_T();
+	}
+}
+
+static void stats_put(const string &type, const MIGDELAY_STATS_T &stats)
+{
+	string value(1, MIGDELAY_STATS_VERSION);
+	put_varint64(value, stats.lifetime);
+	put_varint64(value, stats.ended);
+	put_varint64(value, stats.migrated);
+	put_varint64(value, stats.avoided_files);
+	put_varint64(value, stats.avoided_bytes);
+
+	leveldb::Status status = metadb_put(METADB_LIFETIME, type, value);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "migdelay: %s\n", status.ToString().c_str());
+	}
+}
+
+// Zero unless most files of the type die in the queue
+static unsigned long learned_delay(const MIGDELAY_STATS_T &stats)
+{
+	if(stats.ended < MIGDELAY_MIN_SAMPLES || stats.ended < stats.migrated) {
+		return 0;
+	}
+	// Lifetimes are whole seconds, one that rounds to 0 still needs a wait
+	uint64_t delay = stats.lifetime * 2 + 1;
+	return delay > MIGDELAY_LEARNED_MAX ? MIGDELAY_LEARNED_MAX : delay;
+}
+
+unsigned long migdelay_get(const char * obj)
+{
+	string type;
+	migdelay_type(obj, type);
+
+	AutoLock _lock(&_migdelay_mutex);
+	migdelay_load();
+
+	map<string, unsigned long>::const_iterator mit = _migdelay_min_age.find(type);
+	unsigned long delay = (mit != _migdelay_min_age.end()) ? mit->second : _migdelay_default_age;
+
+	MIGDELAY_STATS_T stats;
+	stats_get(type, stats);
+	unsigned long learned = learned_delay(stats);
+
+	return learned > delay ? learned : delay;
+}
+
+void migdelay_ended(const char * obj, uint64_t lifetime, uint64_t bytes)
+{
+	string type;
+	migdelay_type(obj, type);
+
+	AutoLock _lock(&_migdelay_mutex);
+	MIGDELAY_STATS_T stats;
+	stats_get(type, stats);
+
+	// Rounded, lifetimes of a few seconds would vanish in the shift otherwise
+	stats.lifetime = stats.ended ? (stats.lifetime * ((1 << MIGDELAY_EWMA_SHIFT) - 1) + lifetime
+		+ (1 << (MIGDELAY_EWMA_SHIFT - 1))) >> MIGDELAY_EWMA_SHIFT : lifetime;
+	stats.ended++;
+	if(bytes) {
+		stats.avoided_files++;
+		stats.avoided_bytes += bytes;
+	}
+	stats_put(type, stats);
+
+	log_msg(LOG_LEVEL_DEBUG, "migdelay_ended: %s (%s) after %llu s, %llu bytes not migrated\n",
+		obj, type.c_str(), (unsigned long long)lifetime, (unsigned long long)bytes);
+}
+
+void migdelay_migrated(const char * obj)
+{
+	string type;
+	migdelay_type(obj, type);
+
+	AutoLock _lock(&_migdelay_mutex);
+	MIGDELAY_STATS_T stats;
+	stats_get(type, stats);
+	stats.migrated++;
+	stats_put(type, stats);
+}
+
+int migdelay_dump_to_log()
+{
+	AutoLock _lock(&_migdelay_mutex);
+	migdelay_load();
+
+	uint64_t avoided_files = 0;
+	uint64_t avoided_bytes = 0;
+
+	log_msg(LOG_LEVEL_ERROR, "\nmigdelay: default %lu s\n", _migdelay_default_age);
+	leveldb::Iterator* it = metadb_iterator(METADB_LIFETIME);
+	for (it->SeekToFirst(); it->Valid(); it->Next())
+	{
+		string type = it->key().ToString();
+		MIGDELAY_STATS_T stats;
+		if(stats_decode(it->value().ToString(), stats) != 0) {
+			continue;
+		}
+		map<string, unsigned long>::const_iterator mit = _migdelay_min_age.find(type);
+		log_msg(LOG_LEVEL_ERROR, "migdelay %s: min %lu s, learned %lu s, lifetime %llu s, %llu ended, %llu migrated, %llu files / %llu bytes avoided\n",
+			type.c_str(),
+			(mit != _migdelay_min_age.end()) ? mit->second : _migdelay_default_age,
+			learned_delay(stats),
+			(unsigned long long)stats.lifetime,
+			(unsigned long long)stats.ended,
+			(unsigned long long)stats.migrated,
+			(unsigned long long)stats.avoided_files,
+			(unsigned long long)stats.avoided_bytes);
+		avoided_files += stats.avoided_files;
+		avoided_bytes += stats.avoided_bytes;
+	}
+	delete it;
+
+	log_msg(LOG_LEVEL_ERROR, "migdelay: %llu files / %llu bytes not migrated in total\n",
+		(unsigned long long)avoided_files, (unsigned long long)avoided_bytes);
+	return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef __MIG_DELAY_H__
+#define __MIG_DELAY_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+using namespace std;
+
+/*
+ * How long a closed file sits in the migration queue before ppd copies it.
+ *
+ * Temp files (Office's ~$ files, build outputs) are often renamed or
+ * deleted seconds after they are written, copying them is wasted I/O.
+ * Files are told apart by type: the lowercased suffix of the name, "~$"
+ * for names starting with it, MIGDELAY_NO_SUFFIX without one. A type waits
+ * at least its configured minimum age. When most queued files of a type
+ * were seen to go away before they were migrated, it waits twice their
+ * typical lifetime (plus a second), up to MIGDELAY_LEARNED_MAX.
+ *
+ * The lifetimes are kept in the metadata DB, next to the queue.
+ */
+// "type,seconds" per line, "*,seconds" for the types not listed
+#define MIGDELAY_FILE (STORE_ROOT + "/.migrate.delay")
+#define MIGDELAY_DEFAULT_TYPE "*"
+#define MIGDELAY_NO_SUFFIX "-"
+// Longer suffixes are not file types
+#define MIGDELAY_TYPE_MAX 16
+// Seconds between checks for a changed MIGDELAY_FILE
+#define MIGDELAY_RELOAD_INTERVAL 5
+// Ended lifetimes a type needs before its delay is learned
+#define MIGDELAY_MIN_SAMPLES 8
+// Seconds
+#define MIGDELAY_LEARNED_MAX 3600
+// EWMA weight of a new lifetime, 1/2^shift
+#define MIGDELAY_EWMA_SHIFT 3
+
+struct MIGDELAY_STATS_T
+{
+	MIGDELAY_STATS_T():
+		lifetime(0),
+		ended(0),
+		migrated(0),
+		avoided_files(0),
+		avoided_bytes(0)
+	{
+	}
+
+	// Seconds from enqueue until the name went away, EWMA
+	uint64_t lifetime;
+	uint64_t ended;
+	uint64_t migrated;
+	// Migrations not done because the data was gone first
+	uint64_t avoided_files;
+	uint64_t avoided_bytes;
+};
+#define MIGDELAY_STATS_VERSION '\x01'
+
+extern void migdelay_type(const char * obj, string &type);
+// Seconds obj has to be queued before it is migrated
+extern unsigned long migdelay_get(const char * obj);
+/*
+ * obj's queued name went away lifetime seconds after it was enqueued.
+ * bytes is what its migration would have copied, 0 if the data lives on
+ * under another name.
+ */
+extern void migdelay_ended(const char * obj, uint64_t lifetime, uint64_t bytes);
+extern void migdelay_migrated(const char * obj);
+extern int migdelay_dump_to_log();
+
+#endif
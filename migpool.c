@@ -0,0 +1,312 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <deque>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "store.h"
+#include "utils.h"
+
+#include "migpool.h"
+
+using namespace std;
+
+struct MIGPOOL_TASK_T
+{
+	string path;
+	PP_ENTRY_T pp_entry;
+	string from_store;
+	string to_store;
+};
+
+struct MIGPOOL_WORKER_T
+{
+	int id;
+	pthread_t thread;
+
+	// Stats
+	unsigned long files;
+	unsigned long failures;
+	unsigned long long bytes;
+	unsigned long long busy_us;
+};
+
+struct MIGPOOL_STORE_T
+{
+	// Tasks migrating from this store, FIFO
+	deque<MIGPOOL_TASK_T *> tasks;
+	int limit;
+	int active;
+	unsigned long files;
+	unsigned long long bytes;
+};
+
+/*
+ * One lock for the queues and the store slots: picking a task and taking
+ * its slots has to be atomic, and a task is a whole file copy, so the
+ * lock is never the bottleneck.
+ */
+static pthread_mutex_t _migpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Workers wait for work or free slots, submitters and drainers for room
+static pthread_cond_t _migpool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _migpool_done_cond = PTHREAD_COND_INITIALIZER;
+
+static vector<MIGPOOL_WORKER_T *> _migpool_workers;
+static map<string, MIGPOOL_STORE_T> _migpool_stores;
+static set<string> _migpool_paths;
+static MIGPOOL_FN _migpool_fn = NULL;
+static size_t _migpool_queued = 0;
+static size_t _migpool_running = 0;
+
+static unsigned long long now_us()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// with _migpool_mutex held
+static MIGPOOL_STORE_T * get_store(const string &store_path)
+{
+	map<string, MIGPOOL_STORE_T>::iterator mit = _migpool_stores.find(store_path);
+	if(mit == _migpool_stores.end()) {
+		MIGPOOL_STORE_T store;
+		store.limit = MIGPOOL_STORE_LIMIT_DEFAULT;
+		store.active = 0;
+		store.files = 0;
+		store.bytes = 0;
+		mit = _migpool_stores.insert(make_pair(store_path, store)).first;
+	}
+	return &mit->second;
+}
+
+/*
+ * with _migpool_mutex held
+ * Front task of the least busy source store whose task has a free slot on
+ * both stores, NULL if none can run. Nothing is taken from behind a front
+ * task that has to wait.
+ */
+static MIGPOOL_TASK_T * take_task()
+{
+	MIGPOOL_STORE_T * best = NULL;
+	int best_load = 0;
+
+	map<string, MIGPOOL_STORE_T>::iterator mit;
+	for(mit = _migpool_stores.begin(); mit != _migpool_stores.end(); mit++) {
+		MIGPOOL_STORE_T * from = &mit->second;
+		if(from->tasks.empty() || from->active >= from->limit) {
+			continue;
+		}
+		MIGPOOL_STORE_T * to = get_store(from->tasks.front()->to_store);
+		if(to->active >= to->limit) {
+			continue;
+		}
+
+		int load = from->active + to->active;
+		if(!best || load < best_load) {
+			best = from;
+			best_load = load;
+			if(load == 0) {
+				break;
+			}
+		}
+	}
+	if(!best) {
+		return NULL;
+	}
+
+	MIGPOOL_TASK_T * task = best->tasks.front();
+	best->tasks.pop_front();
+	best->active++;
+	get_store(task->to_store)->active++;
+	_migpool_queued--;
+	_migpool_running++;
+
+	return task;
+}
+
+static void * migpool_threadmain(void * arg)
+{
+	MIGPOOL_WORKER_T * worker = (MIGPOOL_WORKER_T *)arg;
+
+	while(1) {
+		MIGPOOL_TASK_T * task;
+		{
+			AutoLock lock(&_migpool_mutex);
+			while(!(task = take_task())) {
+				pthread_cond_wait(&_migpool_work_cond, &_migpool_mutex);
+			}
+		}
+
+		off_t bytes = 0;
+		unsigned long long start = now_us();
+		int ret = _migpool_fn(task->path, task->pp_entry, task->from_store, task->to_store, &bytes);
+		unsigned long long elapsed = now_us() - start;
+
+		{
+			AutoLock lock(&_migpool_mutex);
+			MIGPOOL_STORE_T * from = get_store(task->from_store);
+			MIGPOOL_STORE_T * to = get_store(task->to_store);
+			from->active--;
+			to->active--;
+			if(ret == 0) {
+				worker->files++;
+				worker->bytes += bytes;
+				from->files++;
+				from->bytes += bytes;
+				to->files++;
+				to->bytes += bytes;
+			} else {
+				worker->failures++;
+			}
+			worker->busy_us += elapsed;
+			_migpool_paths.erase(task->path);
+			_migpool_running--;
+
+			// Slots freed, someone else's task may be runnable now
+			pthread_cond_broadcast(&_migpool_work_cond);
+			pthread_cond_broadcast(&_migpool_done_cond);
+		}
+
+		delete task;
+	}
+
+	return NULL;
+}
+
+// with _migpool_mutex held
+static void migpool_load_limits()
+{
+	ifstream file;
+	file.open(MIGPOOL_LIMITS_FILE.c_str());
+	if(file.fail()) {
+		return;
+	}
+
+	string line;
+	while(getline(file, line)) {
+		size_t pos1 = line.find(',');
+		if(pos1 == string::npos) {
+			continue;
+		}
+		int limit = atoi(line.substr(pos1 + 1).c_str());
+		if(limit <= 0) {
+			log_msg(LOG_LEVEL_ERROR, "migpool_load_limits: invalid limit, skipping: %s\n", line.c_str());
+			continue;
+		}
+		get_store(line.substr(0, pos1))->limit = limit;
+		log_msg(LOG_LEVEL_ERROR, "migpool_load_limits: %s -> %d\n", line.substr(0, pos1).c_str(), limit);
+	}
+}
+
+int migpool_start(int nworkers, MIGPOOL_FN fn)
+{
+	AutoLock lock(&_migpool_mutex);
+
+	if(!_migpool_workers.empty()) {
+		return 0;
+	}
+	_migpool_fn = fn;
+	migpool_load_limits();
+
+	for(int i = 0; i < nworkers; i++) {
+		MIGPOOL_WORKER_T * worker = new MIGPOOL_WORKER_T();
+		worker->id = i;
+		worker->files = 0;
+		worker->failures = 0;
+		worker->bytes = 0;
+		worker->busy_us = 0;
+		if(pthread_create(&worker->thread, NULL, migpool_threadmain, worker)) {
+			log_msg(LOG_LEVEL_ERROR, "migpool_start: cannot start worker %d\n", i);
+			delete worker;
+			break;
+		}
+		pthread_detach(worker->thread);
+		_migpool_workers.push_back(worker);
+	}
+
+	if(_migpool_workers.empty()) {
+		return -1;
+	}
+
+	log_msg(LOG_LEVEL_ERROR, "migpool_start: %lu workers\n", (unsigned long)_migpool_workers.size());
+	return 0;
+}
+
+int migpool_submit(const string &path, const PP_ENTRY_T &pp_entry, const string &from_store, const string &to_store)
+{
+	AutoLock lock(&_migpool_mutex);
+
+	if(_migpool_workers.empty()) {
+		return -1;
+	}
+	if(_migpool_paths.count(path)) {
+		return 1;
+	}
+
+	while(_migpool_queued >= _migpool_workers.size() * MIGPOOL_QUEUE_PER_WORKER) {
+		pthread_cond_wait(&_migpool_done_cond, &_migpool_mutex);
+	}
+
+	MIGPOOL_TASK_T * task = new MIGPOOL_TASK_T();
+	task->path = path;
+	task->pp_entry = pp_entry;
+	task->from_store = from_store;
+	task->to_store = to_store;
+
+	get_store(from_store)->tasks.push_back(task);
+	_migpool_paths.insert(path);
+	_migpool_queued++;
+
+	pthread_cond_broadcast(&_migpool_work_cond);
+	return 0;
+}
+
+void migpool_drain()
+{
+	AutoLock lock(&_migpool_mutex);
+
+	while(_migpool_queued > 0 || _migpool_running > 0) {
+		pthread_cond_wait(&_migpool_done_cond, &_migpool_mutex);
+	}
+}
+
+void migpool_set_store_limit(const char * store_path, int limit)
+{
+	AutoLock lock(&_migpool_mutex);
+
+	get_store(store_path)->limit = limit;
+	log_msg(LOG_LEVEL_ERROR, "migpool_set_store_limit: %s -> %d\n", store_path, limit);
+
+	pthread_cond_broadcast(&_migpool_work_cond);
+}
+
+int migpool_dump_to_log()
+{
+	AutoLock lock(&_migpool_mutex);
+
+	log_msg(LOG_LEVEL_ERROR, "\nmigpool: %lu queued, %lu running\n",
+		(unsigned long)_migpool_queued, (unsigned long)_migpool_running);
+
+	for(size_t w = 0; w < _migpool_workers.size(); w++) {
+		MIGPOOL_WORKER_T * worker = _migpool_workers[w];
+		log_msg(LOG_LEVEL_ERROR, "migpool worker %d: %lu files, %llu bytes, %lu failures, %llu ms busy\n",
+			worker->id, worker->files, worker->bytes, worker->failures, worker->busy_us / 1000);
+	}
+
+	map<string, MIGPOOL_STORE_T>::const_iterator mit;
+	for(mit = _migpool_stores.begin(); mit != _migpool_stores.end(); mit++) {
+		log_msg(LOG_LEVEL_ERROR, "migpool store %s: %d/%d active, %lu queued, %lu files, %llu bytes\n",
+			mit->first.c_str(), mit->second.active, mit->second.limit,
+			(unsigned long)mit->second.tasks.size(), mit->second.files, mit->second.bytes);
+	}
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef __MIG_POOL_H__
+#define __MIG_POOL_H__
+
+#include <sys/types.h>
+
+#include <string>
+
+#include "postprocess.h"
+
+using namespace std;
+
+/*
+ * Migration worker pool.
+ *
+ * Tasks queue per source store and leave each queue from the front, in
+ * submit order, so a batch ppd submitted in disk order is read in disk
+ * order. A task needs a slot on both its source and target store; a free
+ * worker takes the front task of the least busy store that has both, so
+ * stores migrate in parallel and one slow store can't starve the others.
+ */
+#define MIGPOOL_WORKERS 8
+// Submit blocks past this many queued tasks per worker
+#define MIGPOOL_QUEUE_PER_WORKER 64
+// Concurrent migrations from or to one store, unless configured
+#define MIGPOOL_STORE_LIMIT_DEFAULT 2
+// "store,limit" per line
+#define MIGPOOL_LIMITS_FILE (STORE_ROOT + "/.migrate.limits")
+
+/*
+ * Runs one queued migration, bytes is what it moved. 0 on success,
+ * updating the objmap and the queue entry is up to the callee.
+ */
+typedef int (*MIGPOOL_FN)(const string &path, const PP_ENTRY_T &pp_entry, const string &from_store, const string &to_store, off_t * bytes);
+
+// Once per process, later calls are no-ops
+extern int migpool_start(int nworkers, MIGPOOL_FN fn);
+// 1 (and nothing queued) while path is already queued or running
+extern int migpool_submit(const string &path, const PP_ENTRY_T &pp_entry, const string &from_store, const string &to_store);
+// Waits until everything submitted so far has run
+extern void migpool_drain();
+extern void migpool_set_store_limit(const char * store_path, int limit);
+extern int migpool_dump_to_log();
+
+#endif
@@ -0,0 +1,138 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "migpool.h"
+#include "ppd.h"
+#include "store.h"
+#include "utils.h"
+
+using namespace std;
+
+#define TEST_DIRS 4
+#define TEST_FILES_PER_DIR 16
+
+static pthread_mutex_t _test_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Paths in the order the pool handed them out, per source store
+static map<string, vector<string> > _dispatched;
+
+static int record_task(const string &path, const PP_ENTRY_T &pp_entry, const string &from_store, const string &to_store, off_t * bytes)
+{
+	{
+		AutoLock lock(&_test_mutex);
+		_dispatched[from_store].push_back(path);
+	}
+	// Long enough for the other store's tasks to run alongside
+	usleep(1000);
+	*bytes = 0;
+	return 0;
+}
+
+// Files of varying sizes, created out of name order. Paths are unique across stores.
+static int make_store(const string &store, int id, vector<string> &objs, vector<PP_ENTRY_T> &entries)
+{
+	char buf[8192];
+	memset(buf, 'x', sizeof(buf));
+
+	if(mkdir(store.c_str(), 0755) != 0) {
+		return -1;
+	}
+	for(int d = 0; d < TEST_DIRS; d++) {
+		char dir[64];
+		snprintf(dir, sizeof(dir), "/d%d.%d", id, (d * 3) % TEST_DIRS);
+		if(mkdir((store + dir).c_str(), 0755) != 0) {
+			return -1;
+		}
+		for(int f = 0; f < TEST_FILES_PER_DIR; f++) {
+			char obj[128];
+			snprintf(obj, sizeof(obj), "%s/f%02d", dir, (f * 7) % TEST_FILES_PER_DIR);
+			int fd = open((store + obj).c_str(), O_CREAT | O_WRONLY, 0644);
+			if(fd < 0 || write(fd, buf, 512 * (1 + f % 16)) < 0 || fsync(fd) != 0) {
+				return -1;
+			}
+			close(fd);
+
+			PP_ENTRY_T entry;
+			entry.store_path[0] = store;
+			entry.state = 0;
+			entry.obj_id = objs.size();
+			entry.enqueue_time = 0;
+			objs.push_back(obj);
+			entries.push_back(entry);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[])
+{
+	char root[] = "/tmp/migpool_test.XXXXXX";
+	if(mkdtemp(root) == NULL || store_init(root) != 0) {
+		fprintf(stderr, "migpool_test: setup failed\n");
+		return 1;
+	}
+
+	string stores[2] = { string(root) + "/s1", string(root) + "/s2" };
+	vector<string> objs[2];
+	vector<PP_ENTRY_T> entries[2];
+	vector<size_t> order[2];
+	for(int s = 0; s < 2; s++) {
+		if(make_store(stores[s], s, objs[s], entries[s]) != 0) {
+			fprintf(stderr, "migpool_test: cannot create %s\n", stores[s].c_str());
+			return 1;
+		}
+		ppd_sort_batch(objs[s], entries[s], order[s]);
+		// One slot per source store, so dispatch order is what the callee sees
+		migpool_set_store_limit(stores[s].c_str(), 1);
+	}
+	migpool_set_store_limit("target", MIGPOOL_WORKERS);
+
+	if(migpool_start(MIGPOOL_WORKERS, record_task) != 0) {
+		fprintf(stderr, "migpool_test: cannot start the pool\n");
+		return 1;
+	}
+
+	// Interleaved, as ppd submits one batch after another
+	for(size_t n = 0; n < order[0].size(); n++) {
+		for(int s = 0; s < 2; s++) {
+			size_t i = order[s][n];
+			migpool_submit(objs[s][i], entries[s][i], stores[s], "target");
+		}
+	}
+	migpool_drain();
+
+	int failed = 0;
+	for(int s = 0; s < 2; s++) {
+		const vector<string> &dispatched = _dispatched[stores[s]];
+		if(dispatched.size() != order[s].size()) {
+			fprintf(stderr, "FAIL: %s: %lu of %lu dispatched\n", stores[s].c_str(),
+				(unsigned long)dispatched.size(), (unsigned long)order[s].size());
+			failed++;
+			continue;
+		}
+		for(size_t n = 0; n < order[s].size(); n++) {
+			if(dispatched[n] != objs[s][order[s][n]]) {
+				fprintf(stderr, "FAIL: %s: #%lu is %s, sort_batch had %s\n", stores[s].c_str(),
+					(unsigned long)n, dispatched[n].c_str(), objs[s][order[s][n]].c_str());
+				failed++;
+				break;
+			}
+		}
+	}
+
+	string cmd = string("rm -rf ") + root;
+	if(system(cmd.c_str()) != 0) {
+		fprintf(stderr, "migpool_test: cannot remove %s\n", root);
+	}
+
+	printf("migpool_test: %s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
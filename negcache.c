@@ -0,0 +1,55 @@
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#include "log.h"
+#include "shardmap.h"
+
+#include "negcache.h"
+
+using namespace std;
+
+// path -> expiry time
+static ShardMap<time_t, NEGCACHE_SHARDS, NEGCACHE_SHARD_MAX_ENTRIES> _negcache;
+
+unsigned long negcache_gen(const char * obj)
+{
+	return _negcache.gen(obj);
+}
+
+int negcache_lookup(const char * obj)
+{
+	if(!obj) {
+		return 0;
+	}
+
+	time_t expiry;
+	return (_negcache.get(obj, expiry) && expiry > time(NULL)) ? 1 : 0;
+}
+
+int negcache_add(const char * obj, unsigned long gen)
+{
+	if(!obj) {
+		return -1;
+	}
+
+	return _negcache.set(obj, time(NULL) + NEGCACHE_TTL, gen) ? 0 : -1;
+}
+
+int negcache_invalidate(const char * obj)
+{
+	if(!obj) {
+		return -1;
+	}
+
+	_negcache.del(obj);
+	return 0;
+}
+
+void negcache_invalidate_all()
+{
+	log_msg(LOG_LEVEL_DEBUG, "negcache_invalidate_all\n");
+
+	_negcache.clear();
+}
@@ -0,0 +1,24 @@
+#ifndef __NEG_CACHE_H__
+#define __NEG_CACHE_H__
+
+// Negative lookup cache: remembers paths that getattr found missing, so
+// repeated probes from Samba/build tools are answered without objmap and
+// lstat() round-trips. Bounded per shard (a ShardMap, see shardmap.h) and
+// aged out after NEGCACHE_TTL.
+#define NEGCACHE_SHARDS 64
+#define NEGCACHE_SHARD_MAX_ENTRIES 4096
+#define NEGCACHE_TTL 30
+
+extern unsigned long negcache_gen(const char * obj);
+extern int negcache_lookup(const char * obj);
+/*
+ * gen is the value of negcache_gen() taken BEFORE the lookup that failed,
+ * a create racing with the failed lookup bumps it and the add is dropped.
+ */
+extern int negcache_add(const char * obj, unsigned long gen);
+// A name appeared at obj (create, mknod, symlink, mkdir, link, rename target)
+extern int negcache_invalidate(const char * obj);
+// A whole subtree may have appeared (directory rename)
+extern void negcache_invalidate_all();
+
+#endif
@@ -1,169 +1,429 @@
+#include <pthread.h>
+
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <string>
 
 #include "log.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "utils.h"
 
+#include "metadb.h"
+#include "metatxn.h"
+#include "negcache.h"
 #include "objmap.h"
+#include "pathcache.h"
+#include "storereg.h"
+#ifdef OBJMAP_MIRROR
+#include "objmirror.h"
+#endif
 
 using namespace std;
 
-leveldb::DB* _objmap = NULL;
+static unsigned long _objmap_epoch = 0;
+
+// "\x01d" + parent + '\0' + name -> "", one per object
+#define OBJMAP_INDEX_PREFIX (string(1, OBJMAP_INTERNAL_KEY_PREFIX) + "d")
+// Present once every object of the DB has its index entry
+#define OBJMAP_INDEX_VERSION_KEY (string(1, OBJMAP_INTERNAL_KEY_PREFIX) + "v")
+#define OBJMAP_INDEX_VERSION "1"
+// Last object indexed by the online migration, to resume after a restart
+#define OBJMAP_INDEX_CURSOR_KEY (string(1, OBJMAP_INTERNAL_KEY_PREFIX) + "m")
+#define OBJMAP_INDEX_MIGRATE_BATCH 4096
 
-//#ifdef CACHE_MODE
-leveldb::DB* _objmap_L2 = NULL;
-//#endif
+/*
+ * Per level (index 1 and 2). Until _objmap_indexed is set objmap_list() keeps
+ * doing the full scan. While the migration runs, writers take
+ * _objmap_index_mutex so the migration never indexes an object that was
+ * deleted under it.
+ */
+static volatile int _objmap_indexed[3] = {0, 0, 0};
+static volatile int _objmap_migrating = 0;
+static pthread_mutex_t _objmap_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t _objmap_migrate_thread;
 
-void * objmap_hdl(int level)
+bool objmap_is_internal_key(const string &key)
 {
-	if(level == 2)
-	{
-		return (void *)_objmap_L2;
+	return !key.empty() && key[0] == OBJMAP_INTERNAL_KEY_PREFIX;
+}
+
+static int get_table(int level, METADB_TABLE_T &table)
+{
+	switch(level) {
+		case 1:
+			table = METADB_OBJMAP_L1;
+			return 0;
+		case 2:
+			table = METADB_OBJMAP_L2;
+			return 0;
+		default:
+			return -1;
 	}
+}
 
-	return (void *)_objmap;
+static string index_dir_key(const string &parent)
+{
+	string key = OBJMAP_INDEX_PREFIX;
+	key += parent;
+	key += '\0';
+	return key;
+}
+
+// "/a/b" -> "\x01d/a\0b", false for "/" or anything without a basename
+static bool index_key(const string &obj, string &key)
+{
+	size_t preLoc = obj.find_last_of("/");
+	if(preLoc == string::npos || preLoc + 1 == obj.size()) {
+		return false;
+	}
+
+	key = index_dir_key(preLoc == 0 ? "/" : obj.substr(0, preLoc));
+	key += obj.substr(preLoc + 1);
+	return true;
+}
+
+static void * objmap_migrate_threadmain(void * arg);
+
+unsigned long objmap_epoch()
+{
+	return __sync_fetch_and_add(&_objmap_epoch, 0);
 }
 
 int objmap_init()
 {
-	// Set up database connection information and open database
-	leveldb::Options options;
-	options.create_if_missing = true;
-	leveldb::Status status;
-	
-	status = leveldb::DB::Open(options, OBJMAP_DB, &_objmap);
-	
-	if (false == status.ok())
+	// Both levels are tables of the metadata DB
+	if (metadb_init() != 0)
 	{
-	    cerr << "Unable to open objmap database "<< OBJMAP_DB << endl;
-	    cerr << status.ToString() << endl;
+	    cerr << "Unable to open objmap database "<< METADB_DB << endl;
 	    return -1;
 	}
-	
-//#ifdef CACHE_MODE
-	status = leveldb::DB::Open(options, OBJMAP_DB2, &_objmap_L2);
-	
-	if (false == status.ok())
+	leveldb::Status status;
+
+	if (storereg_init() != 0)
 	{
-	    cerr << "Unable to open objmap database "<< OBJMAP_DB2 << endl;
-	    cerr << status.ToString() << endl;
-	    return -1;
+		log_msg(LOG_LEVEL_ERROR, "objmap_init: cannot load the store registry\n");
+		return -1;
+	}
+
+#ifdef OBJMAP_MIRROR
+	// Lookups are served from memory once a level is loaded
+	for(int level = 1; level <= 2; level++) {
+		objmirror_load(level);
+	}
+	objmirror_report();
+#endif
+
+	// Build the directory index of older databases in the background
+	int need_migrate = 0;
+	for(int level = 1; level <= 2; level++) {
+		string version;
+		METADB_TABLE_T table;
+		get_table(level, table);
+		status = metadb_get(table, OBJMAP_INDEX_VERSION_KEY, &version);
+		if(status.ok() && version == OBJMAP_INDEX_VERSION) {
+			_objmap_indexed[level] = 1;
+		} else {
+			need_migrate = 1;
+		}
+	}
+
+	if(need_migrate) {
+		_objmap_migrating = 1;
+		if(pthread_create(&_objmap_migrate_thread, NULL, objmap_migrate_threadmain, NULL)) {
+			log_msg(LOG_LEVEL_ERROR, "objmap_init: cannot start index migration, listing by full scan\n");
+			_objmap_migrating = 0;
+		} else {
+			pthread_detach(_objmap_migrate_thread);
+		}
 	}
-//#endif
 
 	return 0;
 }
 
-int objmap_set(const char * obj, const char * dest, int level)
+/*
+ * Index one DB chunk by chunk. Each chunk re-checks its objects and
+ * saves the cursor in the same batch, under the writers' lock.
+ */
+static int objmap_migrate_level(int level)
 {
-	// Add 256 values to the database
-	leveldb::WriteOptions writeOptions;
-	leveldb::Status status;
-	switch(level) {
-		case 1:
-			status = _objmap->Put(writeOptions, obj, dest);
-			break;
-		case 2:
-			status = _objmap_L2->Put(writeOptions, obj, dest);
-			break;
-		default:
+	METADB_TABLE_T table;
+	string cursor;
+	unsigned long indexed = 0;
+
+	if(get_table(level, table) != 0) {
+		return -1;
+	}
+	metadb_get(table, OBJMAP_INDEX_CURSOR_KEY, &cursor);
+	log_msg(LOG_LEVEL_ERROR, "objmap_migrate_level: indexing level %d from \"%s\"\n", level, cursor.c_str());
+
+	while(1) {
+		vector<string> objs;
+		leveldb::Iterator* it = metadb_iterator(table);
+		if(cursor.empty()) {
+			it->SeekToFirst();
+		} else {
+			it->Seek(cursor);
+			if(it->Valid() && it->key().ToString() == cursor) {
+				it->Next();
+			}
+		}
+		for(; it->Valid() && objs.size() < OBJMAP_INDEX_MIGRATE_BATCH; it->Next()) {
+			string key = it->key().ToString();
+			if(!objmap_is_internal_key(key)) {
+				objs.push_back(key);
+			}
+		}
+		bool done = !it->Valid();
+		leveldb::Status status = it->status();
+		delete it;
+
+		if(!status.ok()) {
+			log_msg(LOG_LEVEL_ERROR, "objmap_migrate_level: scan failed: %s\n", status.ToString().c_str());
+			return -1;
+		}
+
+		AutoLock lock(&_objmap_index_mutex);
+		leveldb::WriteBatch batch;
+		vector<string>::const_iterator vit;
+		for(vit = objs.begin(); vit != objs.end(); vit++) {
+			string dbval, ikey;
+			if(metadb_get(table, *vit, &dbval).ok() && index_key(*vit, ikey)) {
+				metadb_batch_put(&batch, table, ikey, "");
+			}
+		}
+		if(!objs.empty()) {
+			cursor = objs.back();
+			metadb_batch_put(&batch, table, OBJMAP_INDEX_CURSOR_KEY, cursor);
+		}
+		if(done) {
+			metadb_batch_delete(&batch, table, OBJMAP_INDEX_CURSOR_KEY);
+			metadb_batch_put(&batch, table, OBJMAP_INDEX_VERSION_KEY, OBJMAP_INDEX_VERSION);
+		}
+		status = metadb_write(&batch);
+		if(!status.ok()) {
+			log_msg(LOG_LEVEL_ERROR, "objmap_migrate_level: write failed: %s\n", status.ToString().c_str());
 			return -1;
+		}
+		indexed += objs.size();
+
+		if(done) {
+			break;
+		}
 	}
 
-	if (false == status.ok())
-	{
+	log_msg(LOG_LEVEL_ERROR, "objmap_migrate_level: level %d indexed, %lu objects\n", level, indexed);
+	return 0;
+}
+
+static void * objmap_migrate_threadmain(void * arg)
+{
+	for(int level = 1; level <= 2; level++) {
+		if(!_objmap_indexed[level] && objmap_migrate_level(level) == 0) {
+			_objmap_indexed[level] = 1;
+		}
+	}
+
+	AutoLock lock(&_objmap_index_mutex);
+	_objmap_migrating = 0;
+
+	return NULL;
+}
+
+/*
+ * Values are OBJMAP_VALUE_TAG, the store id and flags as varints.
+ * Entries written before the registry hold the store path itself.
+ */
+static int objmap_encode_value(const char * dest, string &value)
+{
+	uint32_t id;
+	if(storereg_id(dest, id) != 0) {
 		return -1;
 	}
 
+	value = OBJMAP_VALUE_TAG;
+	put_varint32(value, id);
+	put_varint32(value, 0); // flags, none defined yet
 	return 0;
 }
 
-int objmap_get(const char * obj, string &destStr, int level)
+int objmap_decode_value(const string &value, string &destStr)
+{
+	if(value.empty() || value[0] != OBJMAP_VALUE_TAG) {
+		destStr = value;
+		return 0;
+	}
+
+	const char * p = value.data() + 1;
+	const char * limit = value.data() + value.size();
+	uint32_t id, flags;
+	if(!get_varint32(p, limit, id) || !get_varint32(p, limit, flags)) {
+		log_msg(LOG_LEVEL_ERROR, "objmap_decode_value: corrupt value\n");
+		return -1;
+	}
+
+	return storereg_path(id, destStr);
+}
+
+// obj and its directory index entry always go in the same batch, no value deletes
+static void objmap_batch(leveldb::WriteBatch * batch, METADB_TABLE_T table, const char * obj, const string * value)
+{
+	string ikey;
+
+	if(value) {
+		metadb_batch_put(batch, table, obj, *value);
+	} else {
+		metadb_batch_delete(batch, table, obj);
+	}
+	if(index_key(obj, ikey)) {
+		if(value) {
+			metadb_batch_put(batch, table, ikey, "");
+		} else {
+			metadb_batch_delete(batch, table, ikey);
+		}
+	}
+}
+
+// Runs after the write, so a racing reader cannot cache the old store, or
+// the ENOENT it saw while a migration moved obj
+static void objmap_invalidate(const string &obj)
+{
+	__sync_fetch_and_add(&_objmap_epoch, 1);
+	pathcache_del(obj.c_str());
+	negcache_invalidate(obj.c_str());
+}
+
+#ifdef OBJMAP_MIRROR
+// A transaction may touch both levels, the hook only knows the obj
+static void objmap_mirror_refresh(const string &obj)
+{
+	objmirror_refresh(obj.c_str(), 1);
+	objmirror_refresh(obj.c_str(), 2);
+}
+#endif
+
+/*
+ * Only serialized against the index migration, and only while it runs.
+ */
+int objmap_write_batch(leveldb::WriteBatch * batch)
 {
-	// Add 256 values to the database
-	leveldb::ReadOptions readOptions;
 	leveldb::Status status;
-	
-	switch(level) {
-		case 1:
-			status = _objmap->Get(readOptions, obj, &destStr);
-			break;
-		case 2:
-			status = _objmap_L2->Get(readOptions, obj, &destStr);
-			break;
-		default:
-			return -1;
+	if(_objmap_migrating) {
+		AutoLock lock(&_objmap_index_mutex);
+		status = metadb_write(batch);
+	} else {
+		status = metadb_write(batch);
 	}
-	
+
 	if (false == status.ok())
 	{
+		log_msg(LOG_LEVEL_ERROR, "objmap_write_batch: %s\n", status.ToString().c_str());
 		return -1;
 	}
-	
+
 	return 0;
 }
 
-int objmap_del(const char * obj, int level)
+static int objmap_write(const char * obj, const char * dest, int level, META_TXN_T * txn)
 {
-	// Add 256 values to the database
-	leveldb::WriteOptions writeOptions;
-	leveldb::Status status;
+	METADB_TABLE_T table;
+	if(get_table(level, table) != 0) {
+		return -1;
+	}
 
-	switch(level) {
-		case 1:
-			status = _objmap->Delete(writeOptions, obj);
-			break;
-		case 2:
-			status = _objmap_L2->Delete(writeOptions, obj);
-			break;
-		default:
+	string value;
+	if(dest) {
+		if(objmap_encode_value(dest, value) != 0) {
 			return -1;
+		}
 	}
-	
-	if (false == status.ok())
-	{
+
+	if(txn) {
+		objmap_batch(metatxn_batch(txn), table, obj, dest ? &value : NULL);
+#ifdef OBJMAP_MIRROR
+		metatxn_on_commit(txn, objmap_mirror_refresh, obj);
+#endif
+		metatxn_on_commit(txn, objmap_invalidate, obj);
+		return 0;
+	}
+
+	leveldb::WriteBatch batch;
+	objmap_batch(&batch, table, obj, dest ? &value : NULL);
+	int ret = objmap_write_batch(&batch);
+#ifdef OBJMAP_MIRROR
+	objmirror_refresh(obj, level);
+#endif
+	objmap_invalidate(obj);
+
+	return ret;
+}
+
+int objmap_set(const char * obj, const char * dest, int level, META_TXN_T * txn)
+{
+	if(!dest) {
 		return -1;
 	}
 
-	return 0;
+	return objmap_write(obj, dest, level, txn);
 }
 
-int objmap_list(const char * prefix, vector<string>& obj_list, int level)
+int objmap_get(const char * obj, string &destStr, int level)
 {
-	// Except for root "/"
-	// the prefix comes without trailling seperator, for example:
-	// "/this_is_a_folder"
-	//
-	// we need to return the basename of following:
-	// /this_is_a_folder/this_is_file.txt
-	// /this_is_file.txt
+	METADB_TABLE_T table;
+	if(get_table(level, table) != 0) {
+		return -1;
+	}
 
+	string value;
 
-	if(!prefix) {
+#ifdef OBJMAP_MIRROR
+	if(objmirror_loaded(level)) {
+		if(objmirror_get(obj, value, level) != 0) {
+			return -1;
+		}
+		return objmap_decode_value(value, destStr);
+	}
+#endif
+
+	leveldb::Status status = metadb_get(table, obj, &value);
+	
+	if (false == status.ok())
+	{
 		return -1;
 	}
-	// @todo: You think I don't know the performance here is poor..?
 	
-	leveldb::DB* objmap = NULL;
-	switch(level) {
-		case 1:
-			objmap = _objmap;
-			break;
-		case 2:
-			objmap = _objmap_L2;
-			break;
-		default:
-			return -1;
+	return objmap_decode_value(value, destStr);
+}
+
+int objmap_relocate_store(const char * old_path, const char * new_path)
+{
+	if(storereg_relocate(old_path, new_path) != 0) {
+		return -1;
 	}
 
-	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = objmap->NewIterator(leveldb::ReadOptions());
+	__sync_fetch_and_add(&_objmap_epoch, 1);
+	pathcache_clear();
+	negcache_invalidate_all();
+	return 0;
+}
+
+int objmap_del(const char * obj, int level, META_TXN_T * txn)
+{
+	return objmap_write(obj, NULL, level, txn);
+}
+
+// Pre-index layout: every key is visited and matched by its dirname
+static void objmap_list_scan(leveldb::Iterator* it, const char * prefix, vector<string>& obj_list)
+{
 	size_t prefix_len = strlen(prefix);
 	
 	for (it->SeekToFirst(); it->Valid(); it->Next())
 	{
 		string keyStr = it->key().ToString();
+		if(objmap_is_internal_key(keyStr)) {
+			continue;
+		}
 		size_t preLoc = keyStr.find_last_of("/");
 		
 		if(preLoc != string::npos
@@ -180,6 +440,45 @@ int objmap_list(const char * prefix, vector<string>& obj_list, int level)
 			obj_list.push_back(leftStr);
 		}
 	}
+}
+
+int objmap_list(const char * prefix, vector<string>& obj_list, int level)
+{
+	// Except for root "/"
+	// the prefix comes without trailling seperator, for example:
+	// "/this_is_a_folder"
+	//
+	// we need to return the basename of following:
+	// /this_is_a_folder/this_is_file.txt
+	// /this_is_file.txt
+
+
+	if(!prefix) {
+		return -1;
+	}
+
+	METADB_TABLE_T table;
+	if(get_table(level, table) != 0) {
+		return -1;
+	}
+
+	leveldb::Iterator* it = metadb_iterator(table);
+
+	if(_objmap_indexed[level]) {
+		string parent = prefix;
+		if(parent.size() > 1 && parent[parent.size() - 1] == '/') {
+			parent.erase(parent.size() - 1);
+		}
+		string dir_key = index_dir_key(parent);
+
+		// Only this directory's entries, sorted by name
+		for (it->Seek(dir_key); it->Valid() && it->key().starts_with(dir_key); it->Next())
+		{
+			obj_list.push_back(it->key().ToString().substr(dir_key.size()));
+		}
+	} else {
+		objmap_list_scan(it, prefix, obj_list);
+	}
 	
 	if (false == it->status().ok())
 	{
@@ -192,36 +491,93 @@ int objmap_list(const char * prefix, vector<string>& obj_list, int level)
 	return 0;
 }
 
-int objmap_dump_to_log(int level)
+struct OBJMAP_DIR_T
 {
-	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = NULL;
-	if(level == 1)
-	{
-		it = _objmap->NewIterator(leveldb::ReadOptions());
+	leveldb::Iterator * it;
+	string dir_key;
+	// Not indexed yet: the scanned list, sorted
+	vector<string> obj_list;
+	size_t next;
+};
+
+OBJMAP_DIR_T * objmap_opendir(const char * prefix, int level)
+{
+	METADB_TABLE_T table;
+	if(!prefix || get_table(level, table) != 0) {
+		return NULL;
 	}
-	else if(level == 2)
-	{
-		it = _objmap_L2->NewIterator(leveldb::ReadOptions());
-		
+
+	OBJMAP_DIR_T * dir = new OBJMAP_DIR_T();
+	dir->it = NULL;
+	dir->next = 0;
+
+	if(_objmap_indexed[level]) {
+		string parent = prefix;
+		if(parent.size() > 1 && parent[parent.size() - 1] == '/') {
+			parent.erase(parent.size() - 1);
+		}
+		dir->dir_key = index_dir_key(parent);
+		dir->it = metadb_iterator(table);
+		dir->it->Seek(dir->dir_key);
+	} else {
+		objmap_list(prefix, dir->obj_list, level);
+		sort(dir->obj_list.begin(), dir->obj_list.end());
+	}
+
+	return dir;
+}
+
+int objmap_readdir(OBJMAP_DIR_T * dir, string &name)
+{
+	if(!dir->it) {
+		if(dir->next >= dir->obj_list.size()) {
+			return 1;
+		}
+		name = dir->obj_list[dir->next++];
+		return 0;
+	}
+
+	if(!dir->it->Valid() || !dir->it->key().starts_with(dir->dir_key)) {
+		return 1;
+	}
+	name = dir->it->key().ToString().substr(dir->dir_key.size());
+	dir->it->Next();
+
+	return 0;
+}
+
+void objmap_closedir(OBJMAP_DIR_T * dir)
+{
+	if(dir) {
+		delete dir->it;
+		delete dir;
 	}
-	if(!it)
+}
+
+int objmap_dump_to_log(int level)
+{
+	// Iterate over each item in the database and print them
+	METADB_TABLE_T table;
+	if(get_table(level, table) != 0)
 	{
 		log_msg(LOG_LEVEL_ERROR, "\nobjmap_dump_to_log: db level %d not open, returning\n", level);
 		return -1;
 	}
 	
+	leveldb::Iterator* it = metadb_iterator(table);
+
 	log_msg(LOG_LEVEL_ERROR, "\nobjmap_dump_to_log: starting dumping level %d\n", level);
 	
-	for (it->SeekToFirst(); it->Valid(); it->Next())
+	for (it->Seek(string(1, OBJMAP_INTERNAL_KEY_PREFIX + 1)); it->Valid(); it->Next())
 	{
-		std::string log_entry;
+		std::string log_entry, dest;
+		objmap_decode_value(it->value().ToString(), dest);
 		log_entry = "";
 		log_entry += it->key().ToString();
 		log_entry += " : ";
-		log_entry += it->value().ToString();
+		log_entry += dest;
 		log_entry += "\n";
-	    cout << it->key().ToString() << " : " << it->value().ToString() << endl;
+	    cout << it->key().ToString() << " : " << dest << endl;
 	    log_msg(LOG_LEVEL_ERROR, "%s", log_entry.c_str());
 	}
 	
@@ -9,19 +9,45 @@
 
 using namespace std;
 
-#define OBJMAP_DB (STORE_ROOT + "/.objmap")
-
-//#ifdef CACHE_MODE
-#define OBJMAP_DB2 (STORE_ROOT + "/.objmap2")
-//#endif
+namespace leveldb { class WriteBatch; }
+struct META_TXN_T;
 
 extern int objmap_init();
-extern int objmap_set(const char * obj, const char * dest, int level = 1);
+// With a txn the write (and cache invalidation) happens at metatxn_commit()
+extern int objmap_set(const char * obj, const char * dest, int level = 1, META_TXN_T * txn = NULL);
 extern int objmap_get(const char * obj, string &destStr, int level = 1);
-extern int objmap_del(const char * obj, int level = 1);
+extern int objmap_del(const char * obj, int level = 1, META_TXN_T * txn = NULL);
+/*
+ * Stored values name the store by its registry id (see storereg.h). Anything
+ * reading the DB directly decodes them with objmap_decode_value().
+ */
+#define OBJMAP_VALUE_TAG '\x02'
+extern int objmap_decode_value(const string &value, string &destStr);
+// Moves every object of a store at once, only its registry entry changes
+extern int objmap_relocate_store(const char * old_path, const char * new_path);
+// Commits a metadata batch that may touch the objmap, used by metatxn_commit()
+extern int objmap_write_batch(leveldb::WriteBatch * batch);
 extern int objmap_list(const char * prefix, vector<string>& obj_list, int level);
+/*
+ * Besides obj -> store, each level carries a parent directory index so listing
+ * a directory is a Seek() instead of a full scan. Index and bookkeeping keys
+ * start with OBJMAP_INTERNAL_KEY_PREFIX and sort before every object path;
+ * anything iterating the DB directly has to skip them.
+ */
+#define OBJMAP_INTERNAL_KEY_PREFIX '\x01'
+extern bool objmap_is_internal_key(const string &key);
+
+/*
+ * Streams one directory's objects in name order, without building the list.
+ * Iterators see the DB as of objmap_opendir().
+ */
+struct OBJMAP_DIR_T;
+extern OBJMAP_DIR_T * objmap_opendir(const char * prefix, int level);
+// 0 and the next name, 1 at the end
+extern int objmap_readdir(OBJMAP_DIR_T * dir, string &name);
+extern void objmap_closedir(OBJMAP_DIR_T * dir);
 extern int objmap_dump_to_log(int level);
-
-extern void * objmap_hdl(int level);
+// Bumped on every objmap write, lets callers revalidate cached stores cheaply
+extern unsigned long objmap_epoch();
 
 #endif
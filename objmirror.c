@@ -0,0 +1,321 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "leveldb/db.h"
+#include "log.h"
+#include "metadb.h"
+#include "objmap.h"
+#include "utils.h"
+
+#include "objmirror.h"
+
+using namespace std;
+
+struct OBJMIRROR_ENTRY_T
+{
+	const char * path; // NULL: never used, _tombstone: deleted
+	uint32_t hash;
+	uint32_t value_id;
+};
+
+struct OBJMIRROR_T
+{
+	pthread_rwlock_t lock;
+	int loaded;
+
+	OBJMIRROR_ENTRY_T * slots;
+	size_t nslots;
+	size_t nentries;
+	size_t ntombstones;
+
+	// Interned paths, deleted ones stay until the arena is compacted
+	vector<char *> blocks;
+	size_t block_used;
+	size_t arena_bytes;
+	size_t dead_bytes;
+
+	// Values are few, entries only keep their id
+	vector<string> values;
+	map<string, uint32_t> value_ids;
+};
+
+static const char _tombstone[] = "";
+static OBJMIRROR_T _objmirror[3];
+static pthread_once_t _objmirror_once = PTHREAD_ONCE_INIT;
+
+static void objmirror_setup()
+{
+	for(int level = 1; level <= 2; level++) {
+		OBJMIRROR_T * mirror = &_objmirror[level];
+		pthread_rwlock_init(&mirror->lock, NULL);
+		mirror->loaded = 0;
+		mirror->nslots = OBJMIRROR_INITIAL_SLOTS;
+		mirror->slots = (OBJMIRROR_ENTRY_T *)calloc(mirror->nslots, sizeof(OBJMIRROR_ENTRY_T));
+		mirror->nentries = 0;
+		mirror->ntombstones = 0;
+		mirror->block_used = OBJMIRROR_ARENA_BLOCK;
+		mirror->arena_bytes = 0;
+		mirror->dead_bytes = 0;
+	}
+}
+
+static OBJMIRROR_T * get_mirror(int level)
+{
+	pthread_once(&_objmirror_once, objmirror_setup);
+	return (level == 1 || level == 2) ? &_objmirror[level] : NULL;
+}
+
+static const char * arena_intern(OBJMIRROR_T * mirror, const char * path)
+{
+	size_t len = strlen(path) + 1;
+
+	if(len > OBJMIRROR_ARENA_BLOCK) {
+		// Oversized, gets a block of its own
+		char * block = (char *)malloc(len);
+		mirror->blocks.push_back(block);
+		mirror->arena_bytes += len;
+		memcpy(block, path, len);
+		return block;
+	}
+
+	if(mirror->block_used + len > OBJMIRROR_ARENA_BLOCK) {
+		mirror->blocks.push_back((char *)malloc(OBJMIRROR_ARENA_BLOCK));
+		mirror->arena_bytes += OBJMIRROR_ARENA_BLOCK;
+		mirror->block_used = 0;
+	}
+
+	char * dest = mirror->blocks.back() + mirror->block_used;
+	memcpy(dest, path, len);
+	mirror->block_used += len;
+	return dest;
+}
+
+static uint32_t value_intern(OBJMIRROR_T * mirror, const string &value)
+{
+	map<string, uint32_t>::const_iterator mit = mirror->value_ids.find(value);
+	if(mit != mirror->value_ids.end()) {
+		return mit->second;
+	}
+
+	uint32_t id = mirror->values.size();
+	mirror->values.push_back(value);
+	mirror->value_ids[value] = id;
+	return id;
+}
+
+/*
+ * with the write lock held
+ * Slot holding path, or the first free one on its probe sequence
+ */
+static OBJMIRROR_ENTRY_T * find_slot(OBJMIRROR_T * mirror, const char * path, uint32_t hash, bool for_insert)
+{
+	size_t mask = mirror->nslots - 1;
+	OBJMIRROR_ENTRY_T * reuse = NULL;
+
+	for(size_t i = hash & mask; ; i = (i + 1) & mask) {
+		OBJMIRROR_ENTRY_T * slot = &mirror->slots[i];
+		if(!slot->path) {
+			return (for_insert && reuse) ? reuse : slot;
+		}
+		if(slot->path == _tombstone) {
+			if(!reuse) {
+				reuse = slot;
+			}
+		} else if(slot->hash == hash && strcmp(slot->path, path) == 0) {
+			return slot;
+		}
+	}
+}
+
+// Deleted and renamed paths take up more than half the arena
+static bool arena_mostly_dead(const OBJMIRROR_T * mirror)
+{
+	return mirror->dead_bytes >= OBJMIRROR_ARENA_BLOCK && mirror->dead_bytes * 2 > mirror->arena_bytes;
+}
+
+static void grow(OBJMIRROR_T * mirror)
+{
+	OBJMIRROR_ENTRY_T * old_slots = mirror->slots;
+	size_t old_nslots = mirror->nslots;
+
+	// Only grow for live entries, a table full of tombstones is just rebuilt
+	if((mirror->nentries + 1) * 2 > old_nslots) {
+		mirror->nslots = old_nslots * 2;
+	}
+	mirror->slots = (OBJMIRROR_ENTRY_T *)calloc(mirror->nslots, sizeof(OBJMIRROR_ENTRY_T));
+	mirror->ntombstones = 0;
+
+	// Live paths move to a fresh arena, the old one goes with the dead ones
+	vector<char *> old_blocks;
+	bool compact = arena_mostly_dead(mirror);
+	if(compact) {
+		old_blocks.swap(mirror->blocks);
+		mirror->block_used = OBJMIRROR_ARENA_BLOCK;
+		mirror->arena_bytes = 0;
+		mirror->dead_bytes = 0;
+	}
+
+	for(size_t i = 0; i < old_nslots; i++) {
+		OBJMIRROR_ENTRY_T entry = old_slots[i];
+		if(entry.path && entry.path != _tombstone) {
+			if(compact) {
+				entry.path = arena_intern(mirror, entry.path);
+			}
+			*find_slot(mirror, entry.path, entry.hash, true) = entry;
+		}
+	}
+
+	free(old_slots);
+	for(size_t i = 0; i < old_blocks.size(); i++) {
+		free(old_blocks[i]);
+	}
+}
+
+// with the write lock held
+static void mirror_set(OBJMIRROR_T * mirror, const char * obj, const string &dest)
+{
+	// Keep the load (entries + tombstones) under 70%, and the arena mostly live
+	if((mirror->nentries + mirror->ntombstones + 1) * 10 > mirror->nslots * 7
+		|| arena_mostly_dead(mirror)) {
+		grow(mirror);
+	}
+
+	uint32_t hash = hash_fnv1a(obj);
+	OBJMIRROR_ENTRY_T * slot = find_slot(mirror, obj, hash, true);
+	if(!slot->path || slot->path == _tombstone) {
+		if(slot->path == _tombstone) {
+			mirror->ntombstones--;
+		}
+		slot->path = arena_intern(mirror, obj);
+		slot->hash = hash;
+		mirror->nentries++;
+	}
+	slot->value_id = value_intern(mirror, dest);
+}
+
+// with the write lock held
+static void mirror_del(OBJMIRROR_T * mirror, const char * obj)
+{
+	OBJMIRROR_ENTRY_T * slot = find_slot(mirror, obj, hash_fnv1a(obj), false);
+	if(slot->path) {
+		mirror->dead_bytes += strlen(slot->path) + 1;
+		slot->path = _tombstone;
+		mirror->nentries--;
+		mirror->ntombstones++;
+	}
+}
+
+int objmirror_load(int level)
+{
+	OBJMIRROR_T * mirror = get_mirror(level);
+	METADB_TABLE_T table = (level == 1) ? METADB_OBJMAP_L1 : METADB_OBJMAP_L2;
+	if(!mirror) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&mirror->lock);
+
+	// The iterator reads one consistent snapshot of the objmap
+	leveldb::Iterator* it = metadb_iterator(table);
+	for (it->SeekToFirst(); it->Valid(); it->Next())
+	{
+		string key = it->key().ToString();
+		if(!objmap_is_internal_key(key)) {
+			mirror_set(mirror, key.c_str(), it->value().ToString());
+		}
+	}
+	int ret = it->status().ok() ? 0 : -1;
+	delete it;
+
+	mirror->loaded = (ret == 0);
+	pthread_rwlock_unlock(&mirror->lock);
+
+	if(ret != 0) {
+		log_msg(LOG_LEVEL_ERROR, "objmirror_load: level %d failed, serving from LevelDB\n", level);
+	}
+	return ret;
+}
+
+int objmirror_loaded(int level)
+{
+	OBJMIRROR_T * mirror = get_mirror(level);
+	return mirror && mirror->loaded;
+}
+
+int objmirror_get(const char * obj, string &value, int level)
+{
+	OBJMIRROR_T * mirror = get_mirror(level);
+	if(!mirror) {
+		return -1;
+	}
+
+	int ret = -1;
+	uint32_t hash = hash_fnv1a(obj);
+
+	pthread_rwlock_rdlock(&mirror->lock);
+	size_t mask = mirror->nslots - 1;
+	for(size_t i = hash & mask; mirror->slots[i].path; i = (i + 1) & mask) {
+		OBJMIRROR_ENTRY_T * slot = &mirror->slots[i];
+		if(slot->path != _tombstone && slot->hash == hash && strcmp(slot->path, obj) == 0) {
+			value = mirror->values[slot->value_id];
+			ret = 0;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&mirror->lock);
+
+	return ret;
+}
+
+void objmirror_refresh(const char * obj, int level)
+{
+	OBJMIRROR_T * mirror = get_mirror(level);
+	METADB_TABLE_T table = (level == 1) ? METADB_OBJMAP_L1 : METADB_OBJMAP_L2;
+	if(!mirror || !mirror->loaded) {
+		return;
+	}
+
+	// The read happens under the lock, so the last refresh always wins
+	pthread_rwlock_wrlock(&mirror->lock);
+	string dest;
+	if(metadb_get(table, obj, &dest).ok()) {
+		mirror_set(mirror, obj, dest);
+	} else {
+		mirror_del(mirror, obj);
+	}
+	pthread_rwlock_unlock(&mirror->lock);
+}
+
+void objmirror_report()
+{
+	for(int level = 1; level <= 2; level++) {
+		OBJMIRROR_T * mirror = get_mirror(level);
+
+		pthread_rwlock_rdlock(&mirror->lock);
+		size_t slot_bytes = mirror->nslots * sizeof(OBJMIRROR_ENTRY_T);
+		size_t value_bytes = 0;
+		for(size_t i = 0; i < mirror->values.size(); i++) {
+			value_bytes += mirror->values[i].size() + 1;
+		}
+		size_t total = slot_bytes + mirror->arena_bytes + value_bytes;
+		size_t per_million = mirror->nentries ? (size_t)((double)total / mirror->nentries * 1000000.0) : 0;
+
+		log_msg(LOG_LEVEL_ERROR, "objmirror level %d: %lu entries, %lu slots (%lu bytes), arena %lu bytes (%lu dead), %lu values, total %lu bytes, %lu MiB per million entries\n",
+			level,
+			(unsigned long)mirror->nentries,
+			(unsigned long)mirror->nslots,
+			(unsigned long)slot_bytes,
+			(unsigned long)mirror->arena_bytes,
+			(unsigned long)mirror->dead_bytes,
+			(unsigned long)mirror->values.size(),
+			(unsigned long)total,
+			(unsigned long)(per_million >> 20));
+		pthread_rwlock_unlock(&mirror->lock);
+	}
+}
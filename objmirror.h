@@ -0,0 +1,35 @@
+#ifndef __OBJ_MIRROR_H__
+#define __OBJ_MIRROR_H__
+
+#include <string>
+
+using namespace std;
+
+/*
+ * In-memory copy of the objmap, only built with -DOBJMAP_MIRROR.
+ *
+ * Per level, an open-addressing (linear probing) hash of path -> stored
+ * objmap value. Paths are interned in an append-only arena and the (few
+ * distinct) values in a small id table, so an entry is 16 bytes plus its
+ * path. Once deleted paths fill more than half the arena, the next insert
+ * rebuilds the table into a fresh one. Values stay encoded, objmap_get() decodes them. Loaded once from a snapshot
+ * of the objmap at mount, then kept in step by objmap writes; LevelDB stays
+ * the durable copy.
+ */
+#define OBJMIRROR_INITIAL_SLOTS 1024
+#define OBJMIRROR_ARENA_BLOCK (1 << 20)
+
+extern int objmirror_load(int level);
+extern int objmirror_loaded(int level);
+// 0 and the raw value on a hit, -1 if the objmap has no such obj
+extern int objmirror_get(const char * obj, string &value, int level);
+/*
+ * Re-read obj from the objmap and mirror what is there now. Called after
+ * every objmap write; refreshing (instead of applying the new value) keeps
+ * concurrent writers of the same obj from leaving a stale entry behind.
+ */
+extern void objmirror_refresh(const char * obj, int level);
+// Logs entries, bytes used and bytes per million entries
+extern void objmirror_report();
+
+#endif
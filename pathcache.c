@@ -0,0 +1,52 @@
+#include <string.h>
+
+#include <string>
+
+#include "log.h"
+#include "shardmap.h"
+
+#include "pathcache.h"
+
+using namespace std;
+
+static ShardMap<string, PATHCACHE_SHARDS, PATHCACHE_SHARD_MAX_ENTRIES> _pathcache;
+
+unsigned long pathcache_gen(const char * obj)
+{
+	return _pathcache.gen(obj);
+}
+
+int pathcache_get(const char * obj, string &destStr)
+{
+	if(!obj) {
+		return -1;
+	}
+
+	return _pathcache.get(obj, destStr) ? 0 : -1;
+}
+
+int pathcache_set(const char * obj, const char * dest, unsigned long gen)
+{
+	if(!obj || !dest) {
+		return -1;
+	}
+
+	return _pathcache.set(obj, dest, gen) ? 0 : -1;
+}
+
+int pathcache_del(const char * obj)
+{
+	if(!obj) {
+		return -1;
+	}
+
+	_pathcache.del(obj);
+	return 0;
+}
+
+void pathcache_clear()
+{
+	log_msg(LOG_LEVEL_DEBUG, "pathcache_clear\n");
+
+	_pathcache.clear();
+}
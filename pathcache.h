@@ -0,0 +1,24 @@
+#ifndef __PATH_CACHE_H__
+#define __PATH_CACHE_H__
+
+#include <string>
+
+using namespace std;
+
+// Path -> store resolution cache sitting in front of the objmap lookups,
+// objmap misses included (a ShardMap, see shardmap.h).
+#define PATHCACHE_SHARDS 64
+#define PATHCACHE_SHARD_MAX_ENTRIES 16384
+
+extern unsigned long pathcache_gen(const char * obj);
+extern int pathcache_get(const char * obj, string &destStr);
+/*
+ * gen is the value of pathcache_gen() taken BEFORE the objmap lookup.
+ * If the path was invalidated in the meantime the entry is dropped,
+ * so a slow reader never re-inserts a stale store.
+ */
+extern int pathcache_set(const char * obj, const char * dest, unsigned long gen);
+extern int pathcache_del(const char * obj);
+extern void pathcache_clear();
+
+#endif
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <pthread.h>
+#include <string.h>
 #include <time.h>
 
 //#include <cstdint>
@@ -7,76 +9,356 @@
 #include <string>
 
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "log.h"
+#include "metadb.h"
+#include "migdelay.h"
+#include "storereg.h"
 #include "utils.h"
 
 #include "postprocess.h"
 
 using namespace std;
 
-leveldb::DB* _postprocess = NULL;
 pthread_mutex_t _postprocess_mutex = PTHREAD_MUTEX_INITIALIZER;
 uint_least64_t _obj_id = 0;
+// Every gid up to here is covered by the persisted high-water mark
+static volatile uint_least64_t _obj_gid_reserved = 0;
+static pthread_mutex_t _obj_gid_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Queue entries are checked and written under a per-object lock, so
+ * enqueues of different files don't serialize.
+ */
+class PostprocessShard
+{
+public:
+	PostprocessShard()
+	{
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	~PostprocessShard()
+	{
+		pthread_mutex_destroy(&lock);
+	}
+
+	pthread_mutex_t lock;
+};
+
+static PostprocessShard _postprocess_shards[PP_LOCK_SHARDS];
+
+static unsigned int get_shard(const char * obj)
+{
+	return hash_fnv1a(obj) % PP_LOCK_SHARDS;
+}
+
+static pthread_mutex_t * get_shard_lock(const char * obj)
+{
+	return &_postprocess_shards[get_shard(obj)].lock;
+}
 
 const char * OBJ_GID_KEY = "__obj_gid__";
+// Set once the queue only holds encoded entries, each with its gid index key
+const char * PP_VERSION_KEY = "__pp_version__";
+static const char PP_TABLE_VERSION = '\x02';
+
+// Enqueue notifications for the ppd scheduler
+static unsigned long _postprocess_events = 0;
+static pthread_mutex_t _postprocess_event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _postprocess_event_cond = PTHREAD_COND_INITIALIZER;
+
+int postprocess_encode(const PP_ENTRY_T &pp_entry, std::string &value)
+{
+	// Trailing empty stores are not written
+	uint32_t nstores = MAX_STORE_LEVEL;
+	while(nstores > 0 && pp_entry.store_path[nstores - 1].empty()) {
+		nstores--;
+	}
+
+	value.clear();
+	value.reserve(32);
+	value += PP_ENTRY_VERSION;
+	put_varint32(value, pp_entry.state);
+	put_varint64(value, pp_entry.obj_id);
+	put_varint64(value, pp_entry.enqueue_time);
+	put_varint32(value, nstores);
+	for(uint32_t i = 0; i < nstores; i++) {
+		uint32_t id = STOREREG_INVALID_ID;
+		if(!pp_entry.store_path[i].empty() && storereg_id(pp_entry.store_path[i].c_str(), id) != 0) {
+			return -1;
+		}
+		put_varint32(value, id);
+	}
+
+	if(pp_entry.checkpoint.offset > 0) {
+		put_varint64(value, pp_entry.checkpoint.offset);
+		put_varint32(value, pp_entry.checkpoint.crc);
+		put_varint64(value, pp_entry.checkpoint.source_size);
+		put_varint64(value, pp_entry.checkpoint.source_mtime);
+		put_varint32(value, pp_entry.checkpoint.source_mtime_nsec);
+	}
+
+	return 0;
+}
+
+int postprocess_decode(const char * data, size_t size, PP_ENTRY_T &pp_entry)
+{
+	const char * p = data;
+	const char * limit = data + size;
+	uint32_t state, nstores;
+	uint64_t obj_id, enqueue_time;
+
+	if(size == 0 || *p++ != PP_ENTRY_VERSION) {
+		return -1;
+	}
+	if(!get_varint32(p, limit, state)
+		|| !get_varint64(p, limit, obj_id)
+		|| !get_varint64(p, limit, enqueue_time)
+		|| !get_varint32(p, limit, nstores)
+		|| nstores > MAX_STORE_LEVEL) {
+		return -1;
+	}
+
+	pp_entry.state = state;
+	pp_entry.obj_id = obj_id;
+	pp_entry.enqueue_time = enqueue_time;
+	for(uint32_t i = 0; i < MAX_STORE_LEVEL; i++) {
+		pp_entry.store_path[i].clear();
+		if(i >= nstores) {
+			continue;
+		}
+
+		uint32_t id;
+		if(!get_varint32(p, limit, id)) {
+			return -1;
+		}
+		if(id != STOREREG_INVALID_ID && storereg_path(id, pp_entry.store_path[i]) != 0) {
+			return -1;
+		}
+	}
+
+	pp_entry.checkpoint = STORE_MIGRATE_CKPT_T();
+	if(p < limit) {
+		STORE_MIGRATE_CKPT_T checkpoint;
+		if(!get_varint64(p, limit, checkpoint.offset)
+			|| !get_varint32(p, limit, checkpoint.crc)
+			|| !get_varint64(p, limit, checkpoint.source_size)
+			|| !get_varint64(p, limit, checkpoint.source_mtime)) {
+			return -1;
+		}
+		// Older checkpoints only have whole seconds, they are never resumed
+		checkpoint.source_mtime_nsec = STORE_MTIME_NSEC_UNKNOWN;
+		if(p < limit && !get_varint32(p, limit, checkpoint.source_mtime_nsec)) {
+			return -1;
+		}
+		pp_entry.checkpoint = checkpoint;
+	}
+
+	return 0;
+}
+
+bool postprocess_is_internal_key(const std::string &key)
+{
+	return (!key.empty() && key[0] == PP_QUEUE_KEY_PREFIX[0])
+		|| key == OBJ_GID_KEY
+		|| key == PP_VERSION_KEY;
+}
+
+// Big-endian gid, so the index iterates in enqueue order
+static std::string queue_key(uint_least64_t obj_id)
+{
+	std::string key(PP_QUEUE_KEY_PREFIX);
+	for(int shift = 56; shift >= 0; shift -= 8) {
+		key += (char)((obj_id >> shift) & 0xff);
+	}
+	return key;
+}
+
+static uint_least64_t queue_key_gid(const std::string &key)
+{
+	uint_least64_t obj_id = 0;
+	for(size_t i = strlen(PP_QUEUE_KEY_PREFIX); i < key.size(); i++) {
+		obj_id = (obj_id << 8) | (unsigned char)key[i];
+	}
+	return obj_id;
+}
 
-void * postprocess_hdl()
+static void postprocess_notify()
 {
-	return (void *)_postprocess;
+	AutoLock lock(&_postprocess_event_mutex);
+	_postprocess_events++;
+	pthread_cond_broadcast(&_postprocess_event_cond);
+}
+
+unsigned long postprocess_events()
+{
+	AutoLock lock(&_postprocess_event_mutex);
+	return _postprocess_events;
+}
+
+int postprocess_wait(unsigned long seen, int timeout_ms)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	AutoLock lock(&_postprocess_event_mutex);
+	while(_postprocess_events == seen) {
+		if(pthread_cond_timedwait(&_postprocess_event_cond, &_postprocess_event_mutex, &deadline) == ETIMEDOUT) {
+			return _postprocess_events == seen ? 1 : 0;
+		}
+	}
+	return 0;
+}
+
+// The gid high-water mark, version byte and a varint
+static std::string gid_value(uint_least64_t obj_id)
+{
+	std::string value(1, PP_ENTRY_VERSION);
+	put_varint64(value, obj_id);
+	return value;
+}
+
+static int gid_decode(const std::string &value, uint_least64_t &obj_id)
+{
+	const char * p = value.data();
+	const char * limit = value.data() + value.size();
+	uint64_t v;
+
+	if(value.empty() || *p++ != PP_ENTRY_VERSION || !get_varint64(p, limit, v)) {
+		return -1;
+	}
+	obj_id = v;
+	return 0;
 }
 
 /*
- * this function is intended to be used with lock acquired
- * do NOT acquire lock again.
+ * Only the first gid past the reservation persists a new one, every other
+ * caller is a single atomic add. A crash loses at most the rest of a block.
+ * When the write fails nothing is reserved, the next gid tries again.
  */
-uint_least64_t get_obj_gid()
+static int reserve_obj_gid(uint_least64_t obj_id)
 {
-	//  * do NOT acquire lock again.
-	// AutoLock lock(&_postprocess_mutex);
+	AutoLock lock(&_obj_gid_mutex);
 
-	_obj_id++;
+	if(obj_id <= _obj_gid_reserved) {
+		return 0;
+	}
 
-	// Add 256 values to the database
-	PP_ENTRY_T * pp_entry = new PP_ENTRY_T();
-	
-	pp_entry->state = 0;
-	pp_entry->obj_id = _obj_id;
-	
-	// Add 256 values to the database
-	leveldb::WriteOptions writeOptions;
-	leveldb::Slice slice((char *)pp_entry, sizeof(PP_ENTRY_T));
-	_postprocess->Put(writeOptions, OBJ_GID_KEY, slice);
-	
-	return _obj_id;
+	// Logged before any entry carrying one of these gids
+	uint_least64_t reserved = (obj_id / PP_GID_BLOCK + 1) * PP_GID_BLOCK;
+	leveldb::Status status = metadb_put(METADB_POSTPROCESS, OBJ_GID_KEY, gid_value(reserved));
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "reserve_obj_gid: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	__sync_synchronize();
+	_obj_gid_reserved = reserved;
+	return 0;
+}
+
+// 0, or -1 when the gid couldn't be reserved and mustn't be used
+int get_obj_gid(uint_least64_t &obj_id)
+{
+	obj_id = __sync_add_and_fetch(&_obj_id, 1);
+	if(obj_id > _obj_gid_reserved) {
+		return reserve_obj_gid(obj_id);
+	}
+
+	return 0;
+}
+
+/*
+ * with the lock held
+ * Records from before the codec hold pointers of a dead process, nothing
+ * in them can be trusted. Drop them, and restart the gid past any that
+ * survived in the old gid record. Entries from before the gid index get
+ * their index key.
+ */
+static int postprocess_upgrade()
+{
+	std::string version;
+	if(metadb_get(METADB_POSTPROCESS, PP_VERSION_KEY, &version).ok() && version == string(1, PP_TABLE_VERSION)) {
+		return 0;
+	}
+
+	leveldb::WriteBatch batch;
+	unsigned long dropped = 0;
+	unsigned long indexed = 0;
+	PP_ENTRY_T pp_entry;
+
+	leveldb::Iterator* it = metadb_iterator(METADB_POSTPROCESS);
+	for (it->SeekToFirst(); it->Valid(); it->Next())
+	{
+		string key = it->key().ToString();
+		if(postprocess_is_internal_key(key)) {
+			continue;
+		}
+		if(postprocess_decode(it->value().data(), it->value().size(), pp_entry) != 0) {
+			metadb_batch_delete(&batch, METADB_POSTPROCESS, key);
+			dropped++;
+		} else {
+			metadb_batch_put(&batch, METADB_POSTPROCESS, queue_key(pp_entry.obj_id), key);
+			indexed++;
+		}
+	}
+	leveldb::Status status = it->status();
+	delete it;
+
+	if(status.ok()) {
+		log_msg(LOG_LEVEL_ERROR, "postprocess_upgrade: %lu entries indexed, %lu unreadable dropped\n", indexed, dropped);
+		metadb_batch_put(&batch, METADB_POSTPROCESS, PP_VERSION_KEY, string(1, PP_TABLE_VERSION));
+		status = metadb_write(&batch);
+	}
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "postprocess_upgrade: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	return 0;
 }
 
 int postprocess_init()
 {
 	AutoLock lock(&_postprocess_mutex);
 
-	// Set up database connection information and open database
-	leveldb::Options options;
-	options.create_if_missing = true;
-	
-	leveldb::Status status = leveldb::DB::Open(options, POSTPROCESS_DB, &_postprocess);
-	
-	if (false == status.ok())
+	// The queue is a table of the metadata DB
+	if (metadb_init() != 0 || storereg_init() != 0)
 	{
-	    cerr << "Unable to open post-processing database "<< POSTPROCESS_DB << endl;
-	    cerr << status.ToString() << endl;
+	    cerr << "Unable to open post-processing database "<< METADB_DB << endl;
 	    return -1;
 	}
+	leveldb::Status status;
 
 	// Initialize/reload the global persistent variables
-	leveldb::ReadOptions readOptions;
 	std::string dbval;
-	status = _postprocess->Get(readOptions, OBJ_GID_KEY, &dbval);
+	status = metadb_get(METADB_POSTPROCESS, OBJ_GID_KEY, &dbval);
 	
-	if (true == status.ok())
+	// The gid restarts past the high-water mark, gids skipped by a crash are never reused
+	if (true == status.ok() && gid_decode(dbval, _obj_id) != 0)
 	{
-		leveldb::Slice slice = dbval; //string -> leveldb::Slice
-		 const PP_ENTRY_T * pp_entry = reinterpret_cast<const PP_ENTRY_T *>(slice.data());
-		_obj_id = pp_entry->obj_id;
+		// The old raw record, its gid is the last 8 bytes
+		if(dbval.size() >= sizeof(uint_least64_t)) {
+			uint_least64_t obj_id;
+			memcpy(&obj_id, dbval.data() + dbval.size() - sizeof(obj_id), sizeof(obj_id));
+			_obj_id = obj_id;
+		}
+		metadb_put(METADB_POSTPROCESS, OBJ_GID_KEY, gid_value(_obj_id));
+	}
+
+	_obj_gid_reserved = _obj_id;
+
+	if(postprocess_upgrade() != 0) {
+		return -1;
 	}
 	
 	log_msg(LOG_LEVEL_ERROR, "\npostprocess_init: postprocess obj_gid: %llu \n", _obj_id);
@@ -84,26 +366,48 @@ int postprocess_init()
 	return 0;
 }
 
+// with the obj's shard lock held
+static int postprocess_put(const char * obj, PP_ENTRY_T &pp_entry)
+{
+	std::string value;
+
+	if(get_obj_gid(pp_entry.obj_id) != 0) {
+		return -1;
+	}
+	pp_entry.enqueue_time = time(NULL);
+	if(postprocess_encode(pp_entry, value) != 0) {
+		return -1;
+	}
+
+	// The entry and its place in the queue go in together
+	leveldb::WriteBatch batch;
+	metadb_batch_put(&batch, METADB_POSTPROCESS, obj, value);
+	metadb_batch_put(&batch, METADB_POSTPROCESS, queue_key(pp_entry.obj_id), obj);
+	leveldb::Status status = metadb_write(&batch);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "postprocess_put: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	postprocess_notify();
+	return 0;
+}
+
 int postprocess_set(const char * obj, int state, std::string store_path1)
 {
-	AutoLock lock(&_postprocess_mutex);
+	AutoLock lock(get_shard_lock(obj));
 
-	leveldb::ReadOptions readOptions;
 	std::string dbval;
-	leveldb::Status status = _postprocess->Get(readOptions, obj, &dbval);
+	leveldb::Status status = metadb_get(METADB_POSTPROCESS, obj, &dbval);
 
 	if (true != status.ok())
 	{
-		PP_ENTRY_T * pp_entry = new PP_ENTRY_T();
-		
-		pp_entry->state = state;
-		pp_entry->store_path[0] = store_path1;
-		pp_entry->obj_id = get_obj_gid();
+		PP_ENTRY_T pp_entry;
 		
-		// Add 256 values to the database
-		leveldb::WriteOptions writeOptions;
-		leveldb::Slice slice((char *)pp_entry, sizeof(PP_ENTRY_T));
-		_postprocess->Put(writeOptions, obj, slice);
+		pp_entry.state = state;
+		pp_entry.store_path[0] = store_path1;
+		return postprocess_put(obj, pp_entry);
 	}
 
 	return 0;
@@ -111,57 +415,113 @@ int postprocess_set(const char * obj, int state, std::string store_path1)
 
 int postprocess_set(const char * obj, int state, std::string store_path1, std::string store_path2)
 {
-	AutoLock lock(&_postprocess_mutex);
+	AutoLock lock(get_shard_lock(obj));
 	
 	if(std::string(obj) == "/.ifsctl")
 	{
 		return 0;
 	}
 
-	leveldb::ReadOptions readOptions;
 	std::string dbval;
-	leveldb::Status status = _postprocess->Get(readOptions, obj, &dbval);
+	leveldb::Status status = metadb_get(METADB_POSTPROCESS, obj, &dbval);
 
 	if (true != status.ok())
 	{
-		PP_ENTRY_T * pp_entry = new PP_ENTRY_T();
-		
-		pp_entry->state = state;
-		pp_entry->store_path[0] = store_path1;
-		pp_entry->store_path[1] = store_path2;
-		pp_entry->obj_id = get_obj_gid();
+		PP_ENTRY_T pp_entry;
 		
-		// Add 256 values to the database
-		leveldb::WriteOptions writeOptions;
-		leveldb::Slice slice((char *)pp_entry, sizeof(PP_ENTRY_T));
-		_postprocess->Put(writeOptions, obj, slice);
+		pp_entry.state = state;
+		pp_entry.store_path[0] = store_path1;
+		pp_entry.store_path[1] = store_path2;
+		return postprocess_put(obj, pp_entry);
 	}
 
 	return 0;
 }
 
-int postprocess_get(const char * obj, const PP_ENTRY_T * &pp_entry)
+int postprocess_set_batch(const vector<string> &objs, const int state, std::string store_path1, std::string store_path2)
 {
-	AutoLock lock(&_postprocess_mutex);
+	// Lock every shard the batch touches, always in index order
+	vector<bool> shards(PP_LOCK_SHARDS, false);
+	for(vector<string>::const_iterator vit = objs.begin(); vit != objs.end(); vit++) {
+		shards[get_shard(vit->c_str())] = true;
+	}
+	for(int i = 0; i < PP_LOCK_SHARDS; i++) {
+		if(shards[i]) {
+			pthread_mutex_lock(&_postprocess_shards[i].lock);
+		}
+	}
+
+	leveldb::WriteBatch batch;
+	int count = 0;
+	int ret = 0;
+
+	// Every entry of the batch differs only in its gid
+	PP_ENTRY_T pp_entry;
+	pp_entry.state = state;
+	pp_entry.store_path[0] = store_path1;
+	pp_entry.store_path[1] = store_path2;
+	pp_entry.enqueue_time = time(NULL);
+
+	for(vector<string>::const_iterator vit = objs.begin(); vit != objs.end(); vit++) {
+		if(*vit == "/.ifsctl") {
+			continue;
+		}
+
+		std::string dbval;
+		leveldb::Status status = metadb_get(METADB_POSTPROCESS, *vit, &dbval);
+		if (true == status.ok())
+		{
+			continue;
+		}
+
+		if(get_obj_gid(pp_entry.obj_id) != 0 || postprocess_encode(pp_entry, dbval) != 0) {
+			ret = -1;
+			break;
+		}
+		metadb_batch_put(&batch, METADB_POSTPROCESS, *vit, dbval);
+		metadb_batch_put(&batch, METADB_POSTPROCESS, queue_key(pp_entry.obj_id), *vit);
+		count++;
+	}
+
+	if(ret == 0 && count > 0) {
+		leveldb::Status status = metadb_write(&batch);
+		if (false == status.ok())
+		{
+			log_msg(LOG_LEVEL_ERROR, "postprocess_set_batch: %s\n", status.ToString().c_str());
+			ret = -1;
+		}
+	}
+
+	for(int i = PP_LOCK_SHARDS - 1; i >= 0; i--) {
+		if(shards[i]) {
+			pthread_mutex_unlock(&_postprocess_shards[i].lock);
+		}
+	}
+
+	if(ret == 0 && count > 0) {
+		postprocess_notify();
+	}
+	return ret;
+}
+
+int postprocess_get(const char * obj, PP_ENTRY_T &pp_entry)
+{
+	AutoLock lock(get_shard_lock(obj));
 
 	if(std::string(obj) == "/.ifsctl")
 	{
-		return 0;
+		return -1;
 	}
 
-	leveldb::ReadOptions readOptions;
 	std::string dbval;
-	leveldb::Status status = _postprocess->Get(readOptions, obj, &dbval);
+	leveldb::Status status = metadb_get(METADB_POSTPROCESS, obj, &dbval);
 	
 	if (false == status.ok())
 	{
 		return -1;
 	}
 	
-	leveldb::Slice slice = dbval; //string -> leveldb::Slice
-	pp_entry = reinterpret_cast<const PP_ENTRY_T *>(slice.data());
-	
-	return 0;
+	return postprocess_decode(dbval.data(), dbval.size(), pp_entry);
 }
 
 /*
@@ -170,35 +530,221 @@ int postprocess_get(const char * obj, const PP_ENTRY_T * &pp_entry)
  */
 int postprocess_del(const char * obj, const PP_ENTRY_T *pp_entry)
 {
-	if(OBJ_GID_KEY == obj)
+	if(postprocess_is_internal_key(obj))
 	{
 		// @todo: there is a catagory of VARs, no hardcoded gid key only
 		return 0;
 	}
 
-	AutoLock lock(&_postprocess_mutex);
+	AutoLock lock(get_shard_lock(obj));
 
-	leveldb::ReadOptions readOptions;
 	std::string dbval;
-	leveldb::Status status = _postprocess->Get(readOptions, obj, &dbval);
+	leveldb::Status status = metadb_get(METADB_POSTPROCESS, obj, &dbval);
 	
 	if (false == status.ok())
 	{
-		// Don't have to fail it since we are deleting this entry
-		leveldb::Slice slice = dbval; //string -> leveldb::Slice
-		const PP_ENTRY_T * this_pp_entry = reinterpret_cast<const PP_ENTRY_T *>(slice.data());
-		if(this_pp_entry->obj_id != pp_entry->obj_id)
+		// Already gone
+		return 0;
+	}
+
+	PP_ENTRY_T this_pp_entry;
+	int decoded = (postprocess_decode(dbval.data(), dbval.size(), this_pp_entry) == 0);
+	if(pp_entry && decoded && this_pp_entry.obj_id != pp_entry->obj_id)
+	{
+		log_msg(LOG_LEVEL_ERROR, "\npostprocess_del: trying to delete an updated obj, ignoring. Origin objid[%llu], updated objid[%llu] \n", pp_entry->obj_id, this_pp_entry.obj_id);
+
+		return 0;
+	}
+
+	// Now remove the entry, and its place in the queue
+	leveldb::WriteBatch batch;
+	metadb_batch_delete(&batch, METADB_POSTPROCESS, obj);
+	if(decoded) {
+		metadb_batch_delete(&batch, METADB_POSTPROCESS, queue_key(this_pp_entry.obj_id));
+	}
+	status = metadb_write(&batch);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "postprocess_del: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+int postprocess_cancel(const char * obj, off_t bytes)
+{
+	AutoLock lock(get_shard_lock(obj));
+
+	std::string dbval;
+	PP_ENTRY_T pp_entry;
+	if(false == metadb_get(METADB_POSTPROCESS, obj, &dbval).ok()
+		|| postprocess_decode(dbval.data(), dbval.size(), pp_entry) != 0)
+	{
+		// Not queued
+		return 0;
+	}
+
+	leveldb::WriteBatch batch;
+	metadb_batch_delete(&batch, METADB_POSTPROCESS, obj);
+	metadb_batch_delete(&batch, METADB_POSTPROCESS, queue_key(pp_entry.obj_id));
+	leveldb::Status status = metadb_write(&batch);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "postprocess_cancel: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	uint_least64_t now = time(NULL);
+	migdelay_ended(obj, now > pp_entry.enqueue_time ? now - pp_entry.enqueue_time : 0, bytes);
+	return 0;
+}
+
+int postprocess_rename(const char * obj, const char * newobj)
+{
+	// Both shard locks, always in index order
+	unsigned int first = get_shard(obj);
+	unsigned int second = get_shard(newobj);
+	if(second < first) {
+		unsigned int shard = first;
+		first = second;
+		second = shard;
+	}
+	pthread_mutex_lock(&_postprocess_shards[first].lock);
+	if(second != first) {
+		pthread_mutex_lock(&_postprocess_shards[second].lock);
+	}
+
+	int retstat = 0;
+	std::string dbval;
+	PP_ENTRY_T pp_entry;
+	if(metadb_get(METADB_POSTPROCESS, obj, &dbval).ok()
+		&& postprocess_decode(dbval.data(), dbval.size(), pp_entry) == 0)
+	{
+		leveldb::WriteBatch batch;
+		metadb_batch_delete(&batch, METADB_POSTPROCESS, obj);
+		metadb_batch_delete(&batch, METADB_POSTPROCESS, queue_key(pp_entry.obj_id));
+
+		// Whatever was queued under newobj is replaced
+		std::string newval;
+		PP_ENTRY_T new_entry;
+		if(metadb_get(METADB_POSTPROCESS, newobj, &newval).ok()
+			&& postprocess_decode(newval.data(), newval.size(), new_entry) == 0) {
+			metadb_batch_delete(&batch, METADB_POSTPROCESS, queue_key(new_entry.obj_id));
+		}
+
+		// A new place in the queue, the enqueue time (its age) stays
+		uint_least64_t enqueue_time = pp_entry.enqueue_time;
+		pp_entry.checkpoint = STORE_MIGRATE_CKPT_T();
+		if(get_obj_gid(pp_entry.obj_id) != 0) {
+			// Not queued under newobj, the old name goes all the same
+			metadb_batch_delete(&batch, METADB_POSTPROCESS, newobj);
+			retstat = -1;
+		} else if(postprocess_encode(pp_entry, dbval) == 0) {
+			metadb_batch_put(&batch, METADB_POSTPROCESS, newobj, dbval);
+			metadb_batch_put(&batch, METADB_POSTPROCESS, queue_key(pp_entry.obj_id), newobj);
+		}
+
+		leveldb::Status status = metadb_write(&batch);
+		if (false == status.ok())
 		{
-			log_msg(LOG_LEVEL_ERROR, "\npostprocess_del: trying to delete an updated obj, ignoring. Origin objid[%llu], updated objid[%llu] \n", pp_entry->obj_id, this_pp_entry->obj_id);
+			log_msg(LOG_LEVEL_ERROR, "postprocess_rename: %s\n", status.ToString().c_str());
+			retstat = -1;
+		} else {
+			uint_least64_t now = time(NULL);
+			migdelay_ended(obj, now > enqueue_time ? now - enqueue_time : 0, 0);
+			postprocess_notify();
+		}
+	}
 
-			return 0;
+	if(second != first) {
+		pthread_mutex_unlock(&_postprocess_shards[second].lock);
+	}
+	pthread_mutex_unlock(&_postprocess_shards[first].lock);
+	return retstat;
+}
+
+int postprocess_checkpoint(const char * obj, uint_least64_t obj_id, const STORE_MIGRATE_CKPT_T &checkpoint)
+{
+	AutoLock lock(get_shard_lock(obj));
+
+	std::string dbval;
+	PP_ENTRY_T pp_entry;
+	leveldb::Status status = metadb_get(METADB_POSTPROCESS, obj, &dbval);
+	if (false == status.ok() || postprocess_decode(dbval.data(), dbval.size(), pp_entry) != 0)
+	{
+		return -1;
+	}
+	if(pp_entry.obj_id != obj_id) {
+		// Re-queued, the next migration starts over anyway
+		return 0;
+	}
+
+	// Same gid, the queue key stays as it is
+	pp_entry.checkpoint = checkpoint;
+	if(postprocess_encode(pp_entry, dbval) != 0) {
+		return -1;
+	}
+	status = metadb_put(METADB_POSTPROCESS, obj, dbval);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "postprocess_checkpoint: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+int postprocess_if_queued(const char * obj, uint_least64_t obj_id, POSTPROCESS_LOCKED_FN fn, void * arg)
+{
+	AutoLock lock(get_shard_lock(obj));
+
+	std::string dbval;
+	PP_ENTRY_T pp_entry;
+	if (false == metadb_get(METADB_POSTPROCESS, obj, &dbval).ok()
+		|| postprocess_decode(dbval.data(), dbval.size(), pp_entry) != 0
+		|| pp_entry.obj_id != obj_id)
+	{
+		return 1;
+	}
+
+	return fn(obj, arg);
+}
+
+int postprocess_scan(uint_least64_t after_gid, size_t max, vector<string> &objs, vector<PP_ENTRY_T> &entries)
+{
+	objs.clear();
+	entries.clear();
+
+	leveldb::Iterator* it = metadb_iterator(METADB_POSTPROCESS);
+	for (it->Seek(queue_key(after_gid + 1)); it->Valid() && objs.size() < max; it->Next())
+	{
+		string key = it->key().ToString();
+		if(key.compare(0, strlen(PP_QUEUE_KEY_PREFIX), PP_QUEUE_KEY_PREFIX) != 0) {
+			break;
+		}
+
+		// The entry itself may have been replaced or removed since
+		string obj = it->value().ToString();
+		PP_ENTRY_T pp_entry;
+		std::string dbval;
+		if(false == metadb_get(METADB_POSTPROCESS, obj, &dbval).ok()
+			|| postprocess_decode(dbval.data(), dbval.size(), pp_entry) != 0
+			|| pp_entry.obj_id != queue_key_gid(key)) {
+			continue;
 		}
-		delete pp_entry;
+
+		objs.push_back(obj);
+		entries.push_back(pp_entry);
 	}
+	leveldb::Status status = it->status();
+	delete it;
 
-	// Now remove the entry
-	leveldb::WriteOptions writeOptions;
-	_postprocess->Delete(writeOptions, obj);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "postprocess_scan: %s\n", status.ToString().c_str());
+		return -1;
+	}
 
 	return 0;
 }
@@ -223,13 +769,13 @@ int postprocess_list(const char * prefix, vector<string>& obj_list)
 	// @todo: You think I don't know the performance here is poor..?
 	
 	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = _postprocess->NewIterator(leveldb::ReadOptions());
+	leveldb::Iterator* it = metadb_iterator(METADB_POSTPROCESS);
 
 	for (it->SeekToFirst(); it->Valid(); it->Next())
 	{
 		string abs_path = it->key().ToString();
 		string rel_path;
-		if(abs_to_relative_path(prefix, abs_path, rel_path))
+		if(!postprocess_is_internal_key(abs_path) && abs_to_relative_path(prefix, abs_path, rel_path))
 		{
 			obj_list.push_back(rel_path);
 		}
@@ -251,22 +797,38 @@ int postprocess_dump_to_log()
 	AutoLock lock(&_postprocess_mutex);
 
 	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = _postprocess->NewIterator(leveldb::ReadOptions());
+	leveldb::Iterator* it = metadb_iterator(METADB_POSTPROCESS);
 	
 	log_msg(LOG_LEVEL_ERROR, "\npostprocess_dump_to_log: starting dumping \n");
 	
 	for (it->SeekToFirst(); it->Valid(); it->Next())
 	{
-		const PP_ENTRY_T * pp_entry = reinterpret_cast<const PP_ENTRY_T *>(it->value().data());
+		if(postprocess_is_internal_key(it->key().ToString())) {
+			continue;
+		}
+
+		PP_ENTRY_T pp_entry;
+		if(postprocess_decode(it->value().data(), it->value().size(), pp_entry) != 0) {
+			log_msg(LOG_LEVEL_ERROR, "[pp_entry]: %s : unreadable\n", it->key().ToString().c_str());
+			continue;
+		}
 
 		std::ostringstream log_entry;
 		log_entry << "[pp_entry]: ";
 		log_entry << it->key().ToString();
 		log_entry << " : ";
-		log_entry << pp_entry->obj_id;
+		log_entry << pp_entry.obj_id;
+		log_entry << " : ";
+		log_entry << pp_entry.state;
 		log_entry << " : ";
-		log_entry << pp_entry->store_path[0];
-		cout << log_entry << endl;
+		log_entry << pp_entry.enqueue_time;
+		log_entry << " : ";
+		log_entry << pp_entry.store_path[0];
+		if(pp_entry.checkpoint.offset > 0) {
+			log_entry << " : copied ";
+			log_entry << pp_entry.checkpoint.offset;
+		}
+		cout << log_entry.str() << endl;
 		log_msg(LOG_LEVEL_ERROR, "%s\n", log_entry.str().c_str());
 	}
 	
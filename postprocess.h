@@ -15,9 +15,37 @@ struct PP_ENTRY_T
 	std::string store_path[MAX_STORE_LEVEL];
 	int state;
 	uint_least64_t obj_id;
+	// Seconds since the epoch
+	uint_least64_t enqueue_time;
+	// How far a resumable migration of the object got
+	STORE_MIGRATE_CKPT_T checkpoint;
 };
 
-#define POSTPROCESS_DB (STORE_ROOT + "/.postprocess")
+/*
+ * On disk a queue entry is PP_ENTRY_VERSION followed by varints: state, gid,
+ * enqueue time, the number of stores and each store's registry id (0 for an
+ * empty slot). A migration checkpoint, if any, follows as offset, crc, source
+ * size, source mtime and its nanoseconds. Records that don't start with the version are the
+ * old raw struct copies, which can't be read back; postprocess_init() drops
+ * them.
+ */
+#define PP_ENTRY_VERSION '\x01'
+
+extern int postprocess_encode(const PP_ENTRY_T &pp_entry, std::string &value);
+extern int postprocess_decode(const char * data, size_t size, PP_ENTRY_T &pp_entry);
+/*
+ * Each entry also has a queue key, PP_QUEUE_KEY_PREFIX + big-endian gid ->
+ * obj, written and removed with it. Scanning those is the queue in
+ * enqueue order.
+ */
+#define PP_QUEUE_KEY_PREFIX "\x01q"
+// Bookkeeping keys (gid, version, queue) share the table, scans skip them
+extern bool postprocess_is_internal_key(const std::string &key);
+
+// Locks striped over the queue, by object path
+#define PP_LOCK_SHARDS 64
+// gids are reserved (and persisted) this many at a time
+#define PP_GID_BLOCK 4096
 
 extern int postprocess_init();
 extern int postprocess_set(const char * obj, const int state, std::string store_path1);
@@ -25,16 +53,44 @@ extern int postprocess_set(const char * obj, const int state, std::string store_
 extern int postprocess_set(const char * obj, const int state, std::string store_path1, std::string store_path2, std::string store_path3);
 extern int postprocess_set(const char * obj, const int state, std::string store_path1, std::string store_path2, std::string store_path3, std::string store_path4);
 extern int postprocess_set(const char * obj, const int state, std::string store_path1, std::string store_path2, std::string store_path3, std::string store_path4, std::string store_path5);
-extern int postprocess_get(const char * obj, const PP_ENTRY_T &pp_entry);
+/*
+ * Same as postprocess_set() for every obj without an entry yet, but takes
+ * each shard lock once and commits the entries in one WriteBatch.
+ */
+extern int postprocess_set_batch(const vector<string> &objs, const int state, std::string store_path1, std::string store_path2);
+extern int postprocess_get(const char * obj, PP_ENTRY_T &pp_entry);
 /*
  * Not a typo.
  * Having pp_entry here is to avoid deleting updated objects, by checking gid in the pp_entry
+ * A NULL pp_entry deletes whatever is there.
  */
 extern int postprocess_del(const char * obj, const PP_ENTRY_T *pp_entry);
+/*
+ * obj went away (unlinked, or replaced by a rename) and its data with it:
+ * drops its entry, if any, and counts the bytes that needn't be migrated.
+ */
+extern int postprocess_cancel(const char * obj, off_t bytes);
+// obj is now newobj, a queued migration moves along, keeping its age
+extern int postprocess_rename(const char * obj, const char * newobj);
+// Saves the checkpoint in obj's entry, unless it was replaced since (the gid differs)
+extern int postprocess_checkpoint(const char * obj, uint_least64_t obj_id, const STORE_MIGRATE_CKPT_T &checkpoint);
+/*
+ * Runs fn(obj, arg) with obj's shard lock held if obj is still queued with
+ * obj_id: a cancel or rename can't get in between. fn's result, or 1
+ * without calling it when the entry is gone or was re-queued.
+ */
+typedef int (*POSTPROCESS_LOCKED_FN)(const char * obj, void * arg);
+extern int postprocess_if_queued(const char * obj, uint_least64_t obj_id, POSTPROCESS_LOCKED_FN fn, void * arg);
+/*
+ * Up to max queued entries with a gid past after_gid, in gid order.
+ * objs[i] goes with entries[i].
+ */
+extern int postprocess_scan(uint_least64_t after_gid, size_t max, vector<string> &objs, vector<PP_ENTRY_T> &entries);
+// Bumped after every enqueue
+extern unsigned long postprocess_events();
+// Until postprocess_events() moves past seen, 1 if timeout_ms ran out first
+extern int postprocess_wait(unsigned long seen, int timeout_ms);
 extern int postprocess_list(const char * prefix, vector<string>& obj_list);
 extern int postprocess_dump_to_log();
 
-// @todo: security...?
-extern void * postprocess_hdl();
-
 #endif
\ No newline at end of file
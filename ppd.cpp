@@ -4,14 +4,26 @@
 #include <errno.h>
 #include "log.h"
 #include "store.h"
+#include "migdelay.h"
+#include "migpool.h"
 #include "objmap.h"
 #include "postprocess.h"
+#include "ppd.h"
 #include "stats.h"
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <map>
+
 #include "leveldb/db.h"
+#include "metadb.h"
 
 #define PPD_LOGFILE "ppd.log"
+// Queue entries handled per scan, and put in disk order together
+#define PPD_BATCH 256
+// Seconds between passes from the start of the queue
+#define PPD_RESCAN_INTERVAL 30
 
 using namespace std;
 
@@ -25,11 +37,116 @@ static int ppd_error(const char *str)
 	return ret;
 }
 
-void process_postprocess_file(const string path, const PP_ENTRY_T * pp_entry)
+struct PPD_CKPT_ARG_T
 {
-	log_msg(LOG_LEVEL_ERROR, "process_file: %s\n", path.c_str());
+	uint_least64_t obj_id;
+};
+
+static int save_checkpoint(const char * path, const STORE_MIGRATE_CKPT_T &ckpt, void * arg)
+{
+	PPD_CKPT_ARG_T * ckpt_arg = (PPD_CKPT_ARG_T *)arg;
+	return postprocess_checkpoint(path, ckpt_arg->obj_id, ckpt);
+}
+
+struct PPD_COMMIT_ARG_T
+{
+	uint_least64_t obj_id;
+	const char * to_store;
+	bool promote;
+};
+
+// With the queue entry's shard lock held
+static int commit_locked(const char * path, void * arg)
+{
+	PPD_COMMIT_ARG_T * commit_arg = (PPD_COMMIT_ARG_T *)arg;
+
+	if(commit_arg->promote) {
+		// Set L1 objmap
+		return objmap_set(path, commit_arg->to_store); // Add to L1
+	}
+	#ifdef CACHE_MODE
+	return objmap_set(path, commit_arg->to_store, 2); // Only add to L2, not deleting one
+	#else
+	return objmap_set(path, commit_arg->to_store);
+	#endif
+}
+
+// Points the objmap at the target, unless the file was unlinked or renamed meanwhile
+static int commit_migration(const char * path, const char * to_store, void * arg)
+{
+	PPD_COMMIT_ARG_T * commit_arg = (PPD_COMMIT_ARG_T *)arg;
+	commit_arg->to_store = to_store;
+	return postprocess_if_queued(path, commit_arg->obj_id, commit_locked, commit_arg);
+}
 
+/*
+ * Runs on a migration worker. Staging source files move to the target,
+ * target files are promoted (always copied) back to the source.
+ */
+static int process_postprocess_file(const string &path, const PP_ENTRY_T &pp_entry, const string &from_store, const string &to_store, off_t * bytes)
+{
 	int retstat = 0;
+	bool promote = (from_store == STORE_DATA_STAGING_TARGET.store_name);
+
+	string full_path = from_store + path;
+	struct stat statbuf;
+	if(lstat(full_path.c_str(), &statbuf) == 0) {
+		*bytes = statbuf.st_size;
+	}
+
+	log_msg(LOG_LEVEL_ERROR, "process_file:(fpath=\"%s\"),post-processing:%s from %s to %s\n",
+		full_path.c_str(), promote ? "promoting" : "move", from_store.c_str(), to_store.c_str());
+
+	// Big files continue where an earlier attempt stopped
+	STORE_MIGRATE_CKPT_T ckpt = pp_entry.checkpoint;
+	PPD_CKPT_ARG_T ckpt_arg;
+	ckpt_arg.obj_id = pp_entry.obj_id;
+	PPD_COMMIT_ARG_T commit_arg;
+	commit_arg.obj_id = pp_entry.obj_id;
+	commit_arg.to_store = NULL;
+	commit_arg.promote = promote;
+
+	if(promote) {
+		// Never MOVE, COPY always in promotion
+		retstat = store_migrate(path.c_str(), from_store.c_str(), to_store.c_str(), true, &ckpt, save_checkpoint, &ckpt_arg,
+			commit_migration, &commit_arg);
+	} else {
+		retstat = store_migrate(path.c_str(), from_store.c_str(), to_store.c_str(), STORE_DATA_STAGING_SOURCE.is_cached,
+			&ckpt, save_checkpoint, &ckpt_arg, commit_migration, &commit_arg);
+	}
+
+	if(retstat == -ECANCELED) {
+		// Unlinked or renamed, nothing left to do under this name
+		return retstat;
+	}
+	if(retstat != 0) {
+		return ppd_error(promote ? "ppd post-processing: promotion failed" : "ppd post-processing: migration failed");
+	}
+
+	log_msg(LOG_LEVEL_ERROR, "process_file:(path=\"%s\"), post-process successfully %s from %s to %s\n",
+		path.c_str(),
+		promote ? "promoted" : "migrated",
+		from_store.c_str(),
+		to_store.c_str());
+
+	migdelay_migrated(path.c_str());
+
+	// Only now we can delete the item from queue
+	log_msg(LOG_LEVEL_ERROR, "process_file:Done, removing from queue (path=\"%s\")\n", path.c_str());
+	// @todo: better use a wrapper
+	postprocess_del(path.c_str(), &pp_entry);
+
+	return 0;
+}
+
+/*
+ * Works out where a queued file goes and hands it to the migration pool.
+ * Files that are gone are simply dropped from the queue.
+ */
+void queue_postprocess_file(const string path, const PP_ENTRY_T * pp_entry)
+{
+	log_msg(LOG_LEVEL_ERROR, "process_file: %s\n", path.c_str());
+
 	// Then this is a non-dir file, need to get the real
 	// destination
 
@@ -39,118 +156,179 @@ void process_postprocess_file(const string path, const PP_ENTRY_T * pp_entry)
 	
 	struct stat statbuf;
 	log_msg(LOG_LEVEL_ERROR, "process_file:(fpath=\"%s\"), check for post-processing\n", full_path.c_str());
-	retstat = lstat(full_path.c_str(), &statbuf);
 
-	// @todo: now we only handle small files,
-	// those < 16 KB
-	// you know...one at a time
-	if(retstat != -1) {
-		std::string archor_path = pp_entry->store_path[0];
-		if(archor_path == STORE_DATA_STAGING_SOURCE.store_name) {
-			// Now, it's the staging/cache mode
-			log_msg(LOG_LEVEL_ERROR, "process_file:(fpath=\"%s\"),post-processing:move from %s to %s\n",
-				full_path.c_str(), archor_path.c_str(), STORE_DATA_STAGING_TARGET.store_name.c_str());
-
-			retstat = store_migrate(path.c_str(), archor_path.c_str(), STORE_DATA_STAGING_TARGET.store_name.c_str(), STORE_DATA_STAGING_SOURCE.is_cached);
-			
-			if(retstat == 0) {
-				// Update the database only after migration is successful
-				#ifdef CACHE_MODE
-				objmap_set(path.c_str(), STORE_DATA_STAGING_TARGET.store_name.c_str(), 2); // Only add to L2, not deleting one
-				#else
-				objmap_set(path.c_str(), STORE_DATA_STAGING_TARGET.store_name.c_str());
-				#endif
-				log_msg(LOG_LEVEL_ERROR, "process_file:(path=\"%s\"), post-process successfully migrated from %s to %s\n",
-					path.c_str(),
-					archor_path.c_str(),
-					STORE_DATA_STAGING_TARGET.store_name.c_str());
-				// Only now we can delete the item from queue
-				log_msg(LOG_LEVEL_ERROR, "process_file:Done migration, removing from queue (path=\"%s\")\n", path.c_str());
-				// @todo: better use a wrapper
-				postprocess_del(path.c_str(), pp_entry);
-			} else {
-				retstat = ppd_error("ppd post-processing: migration failed");
-			}
-		} else if(archor_path == STORE_DATA_STAGING_TARGET.store_name) {
-			// Now, it's the staging/cache mode
-			log_msg(LOG_LEVEL_ERROR, "process_file:(fpath=\"%s\"),post-processing:promoting from %s to %s\n",
-				full_path.c_str(), archor_path.c_str(), STORE_DATA_STAGING_SOURCE.store_name.c_str());
-
-			// Never MOVE, COPY always in promotion
-			retstat = store_migrate(path.c_str(), archor_path.c_str(), STORE_DATA_STAGING_SOURCE.store_name.c_str(), true);
-			
-			if(retstat == 0) {
-				// Update the database only after migration is successful
-				// Set L1 objmap
-				objmap_set(path.c_str(), STORE_DATA_STAGING_SOURCE.store_name.c_str()); // Add to L1
-
-				log_msg(LOG_LEVEL_ERROR, "process_file:(path=\"%s\"), post-process successfully promoted from %s to %s\n",
-					path.c_str(),
-					archor_path.c_str(),
-					STORE_DATA_STAGING_SOURCE.store_name.c_str());
-				// Only now we can delete the item from queue
-				log_msg(LOG_LEVEL_ERROR, "process_file:Done promotion, removing from queue (path=\"%s\")\n", path.c_str());
-				// @todo: better use a wrapper
-				postprocess_del(path.c_str(), pp_entry);
-			} else {
-				retstat = ppd_error("ppd post-processing: promotion failed");
-			}
-		}
-	} else {
+	if(lstat(full_path.c_str(), &statbuf) == -1) {
 		// Nothing to process, remove from queue
 		printf("process_file:Nothing to process, removing from queue (path=\"%s\")\n", path.c_str());
 		// @todo: better use a wrapper
 		postprocess_del(path.c_str(), pp_entry);
+		return;
+	}
+
+	std::string archor_path = pp_entry->store_path[0];
+	if(archor_path == STORE_DATA_STAGING_SOURCE.store_name) {
+		// Now, it's the staging/cache mode
+		migpool_submit(path, *pp_entry, archor_path, STORE_DATA_STAGING_TARGET.store_name);
+	} else if(archor_path == STORE_DATA_STAGING_TARGET.store_name) {
+		migpool_submit(path, *pp_entry, archor_path, STORE_DATA_STAGING_SOURCE.store_name);
 	}
-	printf("\n");
 }
 
-void process_postprocess_db(leveldb::DB* db) {
-	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
-	
-	for (it->SeekToFirst(); it->Valid(); it->Next())
-	{
-		cout << "Queue: "<< it->key().ToString() << " => " << it->value().ToString() << endl;
-		PP_ENTRY_T pp_entry = *(reinterpret_cast<const PP_ENTRY_T *>(it->value().data()));
-		process_postprocess_file(
-			it->key().ToString(),
-			&pp_entry
-		);
+struct PPD_BATCH_ITEM_T
+{
+	size_t index;
+	string dir;
+	STORE_LOCATION_T location;
+	// Where the first file of its directory sits
+	STORE_LOCATION_T dir_location;
+};
+
+static bool batch_item_before(const PPD_BATCH_ITEM_T &a, const PPD_BATCH_ITEM_T &b)
+{
+	if(a.dir != b.dir) {
+		if(store_location_before(a.dir_location, b.dir_location)) {
+			return true;
+		}
+		if(store_location_before(b.dir_location, a.dir_location)) {
+			return false;
+		}
+		return a.dir < b.dir;
 	}
-	
-	if (false == it->status().ok())
-	{
-		cerr << "An error was found during the scan" << endl;
-		cerr << it->status().ToString() << endl; 
+	if(store_location_before(a.location, b.location)) {
+		return true;
 	}
-	
-	delete it;
+	if(store_location_before(b.location, a.location)) {
+		return false;
+	}
+	return a.index < b.index;
 }
 
-void process_postprocess_queue(const char * db_name)
+/*
+ * gid order is enqueue order, which jumps all over the source disk. A
+ * batch goes out a directory at a time, so the targets are written
+ * together, with the directories in the order their data sits on the
+ * source and each directory's files in disk order too.
+ */
+void ppd_sort_batch(const vector<string> &objs, const vector<PP_ENTRY_T> &entries, vector<size_t> &order)
 {
-	// Set up database connection information and open database
-	leveldb::DB* db;
-	leveldb::Options options;
-	options.create_if_missing = false;
-	
-	leveldb::Status status = leveldb::DB::Open(options, db_name, &db);
-	
-	if (false == status.ok())
+	map<string, STORE_LOCATION_T> dirs;
+	vector<PPD_BATCH_ITEM_T> items;
+
+	items.resize(objs.size());
+	for(size_t i = 0; i < objs.size(); i++) {
+		PPD_BATCH_ITEM_T &item = items[i];
+		item.index = i;
+		size_t slash = objs[i].rfind('/');
+		item.dir = (slash == string::npos) ? "" : objs[i].substr(0, slash);
+
+		// Files that are gone sort last, queue_postprocess_file() drops them
+		string full_path = entries[i].store_path[0] + objs[i];
+		if(store_locate(full_path.c_str(), item.location) != 0) {
+			item.location.dev = (uint64_t)-1;
+		}
+
+		map<string, STORE_LOCATION_T>::iterator mit = dirs.find(item.dir);
+		if(mit == dirs.end()) {
+			dirs[item.dir] = item.location;
+		} else if(store_location_before(item.location, mit->second)) {
+			mit->second = item.location;
+		}
+	}
+
+	for(size_t i = 0; i < items.size(); i++) {
+		items[i].dir_location = dirs[items[i].dir];
+	}
+	sort(items.begin(), items.end(), batch_item_before);
+
+	order.resize(items.size());
+	for(size_t i = 0; i < items.size(); i++) {
+		order[i] = items[i].index;
+	}
+
+	log_msg(LOG_LEVEL_DEBUG, "ppd_sort_batch: %lu files in %lu directories\n",
+		(unsigned long)items.size(), (unsigned long)dirs.size());
+}
+
+/*
+ * Processes queued entries past *cursor, one batch of at most PPD_BATCH
+ * taken in gid order and handed out in disk order. Entries younger than
+ * their migdelay stay queued for a later pass from the start, *deferred_until
+ * is lowered to when the first of them is due (0 is none). Returns how many
+ * were taken off the queue scan.
+ */
+static size_t process_postprocess_batch(uint_least64_t * cursor, uint_least64_t * deferred_until)
+{
+	vector<string> objs;
+	vector<PP_ENTRY_T> entries;
+
+	if(postprocess_scan(*cursor, PPD_BATCH, objs, entries) != 0) {
+		return 0;
+	}
+	if(objs.empty()) {
+		return 0;
+	}
+	size_t scanned = objs.size();
+	*cursor = entries.back().obj_id;
+
+	// Likely to be renamed or deleted soon, not worth copying yet
+	vector<string> ready_objs;
+	vector<PP_ENTRY_T> ready_entries;
+	uint_least64_t now = time(NULL);
+	for(size_t i = 0; i < objs.size(); i++) {
+		uint_least64_t ready_at = entries[i].enqueue_time + migdelay_get(objs[i].c_str());
+		if(now < ready_at) {
+			if(*deferred_until == 0 || ready_at < *deferred_until) {
+				*deferred_until = ready_at;
+			}
+			continue;
+		}
+		ready_objs.push_back(objs[i]);
+		ready_entries.push_back(entries[i]);
+	}
+	if(ready_objs.size() < scanned) {
+		log_msg(LOG_LEVEL_DEBUG, "process_postprocess_batch: %lu of %lu deferred\n",
+			(unsigned long)(scanned - ready_objs.size()), (unsigned long)scanned);
+	}
+
+	vector<size_t> order;
+	ppd_sort_batch(ready_objs, ready_entries, order);
+
+	for(size_t n = 0; n < order.size(); n++) {
+		size_t i = order[n];
+		cout << "Queue: "<< ready_objs[i] << " => " << ready_entries[i].store_path[0] << endl;
+		queue_postprocess_file(ready_objs[i], &ready_entries[i]);
+	}
+
+	return scanned;
+}
+
+void process_postprocess_db() {
+	// One pass over everything queued right now
+	uint_least64_t cursor = 0;
+	uint_least64_t deferred_until = 0;
+	while(process_postprocess_batch(&cursor, &deferred_until) == PPD_BATCH) {
+	}
+	migpool_drain();
+}
+
+void process_postprocess_queue()
+{
+	// Opens the metadata DB if this process hasn't yet
+	if (postprocess_init() != 0)
 	{
-		cerr << "Unable to open/create test database "<< db_name << endl;
-		cerr << status.ToString() << endl;
+		cerr << "Unable to open the post-processing queue" << endl;
+		return;
+	}
+	if (migpool_start(MIGPOOL_WORKERS, process_postprocess_file) != 0)
+	{
+		cerr << "Unable to start the migration workers" << endl;
 		return;
 	}
 	
-	process_postprocess_db(db);
-	
-	// Close the database
-	delete db;
+	process_postprocess_db();
 }
 
-void process_L1obj(leveldb::DB* db, const string path, const string store_path)
+void process_L1obj(const string path, const string store_path)
 {
 	printf("process_L1obj: %s => %s\n", path.c_str(), store_path.c_str());
 
@@ -180,8 +358,8 @@ void process_L1obj(leveldb::DB* db, const string path, const string store_path)
 					retstat = ppd_error("process_L1obj: unlink");
 				}
 				log_msg(LOG_LEVEL_ERROR, "process_L1obj: Removing from queue (path=\"%s\")\n", path.c_str());
-				// @todo: better use a wrapper
-				db->Delete(leveldb::WriteOptions(), path.c_str());
+				// Go through objmap so the path cache drops the entry too
+				objmap_del(path.c_str());
 			}
 		}
 	}
@@ -189,22 +367,26 @@ void process_L1obj(leveldb::DB* db, const string path, const string store_path)
 }
 
 int process_L1obj_db() {
-	leveldb::DB* L1obj = (leveldb::DB*)objmap_hdl(1);
-	if(!L1obj) {
-		if(objmap_init() == -1)
-		{
-			log_msg(LOG_LEVEL_ERROR, "\nprocess_L1obj_db: fail to init L1 objmap\n");
-			return -1;
-		}
+	if(objmap_init() == -1)
+	{
+		log_msg(LOG_LEVEL_ERROR, "\nprocess_L1obj_db: fail to init L1 objmap\n");
+		return -1;
 	}
 
-	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = L1obj->NewIterator(leveldb::ReadOptions());
+	// Iterate over each item in the L1 objmap and print them
+	leveldb::Iterator* it = metadb_iterator(METADB_OBJMAP_L1);
 	
 	for (it->SeekToFirst(); it->Valid(); it->Next())
 	{
-	    cout << "Queue: "<< it->key().ToString() << " => " << it->value().ToString() << endl;
-		process_L1obj(L1obj, it->key().ToString(), it->value().ToString());
+		if(objmap_is_internal_key(it->key().ToString())) {
+			continue;
+		}
+		string store;
+		if(objmap_decode_value(it->value().ToString(), store) != 0) {
+			continue;
+		}
+	    cout << "Queue: "<< it->key().ToString() << " => " << store << endl;
+		process_L1obj(it->key().ToString(), store);
 	}
 	
 	if (false == it->status().ok())
@@ -218,25 +400,53 @@ int process_L1obj_db() {
 	return 0;
 }
 
+/*
+ * Sleeps until something is enqueued, then works through the queue from
+ * the last gid it processed. Entries left behind (failed migrations, or
+ * an enqueue that committed after a later gid) are picked up by going
+ * back to the start of the queue every PPD_RESCAN_INTERVAL, or as soon
+ * as the first entry deferred for its migdelay is due.
+ */
 void * ppd_threadmain(void * arg)
 {
 	log_msg(LOG_LEVEL_ERROR, "ppd_threadmain: entry\n");
 
+	if(migpool_start(MIGPOOL_WORKERS, process_postprocess_file) != 0) {
+		log_msg(LOG_LEVEL_ERROR, "ppd_threadmain: no migration workers, exiting\n");
+		return NULL;
+	}
+
+	uint_least64_t cursor = 0;
+	uint_least64_t deferred_until = 0;
+	time_t last_rescan = time(NULL);
+
 	while(1) {
-		leveldb::DB* postprocess_db = (leveldb::DB*)postprocess_hdl();
-		if(postprocess_db) {
-			log_msg(LOG_LEVEL_DEBUG, "ppd_threadmain: process postprocess queue\n");
-			process_postprocess_db(postprocess_db);
+		unsigned long events = postprocess_events();
+
+		log_msg(LOG_LEVEL_DEBUG, "ppd_threadmain: process postprocess queue past gid %llu\n", (unsigned long long)cursor);
+		if(process_postprocess_batch(&cursor, &deferred_until) == PPD_BATCH) {
+			// More queued already
+			continue;
 		}
 
-		//leveldb::DB* L1obj = (leveldb::DB*)objmap_hdl(1);
-		//if(L1obj) {
+		//if(objmap_init() == 0) {
 		//	log_msg(LOG_LEVEL_DEBUG, "ppd_threadmain: process stats queue\n");
 		//	process_L1obj_db(L1obj);
 		//}
 
-		// @todo: for now all ppd tasks shares the same interval
-		sleep(30);
+		time_t rescan_at = last_rescan + PPD_RESCAN_INTERVAL;
+		if(deferred_until && (time_t)deferred_until < rescan_at) {
+			rescan_at = deferred_until;
+		}
+		time_t now = time(NULL);
+		int timeout_ms = rescan_at > now ? (rescan_at - now) * 1000 : 0;
+
+		if(postprocess_wait(events, timeout_ms) != 0 || time(NULL) >= rescan_at) {
+			// The pass from the start finds the deferred entries again
+			cursor = 0;
+			deferred_until = 0;
+			last_rescan = time(NULL);
+		}
 	}
 
 	log_msg(LOG_LEVEL_ERROR, "ppd_threadmain: end\n");
@@ -248,9 +458,16 @@ void ppd_thread_start()
 {
 	//log_open(PPD_LOGFILE);
 
+	// Once per process
+	static volatile int started = 0;
+	if(__sync_lock_test_and_set(&started, 1)) {
+		return;
+	}
+
 	log_msg(LOG_LEVEL_ERROR, "ppd_thread_start\n");
 	if(pthread_create(&ppd_thread, NULL, ppd_threadmain, NULL)) {
 		ppd_error("Error creating thread\n");
+		started = 0;
 		return;
 	}
 
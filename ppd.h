@@ -1,9 +1,16 @@
 #ifndef __PPD_H__
 #define __PPD_H__
 
-void process_postprocess_queue(const char * db_name);
+#include <string>
+#include <vector>
+
+#include "postprocess.h"
+
+void process_postprocess_queue();
 int process_L1obj_db();
 
 void ppd_thread_start();
+// Indexes of objs in the order a batch is submitted to the migration pool
+void ppd_sort_batch(const vector<string> &objs, const vector<PP_ENTRY_T> &entries, vector<size_t> &order);
 
 #endif
@@ -2,6 +2,7 @@
 #include <sstream>
 #include <string>
 #include <errno.h>
+#include <string.h>
 #include "log.h"
 #include "store.h"
 #include "objmap.h"
@@ -14,8 +15,20 @@ int main(int argc, char** argv)
 {
 	log_open(PPDMAIN_LOGFILE);
 	objmap_init();
+
+	// Offline only, the mounted filesystem holds the metadata DB
+	if(argc == 4 && strcmp(argv[1], "--relocate") == 0) {
+		if(objmap_relocate_store(argv[2], argv[3]) != 0) {
+			cerr << "Cannot relocate store " << argv[2] << " to " << argv[3] << endl;
+			return 1;
+		}
+		cout << "Relocated store " << argv[2] << " to " << argv[3] << endl;
+		return 0;
+	}
+
+	// Unmounted only too, a mount runs the migrations in its own ppd thread
 	cout << "=========POSTPROCESSING============" << endl;
-	process_postprocess_queue(POSTPROCESS_DB.c_str());
+	process_postprocess_queue();
 	cout << endl;
 	
 	return 0;
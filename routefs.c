@@ -26,10 +26,23 @@
 #include "routefs.h"
 #include "store.h"
 #include "rootmap.h"
+#include "migdelay.h"
+#include "migpool.h"
 #include "objmap.h"
+#include "storecopy.h"
+#include "storereg.h"
+#include "storeverify.h"
+#include "throttle.h"
+#ifdef OBJMAP_MIRROR
+#include "objmirror.h"
+#endif
 #include "postprocess.h"
 #include "ppd.h"
 #include "stats.h"
+#include "accesslog.h"
+#include "metatxn.h"
+#include "pathcache.h"
+#include "negcache.h"
 
 #include <ctype.h>
 #include <dirent.h>
@@ -145,13 +158,20 @@ static const char * get_suffix(const char * path) {
 /*
  * NULL if no specific type is found
  */
-static const string get_realdir(const char * path)
+const string get_realdir(const char * path)
 {
 	string dest;
 	if(!path) return NULL;
 
-	// Check ObjMap first
+	// Check the resolution cache first, a warm path never touches LevelDB
 	string destStr;
+	if(pathcache_get(path, destStr) == 0) {
+		log_msg(LOG_LEVEL_DEBUG, "get_realdir: found in pathcache: path[%s]=>dest[%s]\n", path, destStr.c_str());
+		return destStr;
+	}
+	unsigned long cache_gen = pathcache_gen(path);
+
+	// Check ObjMap then
 	// @todo: it's all hardcoded now
 	log_msg(LOG_LEVEL_DEBUG, "get_realdir: found in objmap: path[%s]\n", path);
 
@@ -167,6 +187,7 @@ static const string get_realdir(const char * path)
 	if(ret == 0) {
 		// Found the obj in the objmap db
 		log_msg(LOG_LEVEL_DEBUG, "get_realdir: found in objmap: path[%s]=>dest[%s]\n", path, destStr.c_str());
+		pathcache_set(path, destStr.c_str(), cache_gen);
 		return destStr.c_str();
 	}
 	// e.g. rootdir = /store/root/access
@@ -174,6 +195,8 @@ static const string get_realdir(const char * path)
 	const char * suffix = get_suffix(path);
 	log_msg(LOG_LEVEL_DEBUG, "get_realdir: found in objmap: path[%s]\n", path);
 	dest = rootmap_getdest(suffix);
+	// The objmap miss is cached too, objmap_set() invalidates it once the object exists
+	pathcache_set(path, dest.c_str(), cache_gen);
 
 	log_msg(LOG_LEVEL_DEBUG, "get_realdir: path[%s] hint[%s] dest[%s]\n", path, suffix, dest.c_str());
 	return dest;
@@ -181,7 +204,7 @@ static const string get_realdir(const char * path)
 
 // Basically, strip the path off the full path and store it
 // @todo: do we really have to do this?
-static void ifs_set_objmap(const char *path, const char * dest) {
+void ifs_set_objmap(const char *path, const char * dest) {
 	string destStr(dest);
 	size_t loc = destStr.find(path);
 	if(loc != string::npos) {
@@ -242,6 +265,13 @@ int ifs_getattr(const char *path, struct stat *statbuf)
 	char fpath[PATH_MAX];
 
 	log_msg(LOG_LEVEL_DEBUG, "\nifs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, statbuf);
+
+	// Repeated probes of missing names are answered from memory
+	if (negcache_lookup(path)) {
+		return -ENOENT;
+	}
+	unsigned long neg_gen = negcache_gen(path);
+
 	ifs_fullpath(fpath, path);
 
 	retstat = lstat(fpath, statbuf);
@@ -250,6 +280,9 @@ int ifs_getattr(const char *path, struct stat *statbuf)
 		// Key performance function, get rid of unneccessary performance
 		retstat = ifs_error("ifs_getattr lstat", 0); // no log
 		// log_stat(statbuf);
+		if (retstat == -ENOENT) {
+			negcache_add(path, neg_gen);
+		}
 	}
 
 	return retstat;
@@ -329,6 +362,7 @@ int ifs_mknod(const char *path, mode_t mode, dev_t dev)
 		if (retstat < 0)
 			retstat = ifs_error("ifs_mknod mknod");
 	}
+	negcache_invalidate(path);
 	
 	return retstat;
 }
@@ -356,6 +390,7 @@ int ifs_mkdir(const char *path, mode_t mode)
 		retstat = ifs_error("ifs_mkdir mkdir");
 		return retstat;
 	}
+	negcache_invalidate(path);
 
 	return 0;
 }
@@ -373,26 +408,45 @@ int ifs_unlink(const char *path)
 	log_msg(LOG_LEVEL_DEBUG, "ifs_unlink(path=\"%s\")\n",
 		path);
 
+	// All the metadata goes out in one commit at the end
+	META_TXN_T * txn = metatxn_begin();
+
 	ifs_fullpath(fpath, path);
+	// What a still queued migration would have copied
+	struct stat statbuf;
+	off_t size = (lstat(fpath, &statbuf) == 0) ? statbuf.st_size : 0;
 	retstat1 = unlink(fpath);
 	if (retstat1 < 0) {
 		retstat1 = ifs_warn("ifs_unlink unlink no such file in L1");
+	} else {
+		accesslog_forget(path);
+		postprocess_cancel(path, size);
 	}
-	objmap_del(path);
-	stats_del(path);
+	objmap_del(path, 1, txn);
+	stats_del(path, txn);
+	storeverify_del(path, txn);
 
 	#ifdef CACHE_MODE
 	// Tricky, in cached mode
 	// it could have 2 copies, this is the second copy
-	ifs_fullpath(fpath, path);
-	retstat2 = unlink(fpath);
+	string store2;
+	if (objmap_get(path, store2, 2) == 0) {
+		strcpy(fpath, store2.c_str());
+		strncat(fpath, path, PATH_MAX - 1); // ridiculously long paths will break here
+		retstat2 = unlink(fpath);
+	} else {
+		errno = ENOENT;
+		retstat2 = -1;
+	}
 	if (retstat2 < 0) {
-		ifs_warn("ifs_unlink no such file in L2");
+		retstat2 = ifs_warn("ifs_unlink no such file in L2");
 		// retstat = ifs_error("ifs_unlink unlink");
 	}
-	objmap_del(path, 2);
+	objmap_del(path, 2, txn);
 	//stats_del(path); // Intentional, no need to delete, stats is for L1
 	#endif
+
+	metatxn_commit(txn);
 	
 	if(retstat1 < 0 && retstat2 < 0) {
 		retstat = retstat1;
@@ -446,6 +500,7 @@ int ifs_symlink(const char *path, const char *link)
     retstat = symlink(path, flink);
     if (retstat < 0)
 	retstat = ifs_error("ifs_symlink symlink");
+    negcache_invalidate(link);
     
     return retstat;
 }
@@ -478,6 +533,8 @@ int ifs_rename(const char *path, const char *newpath)
 		log_msg(LOG_LEVEL_DEBUG, "\nifs_rename:dir(fpath=\"%s\", fnewpath=\"%s\")\n",
 			fpath, fnewpath);
 		retstat = store_rename(path, newpath);
+		// Every cached object below the old dir is gone now
+		pathcache_clear();
 		if (retstat < 0) {
 			retstat = ifs_error("ifs_rename store_rename");
 			return retstat;
@@ -491,8 +548,18 @@ int ifs_rename(const char *path, const char *newpath)
 			fpath, fnewpath);
 	}
 
+	// A file replaced by the rename dies with it
+	struct stat newstatbuf;
+	int replaces = (!path_is_dir && lstat(fnewpath, &newstatbuf) == 0);
+
 	// Only after all store path is update can the root be updated.
 	retstat = rename(fpath, fnewpath);
+	if (path_is_dir) {
+		// The whole subtree just appeared under newpath
+		negcache_invalidate_all();
+	} else {
+		negcache_invalidate(newpath);
+	}
 
 	if (retstat < 0) {
 		retstat = ifs_error("ifs_rename rename");
@@ -510,13 +577,23 @@ int ifs_rename(const char *path, const char *newpath)
 		string store_path;
 		int ret = objmap_get(path, store_path);
 		if(ret != -1) {
-			// Update the database only after rename is successful
-			objmap_set(newpath, store_path.c_str());
-			// Only delete old entries if newpath is recorded
-			objmap_del(path);
+			// Update the database only after rename is successful,
+			// old and new entries switch over in a single commit
+			META_TXN_T * txn = metatxn_begin();
+			objmap_set(newpath, store_path.c_str(), 1, txn);
+			objmap_del(path, 1, txn);
+			storeverify_rename(path, newpath, txn);
 			#ifdef CACHE_MODE
-			objmap_del(path, 2);
+			objmap_del(path, 2, txn);
 			#endif
+			metatxn_commit(txn);
+
+			if(replaces) {
+				accesslog_forget(newpath);
+				postprocess_cancel(newpath, newstatbuf.st_size);
+			}
+			accesslog_rename(path, newpath);
+			postprocess_rename(path, newpath);
 		} else {
 			retstat = ifs_error("ifs_rename rename: cannot find obj in objmap");
 		}
@@ -541,6 +618,7 @@ int ifs_link(const char *path, const char *newpath)
     retstat = link(fpath, fnewpath);
     if (retstat < 0)
 	retstat = ifs_error("ifs_link link");
+    negcache_invalidate(newpath);
     
     return retstat;
 }
@@ -673,12 +751,9 @@ int ifs_open(const char *path, struct fuse_file_info *fi)
 	if (fd < 0)
 		retstat = ifs_error("ifs_open open");
 		
-	// Update the stats records
-	char timestamp[128];
-	snprintf(timestamp, 128, "%d",(unsigned)time(NULL));
-	stats_set(path, timestamp);
+	// Update the stats records, written out by the accesslog flusher
 	// @todo: right, not just from target to source
-	postprocess_set(path, 0, STORE_DATA_STAGING_TARGET.store_name, STORE_DATA_STAGING_SOURCE.store_name);
+	accesslog_record(path, STORE_DATA_STAGING_TARGET.store_name.c_str(), STORE_DATA_STAGING_SOURCE.store_name.c_str());
 
 	fi->fh = fd;
 
@@ -715,7 +790,9 @@ int ifs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 	// no need to get fpath on this one, since I work from fi->fh not the path
 	log_fi(fi);
 
+	unsigned long long start_us = throttle_clock_us();
 	bytes_read = pread(fi->fh, buf, size, offset);
+	throttle_sample(throttle_clock_us() - start_us);
 	if (retstat < 0) {
 		bytes_read = -1;
 		retstat = ifs_error("ifs_read read");
@@ -750,7 +827,9 @@ int ifs_write(const char *path, const char *buf, size_t size, off_t offset,
 
 	//log_msg(LOG_LEVEL_DEBUG, "\nifs_write(path=\"%s\") writing master data buf=%p size=%d offset=%d\n",
 	//	path, buf, size, offset);
+	unsigned long long start_us = throttle_clock_us();
 	bytes_written = pwrite(fi->fh, buf, size, offset);
+	throttle_sample(throttle_clock_us() - start_us);
 
 	if (retstat < 0) {
 		log_fi(fi);
@@ -761,6 +840,91 @@ int ifs_write(const char *path, const char *buf, size_t size, off_t offset,
 	return bytes_written;
 }
 
+/** Read data from an open file, without copying it
+ *
+ * Hands libfuse a buffer that points at the backing fd, so the data can be
+ * spliced from the store straight into /dev/fuse.
+ *
+ * Introduced in version 2.9
+ */
+int ifs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	AutoTimer _timer(__FUNCTION__);
+
+	struct fuse_bufvec *src;
+
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_read_buf(path=\"%s\", size=%d, offset=%lld, fi=0x%08x)\n",
+		path, size, offset, fi);
+
+	src = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL) {
+		return -ENOMEM;
+	}
+
+	// The spliced read happens after we return, now and then read through
+	// memory so adaptive throttling sees the store's read latency
+	if (throttle_want_sample()) {
+		char *mem = (char *)malloc(size);
+		if (mem == NULL) {
+			free(src);
+			return -ENOMEM;
+		}
+		unsigned long long start_us = throttle_clock_us();
+		ssize_t bytes_read = pread(fi->fh, mem, size, offset);
+		throttle_sample(throttle_clock_us() - start_us);
+		if (bytes_read < 0) {
+			int retstat = ifs_error("ifs_read_buf pread");
+			free(mem);
+			free(src);
+			return retstat;
+		}
+
+		// libfuse frees mem along with the bufvec
+		*src = FUSE_BUFVEC_INIT((size_t)bytes_read);
+		src->buf[0].mem = mem;
+		*bufp = src;
+		return 0;
+	}
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+
+	return 0;
+}
+
+/** Write data to an open file, without copying it
+ *
+ * The incoming buffer may still be a pipe from /dev/fuse, fuse_buf_copy()
+ * splices it into the backing fd when it can.
+ *
+ * Introduced in version 2.9
+ */
+int ifs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fi)
+{
+	AutoTimer _timer(__FUNCTION__);
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_write_buf(path=\"%s\", offset=%lld, fi=0x%08x)\n",
+		path, offset, fi);
+
+	dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	unsigned long long start_us = throttle_clock_us();
+	ssize_t bytes_written = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	throttle_sample(throttle_clock_us() - start_us);
+
+	return bytes_written;
+}
+
 /** Get file system statistics
  *
  * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -1070,9 +1234,11 @@ int ifs_opendir(const char *path, struct fuse_file_info *fi)
 	dp = opendir(fpath);
 	if (dp == NULL) {
 		retstat = ifs_error("ifs_opendir opendir");
+		return retstat;
 	}
 
-	fi->fh = (intptr_t) dp;
+	// The cursor merges the root dir with the objmap across readdir calls
+	fi->fh = (intptr_t) store_opendir(dp, path);
 
 	log_fi(fi);
 
@@ -1106,46 +1272,22 @@ int ifs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 	AutoTimer _timer(__FUNCTION__);
 
 	int retstat = 0;
-	DIR *dp;
-	struct dirent *de;
-	
-	// @todo: I know...this is slow and memory consuming and not scalable...
-	map<string, int> parent_files;
+	STORE_DIR_T *dir;
+	string name;
 
 	log_msg(LOG_LEVEL_DEBUG, "\nifs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 		path, buf, filler, offset, fi);
 
-	// once again, no need for fullpath -- but note that I need to cast fi->fh
-	dp = (DIR *) (uintptr_t) fi->fh;
+	dir = (STORE_DIR_T *) (uintptr_t) fi->fh;
 
-	// Every directory contains at least two entries: . and ..  If my
-	// first call to the system readdir() returns NULL I've got an
-	// error; near as I can tell, that's the only condition under
-	// which I can get an error from readdir()
-	de = readdir(dp);
-	if (de == 0) {
-		retstat = ifs_error("ifs_readdir readdir");
-		return retstat;
-	}
-
-	// This will copy the entire directory into the buffer.  The loop exits
-	// when either the system readdir() returns NULL, or filler()
-	// returns something non-zero.  The first case just means I've
-	// read the whole directory; the second means the buffer is full.
-	do {
-		log_msg(LOG_LEVEL_DEBUG, "calling filler with name %s\n", de->d_name);
-		parent_files[de->d_name] = 1;
-		if (filler(buf, de->d_name, NULL, 0) != 0) {
-			log_msg(LOG_LEVEL_ERROR, "    ERROR ifs_readdir filler:  buffer full");
-			return -ENOMEM;
+	// Offsets are entry numbers: each entry carries the number of the
+	// next one, and filler() returns 1 once the buffer is full. The next
+	// call then continues from that entry without rereading anything.
+	for (off_t off = offset; store_dir_entry(dir, off, name) == 0; off++) {
+		log_msg(LOG_LEVEL_DEBUG, "calling filler with name %s\n", name.c_str());
+		if (filler(buf, name.c_str(), NULL, off + 1) != 0) {
+			break;
 		}
-	} while ((de = readdir(dp)) != NULL);
-
-	// Read the store list second, the order IS important
-	retstat = store_readdir( path, buf, filler, offset, fi, parent_files);
-	if (retstat < 0) {
-		retstat = ifs_error("ifs_readdir store_readdir");
-		return retstat;
 	}
 
 	log_fi(fi);
@@ -1167,7 +1309,7 @@ int ifs_releasedir(const char *path, struct fuse_file_info *fi)
 	    path, fi);
     log_fi(fi);
     
-    closedir((DIR *) (uintptr_t) fi->fh);
+    store_closedir((STORE_DIR_T *) (uintptr_t) fi->fh);
     
     return retstat;
 }
@@ -1217,6 +1359,26 @@ void *ifs_init(struct fuse_conn_info *conn)
 
 	log_msg(LOG_LEVEL_DEBUG, "\nifs_init()\n");
 
+#ifdef FUSE_CAP_SPLICE_READ
+	// Let read_buf/write_buf splice between /dev/fuse and the store fds
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+
+	ifs_init_components(IFS_DATA);
+
+	return IFS_DATA;
+}
+
+/**
+ * Bring up the metadata databases shared by both frontends
+ *
+ * Called from ifs_init() and from the low-level init, which has no
+ * fuse_context to find the private data in.
+ */
+int ifs_init_components(struct ifs_state * state)
+{
+	AutoTimer _timer(__FUNCTION__);
+
 	int status = 0;
 
 	/*
@@ -1226,10 +1388,10 @@ void *ifs_init(struct fuse_conn_info *conn)
 	
 
 	// Initialize the type map
-	status = rootmap_init(IFS_DATA->rootdir, default_datadir.c_str());
+	status = rootmap_init(state->rootdir, default_datadir.c_str());
 	if (0 != status) {
 		log_msg(LOG_LEVEL_ERROR, "Failed to initialize rootmap\n");
-		return IFS_DATA;
+		return -1;
 	}
 	log_msg(LOG_LEVEL_ERROR, "Initialized rootmap\n");
 
@@ -1245,7 +1407,7 @@ void *ifs_init(struct fuse_conn_info *conn)
 	status = objmap_init();
 	if (0 != status) {
 		log_msg(LOG_LEVEL_ERROR, "Failed to initialize objmap\n");
-		return IFS_DATA;
+		return -1;
 	}
 	log_msg(LOG_LEVEL_ERROR, "Initialized objmap\n");
 
@@ -1253,7 +1415,7 @@ void *ifs_init(struct fuse_conn_info *conn)
 	status = postprocess_init();
 	if (0 != status) {
 		log_msg(LOG_LEVEL_ERROR, "Failed to initialize postprocess\n");
-		return IFS_DATA;
+		return -1;
 	}
 	log_msg(LOG_LEVEL_ERROR, "Initialized postprocess\n");
 
@@ -1261,18 +1423,27 @@ void *ifs_init(struct fuse_conn_info *conn)
 	status = stats_init();
 	if (0 != status) {
 		log_msg(LOG_LEVEL_ERROR, "Failed to initialize stats\n");
-		return IFS_DATA;
+		return -1;
 	}
 	log_msg(LOG_LEVEL_ERROR, "Initialized stats\n");
 
-	// Initialize the post-process queue thread
-	// ppd_thread_start();
-	// log_msg(LOG_LEVEL_ERROR, "Initialized ppd thread\n");
+	// Start the access tracking flusher
+	status = accesslog_start();
+	if (0 != status) {
+		log_msg(LOG_LEVEL_ERROR, "Failed to start accesslog flusher\n");
+		return -1;
+	}
+	log_msg(LOG_LEVEL_ERROR, "Started accesslog flusher\n");
 
-	snprintf(IFS_DATA->rootdir,  PATH_MAX, "%s", default_datadir.c_str());
+	snprintf(state->rootdir,  PATH_MAX, "%s", default_datadir.c_str());
 	log_msg(LOG_LEVEL_ERROR, "Set real data dir\n");
 
-	return IFS_DATA;
+	// Migrations run in-process, the mount holds the only metadata DB handle
+	// and enqueues wake the scheduler up
+	ppd_thread_start();
+	log_msg(LOG_LEVEL_ERROR, "Initialized ppd thread\n");
+
+	return 0;
 }
 
 /**
@@ -1287,6 +1458,8 @@ void ifs_destroy(void *userdata)
 	AutoTimer _timer(__FUNCTION__);
 
 	log_msg(LOG_LEVEL_DEBUG, "\nifs_destroy(userdata=0x%08x)\n", userdata);
+
+	accesslog_stop();
 }
 
 /**
@@ -1349,6 +1522,7 @@ int ifs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	fd = creat(fpath, mode); // Force failure if file exists!
 	if (fd < 0)
 		retstat = ifs_error("ifs_create creat");
+	negcache_invalidate(path);
 		
 	fi->fh = fd;
 
@@ -1423,35 +1597,25 @@ int ifs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *
 
 #include "ifsctl.h"
 
-enum {
-        FIOC_NONE,
-        FIOC_ROOT,
-        FIOC_FILE,
-};
-
-static int fioc_file_type(const char *path)
-{
-	if (strcmp(path, "/") == 0)
-	{
-		return FIOC_ROOT;
-	}
-	return FIOC_FILE;
-}
-
+// Any object takes the commands, the root included, same as ifs_ll_ioctl()
 int ifs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
 {
+	(void) path;
 	(void) arg;
 	(void) fi;
 	(void) flags;
 	log_msg(LOG_LEVEL_ERROR, "\nifs_ioctl received\n");
 
-	if (fioc_file_type(path) != FIOC_FILE) {
-		return -EINVAL;
-	}
 	if (flags & FUSE_IOCTL_COMPAT) {
 		return -ENOSYS;
 	}
 
+	return ifs_ioctl_dispatch(cmd, data);
+}
+
+// Shared by the path based and the low-level ioctl handlers
+int ifs_ioctl_dispatch(int cmd, void *data)
+{
 	switch (cmd) {
 	case IFSIOC_PRINTDB:
 		log_msg(LOG_LEVEL_ERROR, "\nifs_ioctl: PRINTDB\n");
@@ -1468,6 +1632,12 @@ int ifs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, u
 			return ifs_error("ifs_ioctl fail to print db level 2", 0);
 		}
 
+		storereg_dump_to_log();
+
+#ifdef OBJMAP_MIRROR
+		objmirror_report();
+#endif
+
 		if(postprocess_dump_to_log() == -1)
 		{
 			log_msg(LOG_LEVEL_ERROR, "\nifs_ioctl: fail to print postprocess db\n");
@@ -1480,6 +1650,12 @@ int ifs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, u
 			return ifs_error("ifs_ioctl fail to print stats db", 0);
 		}
 
+		migpool_dump_to_log();
+		storecopy_dump_to_log();
+		storeverify_dump_to_log();
+		throttle_dump_to_log();
+		migdelay_dump_to_log();
+
 		log_msg(LOG_LEVEL_ERROR, "\nifs_ioctl: PRINTDB done\n");
 		return 0;
 
@@ -1493,6 +1669,25 @@ int ifs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, u
 		log_msg(LOG_LEVEL_ERROR, "\nifs_ioctl: EVICT done\n");
 		return 0;
 
+	case IFSIOC_THROTTLE:
+	{
+		if(!data) {
+			return -EINVAL;
+		}
+		struct ifs_throttle_arg * throttle_arg = (struct ifs_throttle_arg *)data;
+		throttle_arg->store[sizeof(throttle_arg->store) - 1] = '\0';
+		log_msg(LOG_LEVEL_ERROR, "\nifs_ioctl: THROTTLE store \"%s\" rate %llu target %ld\n",
+			throttle_arg->store, throttle_arg->rate, throttle_arg->target_us);
+
+		if(throttle_arg->store[0] && throttle_set_rate(throttle_arg->store, throttle_arg->rate) != 0) {
+			return ifs_error("ifs_ioctl fail to set the migration rate", 0);
+		}
+		if(throttle_arg->target_us >= 0 && throttle_set_adaptive(throttle_arg->target_us) != 0) {
+			return ifs_error("ifs_ioctl fail to set the adaptive target", 0);
+		}
+		return 0;
+	}
+
 	}
 
 	return -EINVAL;
@@ -1519,6 +1714,8 @@ struct ifs_fuse_operations:fuse_operations {
 		open = ifs_open;
 		read = ifs_read;
 		write = ifs_write;
+		read_buf = ifs_read_buf;
+		write_buf = ifs_write_buf;
 		ioctl = ifs_ioctl;
 		statfs = ifs_statfs;
 		flush = ifs_flush;
@@ -1578,13 +1775,15 @@ struct fuse_operations ifs_oper = {
   .access = ifs_access,
   .create = ifs_create,
   .ftruncate = ifs_ftruncate,
-  .fgetattr = ifs_fgetattr
+  .fgetattr = ifs_fgetattr,
+  .read_buf = ifs_read_buf,
+  .write_buf = ifs_write_buf
 };
 #endif
 
 void ifs_usage()
 {
-    fprintf(stderr, "usage:  routefs [FUSE and mount options] rootDir mountPoint\n");
+    fprintf(stderr, "usage:  routefs [--lowlevel] [FUSE and mount options] rootDir mountPoint\n");
 }
 
 int rfs_init(const char * rootdir)
@@ -1614,6 +1813,7 @@ int rfs_init(const char * rootdir)
 int main(int argc, char *argv[])
 {
 	int fuse_stat;
+	int use_lowlevel = 0;
 	struct ifs_state *ifs_data;
 
 	// routefs doesn't do any access checking on its own (the comment
@@ -1640,6 +1840,19 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	// Our own switch, strip it before fuse parses the options
+	if (strcmp(argv[1], "--lowlevel") == 0) {
+		use_lowlevel = 1;
+		for (int cnt = 1; cnt < argc - 1; cnt++) {
+			argv[cnt] = argv[cnt + 1];
+		}
+		argc--;
+		if (argc < 3) {
+			ifs_usage();
+			return 1;
+		}
+	}
+
 	ifs_data = (struct ifs_state *)malloc(sizeof(struct ifs_state));
 	if (ifs_data == NULL) {
 		perror("main calloc");
@@ -1669,7 +1882,11 @@ int main(int argc, char *argv[])
 	for (int cnt = 0; cnt < argc; cnt++) {
 		printf("fuse_main args: %s\n", argv[cnt]);
 	}
-	fuse_stat = fuse_main(argc, argv, &ifs_oper, ifs_data);
+	if (use_lowlevel) {
+		fuse_stat = ifs_ll_main(argc, argv, ifs_data);
+	} else {
+		fuse_stat = fuse_main(argc, argv, &ifs_oper, ifs_data);
+	}
 	fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
 
 	return fuse_stat;
@@ -29,4 +29,19 @@ int ifs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 }
 #endif
 
+#ifdef __cplusplus
+#include <string>
+
+struct ifs_state;
+
+// Shared between the path based frontend and the low-level one
+extern const std::string get_realdir(const char * path);
+extern void ifs_set_objmap(const char *path, const char * dest);
+extern int ifs_init_components(struct ifs_state * state);
+extern int ifs_ioctl_dispatch(int cmd, void *data);
+
+// Low-level (inode based) frontend, see routefs_ll.c
+extern int ifs_ll_main(int argc, char *argv[], struct ifs_state * state);
+#endif
+
 #endif
@@ -0,0 +1,1353 @@
+/*
+  routefs low-level frontend
+  Copyright (C) 2014 Bury Huang
+
+  Inode based implementation on top of fuse_lowlevel_ops. The kernel
+  hands us (parent inode, name) pairs instead of full path strings, and
+  every inode remembers the store it resolved to plus O_PATH dirfds for
+  directories. Most requests therefore end up as one *at() syscall
+  relative to the parent's dirfd, instead of an ifs_fullpath() string
+  build and a full path walk in the backing filesystem.
+
+  Opens are not handed to the kernel with FUSE passthrough: that needs
+  libfuse >= 3.17 (fuse_passthrough_open(), fi->backing_id, and revoking
+  the backing id when ppd migrates the object), while this frontend and
+  the fuse_operations one in routefs.c still share the fuse 2.9 session
+  API. It waits for a fuse3 port of both; until then reads and writes
+  are spliced through read_buf/write_buf.
+
+  Started with "routefs --lowlevel [FUSE and mount options] rootDir mountPoint"
+*/
+
+#include "params.h"
+#include "log.h"
+#include "routefs.h"
+#include "store.h"
+#include "objmap.h"
+#include "postprocess.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "metatxn.h"
+#include "pathcache.h"
+#include "negcache.h"
+#include "storeverify.h"
+#include "throttle.h"
+#include "utils.h"
+
+#include <fuse_lowlevel.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// How long the kernel may trust our answers without asking again.
+// Everything that changes the namespace goes through the kernel, so
+// these only guard against ppd moving data under us.
+#define IFS_LL_ENTRY_TIMEOUT 1.0
+#define IFS_LL_ATTR_TIMEOUT 1.0
+
+struct IFS_INODE_T
+{
+	IFS_INODE_T * parent;
+	string name;
+	bool is_dir;
+	// Set once unlinked/renamed over, the name no longer belongs to us
+	bool detached;
+
+	// Store the object resolved to, and the objmap epoch it was resolved at
+	string store;
+	unsigned long store_epoch;
+
+	// Directories only: store root -> O_PATH fd of this dir in that store
+	map<string, int> dirfds;
+	map<string, IFS_INODE_T *> children;
+	unsigned long nchildren;
+
+	uint64_t nlookup;
+};
+
+static struct ifs_state * _ll_state = NULL;
+static IFS_INODE_T _ll_root;
+static pthread_mutex_t _ll_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Report errors to logfile and give errno to caller
+static int ll_error(const char *str, int log=1)
+{
+	int ret = errno;
+	if(log) {
+		log_msg(LOG_LEVEL_ERROR, "    ERROR %s: %s\n", str, strerror(errno));
+	}
+	return ret;
+}
+
+static IFS_INODE_T * ll_inode(fuse_ino_t ino)
+{
+	if(ino == FUSE_ROOT_ID) {
+		return &_ll_root;
+	}
+	return (IFS_INODE_T *)(uintptr_t)ino;
+}
+
+static fuse_ino_t ll_ino(IFS_INODE_T * inode)
+{
+	if(inode == &_ll_root) {
+		return FUSE_ROOT_ID;
+	}
+	return (fuse_ino_t)(uintptr_t)inode;
+}
+
+/*
+ * with _ll_mutex held
+ */
+static string ll_path_locked(IFS_INODE_T * inode)
+{
+	if(inode == &_ll_root) {
+		return "/";
+	}
+
+	string path;
+	for(; inode != &_ll_root; inode = inode->parent) {
+		path = "/" + inode->name + path;
+	}
+	return path;
+}
+
+static string ll_path(IFS_INODE_T * inode)
+{
+	AutoLock lock(&_ll_mutex);
+	return ll_path_locked(inode);
+}
+
+static string ll_child_path(IFS_INODE_T * parent, const char * name)
+{
+	string path = ll_path(parent);
+	if(path != "/") {
+		path += "/";
+	}
+	path += name;
+	return path;
+}
+
+// Same resolution ifs_fullpath() does, minus the concatenation
+static string ll_realdir(const string &path)
+{
+	string realdir = get_realdir(path.c_str());
+	if(realdir.empty()) {
+		realdir = _ll_state->rootdir;
+	}
+	return realdir;
+}
+
+/*
+ * with _ll_mutex held
+ * The O_PATH fd of dir inside the given store if it is open already,
+ * otherwise -1 and the path to open it by.
+ */
+static int ll_dirfd_cached_locked(IFS_INODE_T * dir, const string &store, string &fpath)
+{
+	map<string, int>::iterator mit = dir->dirfds.find(store);
+	if(mit != dir->dirfds.end()) {
+		return mit->second;
+	}
+
+	fpath = store + ll_path_locked(dir);
+	return -1;
+}
+
+/*
+ * with _ll_mutex held
+ * Publishes fd, opened by fpath without the lock. Whoever got there first
+ * wins, and a dir renamed meanwhile may have opened something else: then
+ * -EAGAIN and the caller starts over.
+ */
+static int ll_dirfd_publish_locked(IFS_INODE_T * dir, const string &store, const string &fpath, int fd)
+{
+	map<string, int>::iterator mit = dir->dirfds.find(store);
+	if(mit != dir->dirfds.end()) {
+		close(fd);
+		return mit->second;
+	}
+	if(store + ll_path_locked(dir) != fpath) {
+		close(fd);
+		return -EAGAIN;
+	}
+
+	dir->dirfds[store] = fd;
+	return fd;
+}
+
+/*
+ * Returns the O_PATH fd of dir inside the given store, opened on first use.
+ * The open runs without _ll_mutex, one slow store mustn't hold up lookups
+ * everywhere else.
+ */
+static int ll_dirfd(IFS_INODE_T * dir, const string &store)
+{
+	while(1) {
+		string fpath;
+		{
+			AutoLock lock(&_ll_mutex);
+			int fd = ll_dirfd_cached_locked(dir, store, fpath);
+			if(fd >= 0) {
+				return fd;
+			}
+		}
+
+		int fd = open(fpath.c_str(), O_PATH | O_DIRECTORY);
+		if(fd < 0) {
+			// The store may not have this directory (yet)
+			return -errno;
+		}
+
+		AutoLock lock(&_ll_mutex);
+		fd = ll_dirfd_publish_locked(dir, store, fpath, fd);
+		if(fd != -EAGAIN) {
+			return fd;
+		}
+	}
+}
+
+static int ll_rootfd(IFS_INODE_T * dir)
+{
+	return ll_dirfd(dir, _ll_state->rootdir);
+}
+
+/*
+ * Resolve an inode to (dirfd, name) for the *at() calls.
+ * The cached store is reused until objmap changes, ppd may have moved it.
+ */
+static int ll_locate(IFS_INODE_T * inode, int &dirfd, string &name)
+{
+	if(inode == &_ll_root) {
+		dirfd = ll_rootfd(inode);
+		name = ".";
+		return dirfd < 0 ? dirfd : 0;
+	}
+
+	unsigned long epoch = objmap_epoch();
+	string store;
+	{
+		AutoLock lock(&_ll_mutex);
+		if(inode->is_dir || inode->store_epoch == epoch) {
+			store = inode->store;
+		}
+	}
+
+	if(store.empty()) {
+		store = ll_realdir(ll_path(inode));
+		AutoLock lock(&_ll_mutex);
+		inode->store = store;
+		inode->store_epoch = epoch;
+	}
+
+	// Like ll_dirfd(), but the parent may change (and the old one go away)
+	// while the lock is dropped, only inode itself is held by the kernel
+	while(1) {
+		IFS_INODE_T * parent;
+		string fpath;
+		{
+			AutoLock lock(&_ll_mutex);
+			parent = inode->parent;
+			name = inode->name;
+			dirfd = ll_dirfd_cached_locked(parent, store, fpath);
+			if(dirfd >= 0) {
+				return 0;
+			}
+		}
+
+		int fd = open(fpath.c_str(), O_PATH | O_DIRECTORY);
+		if(fd < 0) {
+			dirfd = -errno;
+			return dirfd;
+		}
+
+		AutoLock lock(&_ll_mutex);
+		if(inode->parent != parent) {
+			close(fd);
+			continue;
+		}
+		dirfd = ll_dirfd_publish_locked(parent, store, fpath, fd);
+		if(dirfd != -EAGAIN) {
+			name = inode->name;
+			return dirfd < 0 ? dirfd : 0;
+		}
+	}
+}
+
+/*
+ * with _ll_mutex held
+ * Free inodes the kernel forgot about, walking up while parents become unused
+ */
+static void ll_release_locked(IFS_INODE_T * inode)
+{
+	while(inode != &_ll_root && inode->nlookup == 0 && inode->nchildren == 0) {
+		IFS_INODE_T * parent = inode->parent;
+
+		if(!inode->detached) {
+			map<string, IFS_INODE_T *>::iterator mit = parent->children.find(inode->name);
+			if(mit != parent->children.end() && mit->second == inode) {
+				parent->children.erase(mit);
+			}
+		}
+		parent->nchildren--;
+
+		map<string, int>::iterator fit;
+		for(fit = inode->dirfds.begin(); fit != inode->dirfds.end(); fit++) {
+			close(fit->second);
+		}
+		delete inode;
+
+		inode = parent;
+	}
+}
+
+/*
+ * with _ll_mutex held
+ * The name is gone from the namespace, keep the inode until forgotten
+ */
+static void ll_detach_locked(IFS_INODE_T * parent, const char * name)
+{
+	map<string, IFS_INODE_T *>::iterator mit = parent->children.find(name);
+	if(mit == parent->children.end()) {
+		return;
+	}
+	IFS_INODE_T * inode = mit->second;
+	parent->children.erase(mit);
+	inode->detached = true;
+	ll_release_locked(inode);
+}
+
+/*
+ * Register (or find) the inode for parent/name and fill in the entry reply
+ */
+static void ll_new_entry(IFS_INODE_T * parent, const char * name, const string &store,
+		const struct stat * st, struct fuse_entry_param * e)
+{
+	unsigned long epoch = objmap_epoch();
+	AutoLock lock(&_ll_mutex);
+
+	IFS_INODE_T * inode = NULL;
+	map<string, IFS_INODE_T *>::iterator mit = parent->children.find(name);
+	if(mit != parent->children.end()) {
+		inode = mit->second;
+		if(inode->is_dir != S_ISDIR(st->st_mode)) {
+			// Replaced behind our back, the old one lives on until forgotten
+			parent->children.erase(mit);
+			inode->detached = true;
+			inode = NULL;
+		}
+	}
+
+	if(!inode) {
+		inode = new IFS_INODE_T();
+		inode->parent = parent;
+		inode->name = name;
+		inode->is_dir = S_ISDIR(st->st_mode);
+		inode->detached = false;
+		inode->nchildren = 0;
+		inode->nlookup = 0;
+		parent->children[name] = inode;
+		parent->nchildren++;
+	}
+	inode->store = store;
+	inode->store_epoch = epoch;
+	inode->nlookup++;
+
+	memset(e, 0, sizeof(*e));
+	e->ino = ll_ino(inode);
+	e->attr = *st;
+	e->attr_timeout = IFS_LL_ATTR_TIMEOUT;
+	e->entry_timeout = IFS_LL_ENTRY_TIMEOUT;
+}
+
+static int ll_do_lookup(IFS_INODE_T * parent, const char * name, struct fuse_entry_param * e)
+{
+	string path = ll_child_path(parent, name);
+
+	if(negcache_lookup(path.c_str())) {
+		return ENOENT;
+	}
+	unsigned long neg_gen = negcache_gen(path.c_str());
+
+	struct stat st;
+	string store = ll_realdir(path);
+	int dirfd = ll_dirfd(parent, store);
+	int retstat = -1;
+	if(dirfd >= 0) {
+		retstat = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+	}
+
+	if(retstat != 0 && store != _ll_state->rootdir) {
+		// Directories only live in the root tree
+		store = _ll_state->rootdir;
+		dirfd = ll_dirfd(parent, store);
+		if(dirfd >= 0) {
+			retstat = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+		}
+	}
+
+	if(retstat != 0) {
+		int err = (dirfd < 0) ? ENOENT : errno;
+		if(err == ENOENT) {
+			negcache_add(path.c_str(), neg_gen);
+		}
+		return err;
+	}
+
+	if(S_ISDIR(st.st_mode)) {
+		store = _ll_state->rootdir;
+	}
+
+	ll_new_entry(parent, name, store, &st, e);
+	return 0;
+}
+
+static void ifs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+
+	struct fuse_entry_param e;
+	int err = ll_do_lookup(ll_inode(parent), name, &e);
+	if(err == ENOENT) {
+		// Negative entry, the kernel caches the miss for us
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = IFS_LL_ENTRY_TIMEOUT;
+		fuse_reply_entry(req, &e);
+	} else if(err) {
+		fuse_reply_err(req, err);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+	IFS_INODE_T * inode = ll_inode(ino);
+	if(inode == &_ll_root) {
+		return;
+	}
+
+	AutoLock lock(&_ll_mutex);
+	if(inode->nlookup < nlookup) {
+		log_msg(LOG_LEVEL_ERROR, "ifs_ll_forget: lookup count underflow on %s\n", inode->name.c_str());
+		inode->nlookup = 0;
+	} else {
+		inode->nlookup -= nlookup;
+	}
+	ll_release_locked(inode);
+}
+
+static void ifs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	ll_forget_one(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void ifs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for(size_t i = 0; i < count; i++) {
+		ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static int ll_getattr(IFS_INODE_T * inode, struct stat * st, struct fuse_file_info *fi)
+{
+	if(fi) {
+		if(fstat(fi->fh, st) < 0) {
+			return ll_error("ifs_ll_getattr fstat", 0);
+		}
+		return 0;
+	}
+
+	int dirfd;
+	string name;
+	if(ll_locate(inode, dirfd, name) < 0) {
+		return ENOENT;
+	}
+	if(fstatat(dirfd, name.c_str(), st, AT_SYMLINK_NOFOLLOW) < 0) {
+		return ll_error("ifs_ll_getattr fstatat", 0);
+	}
+	return 0;
+}
+
+static void ifs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_getattr(ino=%lu)\n", ino);
+
+	struct stat st;
+	int err = ll_getattr(ll_inode(ino), &st, fi);
+	if(err) {
+		fuse_reply_err(req, err);
+		return;
+	}
+	fuse_reply_attr(req, &st, IFS_LL_ATTR_TIMEOUT);
+}
+
+static void ifs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_setattr(ino=%lu, to_set=0x%x)\n", ino, to_set);
+
+	IFS_INODE_T * inode = ll_inode(ino);
+	int dirfd;
+	string name;
+	int retstat = 0;
+
+	if(ll_locate(inode, dirfd, name) < 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if(to_set & FUSE_SET_ATTR_MODE) {
+		if(fi) {
+			retstat = fchmod(fi->fh, attr->st_mode);
+		} else {
+			retstat = fchmodat(dirfd, name.c_str(), attr->st_mode, 0);
+		}
+		if(retstat < 0) {
+			fuse_reply_err(req, ll_error("ifs_ll_setattr chmod"));
+			return;
+		}
+	}
+
+	if(to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+		// @todo: ignore chown error since we are fuse...
+		if(fchownat(dirfd, name.c_str(), uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+			log_msg(LOG_LEVEL_WARN, "    WARN ifs_ll_setattr chown: %s\n", strerror(errno));
+		}
+	}
+
+	if(to_set & FUSE_SET_ATTR_SIZE) {
+		if(fi) {
+			retstat = ftruncate(fi->fh, attr->st_size);
+		} else {
+			int fd = openat(dirfd, name.c_str(), O_WRONLY);
+			retstat = fd;
+			if(fd >= 0) {
+				retstat = ftruncate(fd, attr->st_size);
+				close(fd);
+			}
+		}
+		if(retstat < 0) {
+			fuse_reply_err(req, ll_error("ifs_ll_setattr truncate"));
+			return;
+		}
+	}
+
+	if(to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2];
+		tv[0].tv_sec = 0;
+		tv[1].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1].tv_nsec = UTIME_OMIT;
+
+		if(to_set & FUSE_SET_ATTR_ATIME_NOW) {
+			tv[0].tv_nsec = UTIME_NOW;
+		} else if(to_set & FUSE_SET_ATTR_ATIME) {
+			tv[0] = attr->st_atim;
+		}
+		if(to_set & FUSE_SET_ATTR_MTIME_NOW) {
+			tv[1].tv_nsec = UTIME_NOW;
+		} else if(to_set & FUSE_SET_ATTR_MTIME) {
+			tv[1] = attr->st_mtim;
+		}
+
+		if(fi) {
+			retstat = futimens(fi->fh, tv);
+		} else {
+			retstat = utimensat(dirfd, name.c_str(), tv, AT_SYMLINK_NOFOLLOW);
+		}
+		// @todo: ignore the result, as best effort, we are fuse, not root
+		if(retstat < 0) {
+			log_msg(LOG_LEVEL_WARN, "    WARN ifs_ll_setattr utimens: %s\n", strerror(errno));
+		}
+	}
+
+	ifs_ll_getattr(req, ino, fi);
+}
+
+static void ifs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_readlink(ino=%lu)\n", ino);
+
+	char link[PATH_MAX];
+	int dirfd;
+	string name;
+
+	if(ll_locate(ll_inode(ino), dirfd, name) < 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	ssize_t len = readlinkat(dirfd, name.c_str(), link, sizeof(link) - 1);
+	if(len < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_readlink readlinkat"));
+		return;
+	}
+	link[len] = '\0';
+	fuse_reply_readlink(req, link);
+}
+
+/*
+ * Common tail of mknod/symlink/create: objmap, negative cache and the entry
+ */
+static void ll_created(fuse_req_t req, IFS_INODE_T * parent, const char * name,
+		const string &path, const string &store, int dirfd, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	struct stat st;
+
+	string fpath = store + path;
+	ifs_set_objmap(path.c_str(), fpath.c_str());
+	negcache_invalidate(path.c_str());
+
+	int retstat;
+	if(fi) {
+		retstat = fstat(fi->fh, &st);
+	} else {
+		retstat = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+	}
+	if(retstat < 0) {
+		int err = ll_error("ifs_ll_created fstat");
+		if(fi) {
+			close(fi->fh);
+		}
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	ll_new_entry(parent, name, store, &st, &e);
+	if(fi) {
+		fuse_reply_create(req, &e, fi);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void ifs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_mknod(parent=%lu, name=\"%s\", mode=0%3o)\n", parent, name, mode);
+
+	IFS_INODE_T * pinode = ll_inode(parent);
+	string path = ll_child_path(pinode, name);
+	string store = ll_realdir(path);
+	int dirfd = ll_dirfd(pinode, store);
+	int retstat;
+
+	if(dirfd < 0) {
+		fuse_reply_err(req, -dirfd);
+		return;
+	}
+
+	if(S_ISREG(mode)) {
+		retstat = openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY, mode);
+		if(retstat >= 0) {
+			retstat = close(retstat);
+		}
+	} else if(S_ISFIFO(mode)) {
+		retstat = mkfifoat(dirfd, name, mode);
+	} else {
+		retstat = mknodat(dirfd, name, mode, rdev);
+	}
+	if(retstat < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_mknod"));
+		return;
+	}
+
+	ll_created(req, pinode, name, path, store, dirfd, NULL);
+}
+
+static void ifs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_mkdir(parent=%lu, name=\"%s\", mode=0%3o)\n", parent, name, mode);
+
+	IFS_INODE_T * pinode = ll_inode(parent);
+	string path = ll_child_path(pinode, name);
+	int rootfd = ll_rootfd(pinode);
+	struct fuse_entry_param e;
+	struct stat st;
+
+	if(rootfd < 0) {
+		fuse_reply_err(req, -rootfd);
+		return;
+	}
+
+	if(store_mkdir(path.c_str(), mode) < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_mkdir store_mkdir"));
+		return;
+	}
+
+	if(mkdirat(rootfd, name, mode) < 0 || fstatat(rootfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_mkdir mkdirat"));
+		return;
+	}
+	negcache_invalidate(path.c_str());
+
+	ll_new_entry(pinode, name, _ll_state->rootdir, &st, &e);
+	fuse_reply_entry(req, &e);
+}
+
+static void ifs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_symlink(link=\"%s\", parent=%lu, name=\"%s\")\n", link, parent, name);
+
+	IFS_INODE_T * pinode = ll_inode(parent);
+	string path = ll_child_path(pinode, name);
+	string store = ll_realdir(path);
+	int dirfd = ll_dirfd(pinode, store);
+
+	if(dirfd < 0) {
+		fuse_reply_err(req, -dirfd);
+		return;
+	}
+	if(symlinkat(link, dirfd, name) < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_symlink symlinkat"));
+		return;
+	}
+
+	ll_created(req, pinode, name, path, store, dirfd, NULL);
+}
+
+static void ifs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+
+	IFS_INODE_T * pinode = ll_inode(parent);
+	string path = ll_child_path(pinode, name);
+	string store = ll_realdir(path);
+	int dirfd = ll_dirfd(pinode, store);
+	int err1 = ENOENT;
+	int err2 = ENOENT;
+
+	// All the metadata goes out in one commit at the end
+	META_TXN_T * txn = metatxn_begin();
+
+	// What a still queued migration would have copied
+	struct stat statbuf;
+	off_t size = (dirfd >= 0 && fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) ? statbuf.st_size : 0;
+	if(dirfd >= 0 && unlinkat(dirfd, name, 0) == 0) {
+		err1 = 0;
+		accesslog_forget(path.c_str());
+		postprocess_cancel(path.c_str(), size);
+	} else if(dirfd >= 0) {
+		err1 = ll_error("ifs_ll_unlink no such file in L1", 0);
+	}
+	objmap_del(path.c_str(), 1, txn);
+	stats_del(path.c_str(), txn);
+	storeverify_del(path.c_str(), txn);
+
+	#ifdef CACHE_MODE
+	// Tricky, in cached mode
+	// it could have 2 copies, this is the second copy
+	string store2;
+	if(objmap_get(path.c_str(), store2, 2) == 0 && store2 != store) {
+		dirfd = ll_dirfd(pinode, store2);
+		if(dirfd >= 0 && unlinkat(dirfd, name, 0) == 0) {
+			err2 = 0;
+		}
+	}
+	objmap_del(path.c_str(), 2, txn);
+	#endif
+
+	metatxn_commit(txn);
+
+	if(err1 && err2) {
+		fuse_reply_err(req, err1);
+		return;
+	}
+
+	{
+		AutoLock lock(&_ll_mutex);
+		ll_detach_locked(pinode, name);
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_rmdir(parent=%lu, name=\"%s\")\n", parent, name);
+
+	IFS_INODE_T * pinode = ll_inode(parent);
+	string path = ll_child_path(pinode, name);
+	int rootfd = ll_rootfd(pinode);
+
+	if(store_rmdir(path.c_str()) < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_rmdir store_rmdir"));
+		return;
+	}
+	if(rootfd < 0 || unlinkat(rootfd, name, AT_REMOVEDIR) < 0) {
+		fuse_reply_err(req, rootfd < 0 ? -rootfd : ll_error("ifs_ll_rmdir unlinkat"));
+		return;
+	}
+
+	{
+		AutoLock lock(&_ll_mutex);
+		ll_detach_locked(pinode, name);
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_rename(parent=%lu, name=\"%s\", newparent=%lu, newname=\"%s\")\n",
+		parent, name, newparent, newname);
+
+	IFS_INODE_T * pinode = ll_inode(parent);
+	IFS_INODE_T * npinode = ll_inode(newparent);
+	string path = ll_child_path(pinode, name);
+	string newpath = ll_child_path(npinode, newname);
+	int path_is_dir = 0;
+	int retstat;
+	struct stat statbuf;
+	struct stat newstatbuf;
+	int replaces = 0;
+
+	int rootfd = ll_rootfd(pinode);
+	if(rootfd >= 0 && fstatat(rootfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(statbuf.st_mode)) {
+		path_is_dir = 1;
+		if(store_rename(path.c_str(), newpath.c_str()) < 0) {
+			fuse_reply_err(req, ll_error("ifs_ll_rename store_rename"));
+			return;
+		}
+		// Every cached object below the old dir is gone now
+		pathcache_clear();
+		retstat = renameat(rootfd, name, ll_rootfd(npinode), newname);
+	} else {
+		// A regular object stays in its store, only the name moves
+		string store = ll_realdir(path);
+		int dirfd = ll_dirfd(pinode, store);
+		int newdirfd = ll_dirfd(npinode, store);
+		if(dirfd < 0 || newdirfd < 0) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		// A file replaced by the rename dies with it
+		replaces = (fstatat(newdirfd, newname, &newstatbuf, AT_SYMLINK_NOFOLLOW) == 0);
+		retstat = renameat(dirfd, name, newdirfd, newname);
+	}
+
+	if(retstat < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_rename renameat"));
+		return;
+	}
+
+	if(path_is_dir) {
+		negcache_invalidate_all();
+	} else {
+		negcache_invalidate(newpath.c_str());
+
+		// See ifs_rename() for why the store never changes here
+		string store_path;
+		if(objmap_get(path.c_str(), store_path) != -1) {
+			META_TXN_T * txn = metatxn_begin();
+			objmap_set(newpath.c_str(), store_path.c_str(), 1, txn);
+			objmap_del(path.c_str(), 1, txn);
+			storeverify_rename(path.c_str(), newpath.c_str(), txn);
+			#ifdef CACHE_MODE
+			objmap_del(path.c_str(), 2, txn);
+			#endif
+			metatxn_commit(txn);
+
+			if(replaces) {
+				accesslog_forget(newpath.c_str());
+				postprocess_cancel(newpath.c_str(), newstatbuf.st_size);
+			}
+			accesslog_rename(path.c_str(), newpath.c_str());
+			postprocess_rename(path.c_str(), newpath.c_str());
+		} else {
+			log_msg(LOG_LEVEL_ERROR, "    ERROR ifs_ll_rename: cannot find obj %s in objmap\n", path.c_str());
+		}
+	}
+
+	// Move the inode over, whatever was at the target is detached
+	AutoLock lock(&_ll_mutex);
+	ll_detach_locked(npinode, newname);
+	map<string, IFS_INODE_T *>::iterator mit = pinode->children.find(name);
+	if(mit != pinode->children.end()) {
+		IFS_INODE_T * inode = mit->second;
+		pinode->children.erase(mit);
+		pinode->nchildren--;
+		inode->parent = npinode;
+		inode->name = newname;
+		inode->store_epoch = 0;
+		npinode->children[newname] = inode;
+		npinode->nchildren++;
+		ll_release_locked(pinode);
+	}
+
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_link(ino=%lu, newparent=%lu, newname=\"%s\")\n", ino, newparent, newname);
+
+	IFS_INODE_T * inode = ll_inode(ino);
+	IFS_INODE_T * npinode = ll_inode(newparent);
+	int dirfd;
+	string name;
+	struct stat st;
+	struct fuse_entry_param e;
+
+	if(ll_locate(inode, dirfd, name) < 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	string store;
+	{
+		AutoLock lock(&_ll_mutex);
+		store = inode->store;
+	}
+	string newpath = ll_child_path(npinode, newname);
+	int newdirfd = ll_dirfd(npinode, store);
+	if(newdirfd < 0) {
+		fuse_reply_err(req, -newdirfd);
+		return;
+	}
+
+	if(linkat(dirfd, name.c_str(), newdirfd, newname, 0) < 0
+		|| fstatat(newdirfd, newname, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_link linkat"));
+		return;
+	}
+	// The link lives next to its source, record it so lookups find the store
+	objmap_set(newpath.c_str(), store.c_str());
+	negcache_invalidate(newpath.c_str());
+
+	ll_new_entry(npinode, newname, store, &st, &e);
+	fuse_reply_entry(req, &e);
+}
+
+static void ifs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_open(ino=%lu, flags=0x%x)\n", ino, fi->flags);
+
+	IFS_INODE_T * inode = ll_inode(ino);
+	int dirfd;
+	string name;
+
+	if(ll_locate(inode, dirfd, name) < 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	int fd = openat(dirfd, name.c_str(), fi->flags & ~(O_CREAT | O_EXCL | O_NOCTTY));
+	if(fd < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_open openat"));
+		return;
+	}
+
+	// Update the stats records, written out by the accesslog flusher
+	string path = ll_path(inode);
+	// @todo: right, not just from target to source
+	accesslog_record(path.c_str(), STORE_DATA_STAGING_TARGET.store_name.c_str(), STORE_DATA_STAGING_SOURCE.store_name.c_str());
+
+	fi->fh = fd;
+	fuse_reply_open(req, fi);
+}
+
+static void ifs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_read(ino=%lu, size=%d, offset=%lld)\n", ino, size, off);
+
+	// Point libfuse at the backing fd, it splices into /dev/fuse when it can
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	buf.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	buf.buf[0].fd = fi->fh;
+	buf.buf[0].pos = off;
+
+	unsigned long long start_us = throttle_clock_us();
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+	throttle_sample(throttle_clock_us() - start_us);
+}
+
+static void ifs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_write(ino=%lu, size=%d, offset=%lld)\n", ino, size, off);
+
+	unsigned long long start_us = throttle_clock_us();
+	ssize_t bytes_written = pwrite(fi->fh, buf, size, off);
+	throttle_sample(throttle_clock_us() - start_us);
+	if(bytes_written < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_write pwrite"));
+		return;
+	}
+	fuse_reply_write(req, bytes_written);
+}
+
+static void ifs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_write_buf(ino=%lu, offset=%lld)\n", ino, off);
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+	dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = off;
+
+	unsigned long long start_us = throttle_clock_us();
+	ssize_t bytes_written = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+	throttle_sample(throttle_clock_us() - start_us);
+	if(bytes_written < 0) {
+		fuse_reply_err(req, -bytes_written);
+		return;
+	}
+	fuse_reply_write(req, bytes_written);
+}
+
+static void ifs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_release(ino=%lu)\n", ino);
+
+	IFS_INODE_T * inode = ll_inode(ino);
+	close(fi->fh);
+
+	// Only migrate on creation time, see ifs_release()
+	if(~(fi->flags) & O_CREAT) {
+		string path = ll_path(inode);
+		string store_path;
+		if(objmap_get(path.c_str(), store_path) != -1) {
+			postprocess_set(path.c_str(), 0, store_path.c_str());
+		}
+	}
+
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	int retstat;
+	if(datasync) {
+		retstat = fdatasync(fi->fh);
+	} else {
+		retstat = fsync(fi->fh);
+	}
+	fuse_reply_err(req, retstat < 0 ? ll_error("ifs_ll_fsync fsync") : 0);
+}
+
+static void ifs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_opendir(ino=%lu)\n", ino);
+
+	IFS_INODE_T * inode = ll_inode(ino);
+	IFS_INODE_T * dir_parent = (inode == &_ll_root) ? inode : inode->parent;
+	string name = (inode == &_ll_root) ? "." : inode->name;
+	int rootfd = ll_rootfd(dir_parent);
+
+	int fd = (rootfd < 0) ? -1 : openat(rootfd, name.c_str(), O_RDONLY | O_DIRECTORY);
+	DIR * dp = (fd < 0) ? NULL : fdopendir(fd);
+	if(!dp) {
+		int err = ll_error("ifs_ll_opendir opendir");
+		if(fd >= 0) {
+			close(fd);
+		}
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	// Same cursor as ifs_readdir(): root tree first, then the objmap
+	STORE_DIR_T * dir = store_opendir(dp, ll_path(inode).c_str(), get_realdir);
+
+	fi->fh = (uintptr_t) dir;
+	fuse_reply_open(req, fi);
+}
+
+static void ifs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_readdir(ino=%lu, size=%d, offset=%lld)\n", ino, size, off);
+
+	STORE_DIR_T * dir = (STORE_DIR_T *)(uintptr_t) fi->fh;
+	char * buf = (char *)malloc(size);
+	size_t pos = 0;
+
+	if(!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// The offset handed back to us is the number of the next entry
+	string name;
+	for(off_t idx = off; store_dir_entry(dir, idx, name) == 0; idx++) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = -1;
+		size_t len = fuse_add_direntry(req, buf + pos, size - pos, name.c_str(), &st, idx + 1);
+		if(len > size - pos) {
+			break;
+		}
+		pos += len;
+	}
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+/*
+ * Like readdir, but every entry carries its attributes and takes a lookup
+ * reference, so listing a directory costs no getattr/lookup per entry.
+ * The stats come from the cursor's scan, not from a lookup per name.
+ */
+static void ifs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_readdirplus(ino=%lu, size=%d, offset=%lld)\n", ino, size, off);
+
+	IFS_INODE_T * inode = ll_inode(ino);
+	STORE_DIR_T * dir = (STORE_DIR_T *)(uintptr_t) fi->fh;
+	char * buf = (char *)malloc(size);
+	size_t pos = 0;
+
+	if(!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	string name;
+	for(off_t idx = off; store_dir_entry(dir, idx, name) == 0; idx++) {
+		// Check the room first, the lookup reference can't be undone cheaply
+		if(fuse_add_direntry_plus(req, NULL, 0, name.c_str(), NULL, 0) > size - pos) {
+			break;
+		}
+
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+
+		struct stat st;
+		string store;
+		if(name == "." || name == "..") {
+			// No reference for these, the kernel resolves them itself
+			e.attr.st_ino = -1;
+			e.attr.st_mode = S_IFDIR;
+		} else if(store_dir_stat(dir, &st, store) == 0) {
+			if(store.empty() || S_ISDIR(st.st_mode)) {
+				store = _ll_state->rootdir;
+			}
+			ll_new_entry(inode, name.c_str(), store, &st, &e);
+		} else {
+			// Raced with an unlink, list the name without attributes
+			e.attr.st_ino = -1;
+		}
+
+		pos += fuse_add_direntry_plus(req, buf + pos, size - pos, name.c_str(), &e, idx + 1);
+	}
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+#endif
+
+static void ifs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	store_closedir((STORE_DIR_T *)(uintptr_t) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs statv;
+	int rootfd = ll_rootfd(&_ll_root);
+
+	if(rootfd < 0 || fstatvfs(rootfd, &statv) < 0) {
+		fuse_reply_err(req, rootfd < 0 ? -rootfd : ll_error("ifs_ll_statfs fstatvfs"));
+		return;
+	}
+	fuse_reply_statfs(req, &statv);
+}
+
+static void ifs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	int dirfd;
+	string name;
+
+	if(ll_locate(ll_inode(ino), dirfd, name) < 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if(faccessat(dirfd, name.c_str(), mask, 0) < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_access faccessat"));
+		return;
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void ifs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_create(parent=%lu, name=\"%s\", mode=0%03o)\n", parent, name, mode);
+
+	IFS_INODE_T * pinode = ll_inode(parent);
+	string path = ll_child_path(pinode, name);
+	string store = ll_realdir(path);
+	int dirfd = ll_dirfd(pinode, store);
+
+	if(dirfd < 0) {
+		fuse_reply_err(req, -dirfd);
+		return;
+	}
+
+	int fd = openat(dirfd, name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if(fd < 0) {
+		fuse_reply_err(req, ll_error("ifs_ll_create openat"));
+		return;
+	}
+	fi->fh = fd;
+
+	ll_created(req, pinode, name, path, store, dirfd, fi);
+}
+
+static void ifs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+		unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	log_msg(LOG_LEVEL_ERROR, "\nifs_ll_ioctl received\n");
+
+	if(flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	int retstat = ifs_ioctl_dispatch(cmd, (void *)in_buf);
+	if(retstat < 0) {
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	fuse_reply_ioctl(req, retstat, NULL, 0);
+}
+
+static void ifs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_init()\n");
+
+	_ll_state = (struct ifs_state *)userdata;
+
+#ifdef FUSE_CAP_SPLICE_READ
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+#ifdef FUSE_CAP_READDIRPLUS
+	conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+#endif
+
+	ifs_init_components(_ll_state);
+
+	_ll_root.parent = &_ll_root;
+	_ll_root.is_dir = true;
+	_ll_root.detached = false;
+	_ll_root.store = _ll_state->rootdir;
+	_ll_root.nchildren = 0;
+	_ll_root.nlookup = 1;
+
+	if(ll_rootfd(&_ll_root) < 0) {
+		log_msg(LOG_LEVEL_ERROR, "ifs_ll_init: cannot open root dir %s\n", _ll_state->rootdir);
+	}
+}
+
+static void ifs_ll_destroy(void *userdata)
+{
+	log_msg(LOG_LEVEL_DEBUG, "\nifs_ll_destroy()\n");
+
+	accesslog_stop();
+}
+
+struct ifs_ll_operations:fuse_lowlevel_ops {
+	ifs_ll_operations() {
+		init = ifs_ll_init;
+		destroy = ifs_ll_destroy;
+		lookup = ifs_ll_lookup;
+		forget = ifs_ll_forget;
+		forget_multi = ifs_ll_forget_multi;
+		getattr = ifs_ll_getattr;
+		setattr = ifs_ll_setattr;
+		readlink = ifs_ll_readlink;
+		mknod = ifs_ll_mknod;
+		mkdir = ifs_ll_mkdir;
+		unlink = ifs_ll_unlink;
+		rmdir = ifs_ll_rmdir;
+		symlink = ifs_ll_symlink;
+		rename = ifs_ll_rename;
+		link = ifs_ll_link;
+		open = ifs_ll_open;
+		read = ifs_ll_read;
+		write = ifs_ll_write;
+		write_buf = ifs_ll_write_buf;
+		flush = ifs_ll_flush;
+		release = ifs_ll_release;
+		fsync = ifs_ll_fsync;
+		opendir = ifs_ll_opendir;
+		readdir = ifs_ll_readdir;
+#ifdef FUSE_CAP_READDIRPLUS
+		readdirplus = ifs_ll_readdirplus;
+#endif
+		releasedir = ifs_ll_releasedir;
+		fsyncdir = ifs_ll_fsyncdir;
+		statfs = ifs_ll_statfs;
+		access = ifs_ll_access;
+		create = ifs_ll_create;
+		ioctl = ifs_ll_ioctl;
+	}
+} ifs_ll_oper;
+
+int ifs_ll_main(int argc, char *argv[], struct ifs_state * state)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	char *mountpoint = NULL;
+	int multithreaded = 0;
+	int foreground = 0;
+	int err = -1;
+
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+		return 1;
+	}
+
+	ch = fuse_mount(mountpoint, &args);
+	if (ch != NULL) {
+		struct fuse_session *se;
+
+		se = fuse_lowlevel_new(&args, &ifs_ll_oper, sizeof(ifs_ll_oper), state);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				if (multithreaded) {
+					err = fuse_session_loop_mt(se);
+				} else {
+					err = fuse_session_loop(se);
+				}
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	fuse_opt_free_args(&args);
+
+	return err ? 1 : 0;
+}
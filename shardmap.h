@@ -0,0 +1,121 @@
+#ifndef __SHARD_MAP_H__
+#define __SHARD_MAP_H__
+
+#include <pthread.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+
+#include "utils.h"
+
+using namespace std;
+
+/*
+ * Path keyed cache, sharded by hash, each shard with its own rwlock so
+ * concurrent FUSE threads only contend when they hit the same shard.
+ *
+ * Every invalidation bumps its shard's generation. An insert carries the
+ * generation taken BEFORE the lookup whose result it caches, one that
+ * raced with an invalidation is dropped, so a slow reader never puts a
+ * stale answer back. Shards are bounded, but not LRU.
+ */
+template <class V, int SHARDS, size_t SHARD_MAX_ENTRIES>
+class ShardMap
+{
+public:
+	unsigned long gen(const char * key)
+	{
+		Shard * shard = get_shard(key);
+
+		pthread_rwlock_rdlock(&shard->lock);
+		unsigned long gen = shard->gen;
+		pthread_rwlock_unlock(&shard->lock);
+
+		return gen;
+	}
+
+	bool get(const char * key, V &value)
+	{
+		Shard * shard = get_shard(key);
+		bool found = false;
+
+		pthread_rwlock_rdlock(&shard->lock);
+		typename map<string, V>::const_iterator mit = shard->entries.find(key);
+		if(mit != shard->entries.end()) {
+			value = mit->second;
+			found = true;
+		}
+		pthread_rwlock_unlock(&shard->lock);
+
+		return found;
+	}
+
+	bool set(const char * key, const V &value, unsigned long gen)
+	{
+		Shard * shard = get_shard(key);
+		bool set = false;
+
+		pthread_rwlock_wrlock(&shard->lock);
+		if(shard->gen == gen) {
+			if(shard->entries.size() >= SHARD_MAX_ENTRIES) {
+				shard->entries.erase(shard->entries.begin());
+			}
+			shard->entries[key] = value;
+			set = true;
+		}
+		pthread_rwlock_unlock(&shard->lock);
+
+		return set;
+	}
+
+	void del(const char * key)
+	{
+		Shard * shard = get_shard(key);
+
+		pthread_rwlock_wrlock(&shard->lock);
+		shard->gen++;
+		shard->entries.erase(key);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+
+	void clear()
+	{
+		for(int i = 0; i < SHARDS; i++) {
+			Shard * shard = &shards_[i];
+			pthread_rwlock_wrlock(&shard->lock);
+			shard->gen++;
+			shard->entries.clear();
+			pthread_rwlock_unlock(&shard->lock);
+		}
+	}
+
+private:
+	class Shard
+	{
+	public:
+		Shard():
+			gen(0)
+		{
+			pthread_rwlock_init(&lock, NULL);
+		}
+
+		~Shard()
+		{
+			pthread_rwlock_destroy(&lock);
+		}
+
+		pthread_rwlock_t lock;
+		unsigned long gen;
+		map<string, V> entries;
+	};
+
+	Shard * get_shard(const char * key)
+	{
+		return &shards_[hash_fnv1a(key) % SHARDS];
+	}
+
+	Shard shards_[SHARDS];
+};
+
+#endif
@@ -3,31 +3,21 @@
 #include <string>
 
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "log.h"
 
+#include "metadb.h"
+#include "metatxn.h"
 #include "stats.h"
 
 using namespace std;
 
-leveldb::DB* _stats = NULL;
-
-void * stats_hdl()
-{
-	return (void *)_stats;
-}
-
 int stats_init()
 {
-	// Set up database connection information and open database
-	leveldb::Options options;
-	options.create_if_missing = true;
-	
-	leveldb::Status status = leveldb::DB::Open(options, STATS_DB, &_stats);
-	
-	if (false == status.ok())
+	// Stats are a table of the metadata DB
+	if (metadb_init() != 0)
 	{
-	    cerr << "Unable to open post-processing database "<< STATS_DB << endl;
-	    cerr << status.ToString() << endl;
+	    cerr << "Unable to open stats database "<< METADB_DB << endl;
 	    return -1;
 	}
 	
@@ -36,18 +26,32 @@ int stats_init()
 
 int stats_set(const char * obj, const char * state)
 {
-	// Add 256 values to the database
-	leveldb::WriteOptions writeOptions;
-	_stats->Put(writeOptions, obj, state);
+	metadb_put(METADB_STATS, obj, state);
 	
 	return 0;
 }
 
+int stats_set_batch(const map<string, string> &obj_states)
+{
+	leveldb::WriteBatch batch;
+	map<string, string>::const_iterator mit;
+	for(mit = obj_states.begin(); mit != obj_states.end(); mit++) {
+		metadb_batch_put(&batch, METADB_STATS, mit->first, mit->second);
+	}
+
+	leveldb::Status status = metadb_write(&batch);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "stats_set_batch: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
 int stats_get(const char * obj, string &state)
 {
-	// Add 256 values to the database
-	leveldb::ReadOptions readOptions;
-	leveldb::Status status = _stats->Get(readOptions, obj, &state);
+	leveldb::Status status = metadb_get(METADB_STATS, obj, &state);
 	
 	if (false == status.ok())
 	{
@@ -57,11 +61,14 @@ int stats_get(const char * obj, string &state)
 	return 0;
 }
 
-int stats_del(const char * obj)
+int stats_del(const char * obj, META_TXN_T * txn)
 {
-	// Add 256 values to the database
-	leveldb::WriteOptions writeOptions;
-	_stats->Delete(writeOptions, obj);
+	if(txn) {
+		metadb_batch_delete(metatxn_batch(txn), METADB_STATS, obj);
+		return 0;
+	}
+
+	metadb_delete(METADB_STATS, obj);
 	
 	return 0;
 }
@@ -83,7 +90,7 @@ int stats_list(const char * prefix, vector<string>& obj_list)
 	// @todo: You think I don't know the performance here is poor..?
 	
 	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = _stats->NewIterator(leveldb::ReadOptions());
+	leveldb::Iterator* it = metadb_iterator(METADB_STATS);
 	size_t prefix_len = strlen(prefix);
 	
 	for (it->SeekToFirst(); it->Valid(); it->Next())
@@ -120,7 +127,7 @@ int stats_list(const char * prefix, vector<string>& obj_list)
 int stats_dump_to_log()
 {
 	// Iterate over each item in the database and print them
-	leveldb::Iterator* it = _stats->NewIterator(leveldb::ReadOptions());
+	leveldb::Iterator* it = metadb_iterator(METADB_STATS);
 	
 	log_msg(LOG_LEVEL_ERROR, "\nstats_dump_to_log: starting dumping \n");
 	
@@ -5,20 +5,20 @@
 //#include <sys/systm.h>
 
 #include "store.h"
+#include <map>
 #include <vector>
 
 using namespace std;
 
-#define STATS_DB (STORE_ROOT + "/.stats")
+struct META_TXN_T;
 
 extern int stats_init();
 extern int stats_set(const char * obj, const char * state);
+// obj -> state, written in a single WriteBatch
+extern int stats_set_batch(const map<string, string> &obj_states);
 extern int stats_get(const char * obj, string &state);
-extern int stats_del(const char * obj);
+extern int stats_del(const char * obj, META_TXN_T * txn = NULL);
 extern int stats_list(const char * prefix, vector<string>& obj_list);
 extern int stats_dump_to_log();
 
-// @todo: security...?
-extern void * stats_hdl();
-
 #endif
\ No newline at end of file
@@ -12,11 +12,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <time.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 
 #include "objmap.h"
+#include "storecopy.h"
+#include "storeverify.h"
 #include <string>
 #include <vector>
 
@@ -26,9 +31,6 @@ using namespace std;
 string STORE_ROOT = "/routefs_root";
 string STORE_DATA_STAGING_ROOT;
 
-// For writing
-#define DIRECTIO_BLOCK_SIZE 256*1024
-
 #ifdef CACHE_MODE
 STORE_T STORE_DATA_STAGING_SOURCE = { STORE_DATA_STAGING_ROOT, true};
 #else
@@ -68,6 +70,52 @@ int store_is_valid_store(const char * store_path)
 	return 0;
 }
 
+int store_locate(const char * fpath, STORE_LOCATION_T &location)
+{
+	int fd = open(fpath, O_RDONLY | O_NOFOLLOW);
+	if(fd < 0) {
+		return -1;
+	}
+
+	struct stat statbuf;
+	if(fstat(fd, &statbuf) != 0) {
+		close(fd);
+		return -1;
+	}
+	location.dev = statbuf.st_dev;
+	location.ino = statbuf.st_ino;
+	location.physical = 0;
+
+	// Only the first extent is asked for
+	char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	memset(buf, 0, sizeof(buf));
+	struct fiemap * fiemap = (struct fiemap *)buf;
+	fiemap->fm_start = 0;
+	fiemap->fm_length = FIEMAP_MAX_OFFSET;
+	fiemap->fm_extent_count = 1;
+	if(ioctl(fd, FS_IOC_FIEMAP, fiemap) == 0 && fiemap->fm_mapped_extents > 0
+		&& !(fiemap->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC))) {
+		location.physical = fiemap->fm_extents[0].fe_physical;
+	}
+
+	close(fd);
+	return 0;
+}
+
+bool store_location_before(const STORE_LOCATION_T &a, const STORE_LOCATION_T &b)
+{
+	if(a.dev != b.dev) {
+		return a.dev < b.dev;
+	}
+	if((a.physical == 0) != (b.physical == 0)) {
+		return a.physical != 0;
+	}
+	if(a.physical != b.physical) {
+		return a.physical < b.physical;
+	}
+	return a.ino < b.ino;
+}
+
 // Create directories in all data stores
 int store_mkdir(const char *path, mode_t mode)
 {
@@ -130,95 +178,177 @@ int store_rename(const char *path, const char *newpath)
 	return retstat;
 }
 
-int store_readdir(
-		const char *path,
-		void *buf,
-		fuse_fill_dir_t filler,
-		off_t offset,
-		struct fuse_file_info *fi,
-		map<string, int>& parent_files)
+struct STORE_DIR_T
 {
-	int retstat = 0;
+	DIR * dp;
+	string path;
+	STORE_REALDIR_FN realdir;
+	// 0: backing dir, 1: objmap levels, 2: done
+	int phase;
+	OBJMAP_DIR_T * objdir[2];
+	string head[2];
+	int head_valid[2];
+	// cur is entry number pos, once loaded
+	off_t pos;
+	int cur_valid;
+	string cur;
+	// cur came from the backing dir, not the objmap
+	int cur_backing;
+};
+
+STORE_DIR_T * store_opendir(DIR * dp, const char *path, STORE_REALDIR_FN realdir)
+{
+	STORE_DIR_T * dir = new STORE_DIR_T();
+	dir->dp = dp;
+	dir->path = path;
+	dir->realdir = realdir;
+	dir->phase = 0;
+	dir->objdir[0] = dir->objdir[1] = NULL;
+	dir->head_valid[0] = dir->head_valid[1] = 0;
+	dir->pos = 0;
+	dir->cur_valid = 0;
+
+	return dir;
+}
 
-	log_msg(LOG_LEVEL_DEBUG, "\nstore_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
-		path, buf, filler, offset, fi);
+static void store_dir_close_objmap(STORE_DIR_T * dir)
+{
+	for(int i = 0; i < 2; i++) {
+		objmap_closedir(dir->objdir[i]);
+		dir->objdir[i] = NULL;
+		dir->head_valid[i] = 0;
+	}
+}
 
-	vector<string> obj_list;
-	objmap_list(path, obj_list, 1);
-	objmap_list(path, obj_list, 2);
-	vector<string>::iterator vit;
-	for(vit=obj_list.begin();vit!=obj_list.end();vit++){
-		log_msg(LOG_LEVEL_DEBUG, "    store_readdir filler:  %s", (*vit).c_str());
-		if(!parent_files[*vit]) {
-			parent_files[*vit] = 1;
-			if (filler(buf, (*vit).c_str(), NULL, 0) != 0) {
-				log_msg(LOG_LEVEL_ERROR, "    ERROR store_readdir filler:  buffer full");
-				return -ENOMEM;
-			}
+static void store_dir_rewind(STORE_DIR_T * dir)
+{
+	rewinddir(dir->dp);
+	store_dir_close_objmap(dir);
+	dir->phase = 0;
+	dir->pos = 0;
+	dir->cur_valid = 0;
+}
+
+static int store_dir_fetch(STORE_DIR_T * dir, string &name)
+{
+	if(dir->phase == 0) {
+		struct dirent *de = readdir(dir->dp);
+		if(de) {
+			name = de->d_name;
+			return 0;
+		}
+
+		dir->phase = 1;
+		for(int i = 0; i < 2; i++) {
+			dir->objdir[i] = objmap_opendir(dir->path.c_str(), i + 1);
+			dir->head_valid[i] = dir->objdir[i] && objmap_readdir(dir->objdir[i], dir->head[i]) == 0;
 		}
 	}
 
-#if 0
-	DIR *dp;
-	struct dirent *de;
-	char fpath[PATH_MAX];
+	while(dir->phase == 1) {
+		int lo = -1;
+		for(int i = 0; i < 2; i++) {
+			if(dir->head_valid[i] && (lo < 0 || dir->head[i] < dir->head[lo])) {
+				lo = i;
+			}
+		}
+		if(lo < 0) {
+			store_dir_close_objmap(dir);
+			dir->phase = 2;
+			break;
+		}
 
-	vector<string>::iterator vit;
-	for (vit = STORE_VOL_PATH.begin(); vit != STORE_VOL_PATH.end(); vit ++) {
-		string curr_dir = *vit;
+		name = dir->head[lo];
+		// Same name on both levels shows up once
+		for(int i = 0; i < 2; i++) {
+			if(dir->head_valid[i] && dir->head[i] == name) {
+				dir->head_valid[i] = objmap_readdir(dir->objdir[i], dir->head[i]) == 0;
+			}
+		}
+
+		// Already listed from the backing dir
 		struct stat statbuf;
-		retstat = lstat(curr_dir.c_str(), &statbuf);
-		if (retstat != 0) {
-			// Skip those not yet created stores
-			retstat = 0;
+		if(fstatat(dirfd(dir->dp), name.c_str(), &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
 			continue;
 		}
-		strcpy(fpath, curr_dir.c_str());
-		strncat(fpath, path, PATH_MAX - 1); // ridiculously long paths will break here
-		dp = opendir(fpath);
-		log_msg(LOG_LEVEL_DEBUG, "store_readdir calling opendir: %s\n", fpath);
-		if (dp == NULL) {
-			retstat = store_error("store_readdir opendir");
-		}
 
-		// Every directory contains at least two entries: . and ..  If my
-		// first call to the system readdir() returns NULL I've got an
-		// error; near as I can tell, that's the only condition under
-		// which I can get an error from readdir()
-		de = readdir(dp);
-		if (de == 0) {
-			closedir(dp);
-			retstat = store_error("store_readdir readdir");
-			return retstat;
-		}
+		return 0;
+	}
 
-		// This will copy the entire directory into the buffer.  The loop exits
-		// when either the system readdir() returns NULL, or filler()
-		// returns something non-zero.  The first case just means I've
-		// read the whole directory; the second means the buffer is full.
-		do {
-			log_msg(LOG_LEVEL_DEBUG, "store_readdir calling filler with name %s, type %d, dirtype %d\n", de->d_name, de->d_type, DT_DIR);
-			if(de->d_type == DT_DIR) {
-				// When we are crossing the mountpoint, it returns DT_UNKNOWN...
-				// Don't add directory, it's all duplicate. Files only.
-			} else if (de->d_type == DT_UNKNOWN && parent_files[de->d_name]) {
-				// Ignore it too, damn it...
-			} else {
-				if (filler(buf, de->d_name, NULL, 0) != 0) {
-					closedir(dp);
-					log_msg(LOG_LEVEL_ERROR, "    ERROR store_readdir filler:  buffer full");
-					return -ENOMEM;
-				}
+	return 1;
+}
+
+int store_dir_entry(STORE_DIR_T * dir, off_t off, string &name)
+{
+	if(off < dir->pos) {
+		log_msg(LOG_LEVEL_DEBUG, "store_dir_entry: %s seeking back from %lld to %lld\n",
+			dir->path.c_str(), (long long)dir->pos, (long long)off);
+		store_dir_rewind(dir);
+	}
+
+	while(1) {
+		if(!dir->cur_valid) {
+			if(store_dir_fetch(dir, dir->cur) != 0) {
+				return 1;
 			}
-		} while ((de = readdir(dp)) != NULL);
+			dir->cur_valid = 1;
+			dir->cur_backing = (dir->phase == 0);
+		}
+		if(dir->pos == off) {
+			name = dir->cur;
+			return 0;
+		}
+		dir->cur_valid = 0;
+		dir->pos++;
+	}
+}
 
-		closedir(dp);
+int store_dir_stat(STORE_DIR_T * dir, struct stat * statbuf, string &store)
+{
+	if(!dir->cur_valid) {
+		return -1;
+	}
+
+	// Objmap entries already failed this check in store_dir_fetch()
+	struct stat backing;
+	int has_backing = dir->cur_backing
+		&& fstatat(dirfd(dir->dp), dir->cur.c_str(), &backing, AT_SYMLINK_NOFOLLOW) == 0;
+	if(has_backing && S_ISDIR(backing.st_mode)) {
+		*statbuf = backing;
+		store = "";
+		return 0;
 	}
-#endif
 
-	log_fi(fi);
+	string child = dir->path;
+	if(child.empty() || child[child.size() - 1] != '/') {
+		child += "/";
+	}
+	child += dir->cur;
 
-	return retstat;
+	string realdir = dir->realdir ? dir->realdir(child.c_str()) : "";
+	if(!realdir.empty() && lstat((realdir + child).c_str(), statbuf) == 0) {
+		store = realdir;
+		return 0;
+	}
+
+	if(has_backing) {
+		*statbuf = backing;
+		store = "";
+		return 0;
+	}
+
+	return -1;
+}
+
+void store_closedir(STORE_DIR_T * dir)
+{
+	if(!dir) {
+		return;
+	}
+
+	store_dir_close_objmap(dir);
+	closedir(dir->dp);
+	delete dir;
 }
 
 // Create directories in all data stores
@@ -250,7 +380,101 @@ int store_rmdir(const char *path)
 	return retstat;
 }
 
-int store_migrate(const char *path, const char * from_store, const char * to_store, int keep_source)
+/*
+ * Copies the file a piece at a time. Each piece is synced and handed to
+ * the verifier, which reads it back while the next one is copied. Only
+ * the io_uring pipeline checksums the source as it reads; every other
+ * copy stays in the kernel and the verifier reads the source as well.
+ * Checkpoints only ever cover target data that was read back and matched.
+ * ckpt->offset is where the target stands on entry, on success ckpt covers
+ * the whole file; verified is false for a reflink.
+ */
+static int store_migrate_pieces(const char *path, const char * fpath_to, int fd_from, int fd_to, const struct stat &statbuf,
+	const char * from_store, const char * to_store, STORE_COPY_METHOD_T * method,
+	STORE_MIGRATE_CKPT_T * ckpt, STORE_MIGRATE_CKPT_FN ckpt_fn, void * ckpt_arg, bool * verified)
+{
+	off_t pos = ckpt->offset;
+	uint32_t crc = ckpt->crc;
+	int retstat = 0;
+
+	// Shared extents, nothing was moved that could have been damaged
+	*verified = false;
+	if(pos == 0 && storecopy_clone(fd_from, fd_to, statbuf.st_size) == 0) {
+		*method = STORE_COPY_CLONE;
+		return 0;
+	}
+
+	bool copy_crc = storecopy_in_user_space(fd_from, fd_to, statbuf.st_size - pos);
+	STORE_VERIFY_T * verify = storeverify_start(fpath_to, copy_crc ? -1 : fd_from, pos, crc,
+		statbuf.st_size - pos > STORE_VERIFY_PIECE_SIZE, from_store, to_store);
+	if(!verify) {
+		return -EIO;
+	}
+
+	while(pos < statbuf.st_size) {
+		off_t len = statbuf.st_size - pos;
+		if(len > STORE_VERIFY_PIECE_SIZE) {
+			len = STORE_VERIFY_PIECE_SIZE;
+		}
+		retstat = storecopy_copy(fd_from, fd_to, pos, len, method, from_store, to_store, copy_crc ? &crc : NULL);
+		if(retstat != 0) {
+			break;
+		}
+		pos += len;
+
+		// Read back from the disk, not the page cache
+		if(fdatasync(fd_to) != 0) {
+			retstat = -errno;
+			break;
+		}
+		storeverify_add(verify, pos, crc);
+
+		if(ckpt_fn && pos < statbuf.st_size && pos - (off_t)ckpt->offset >= STORE_MIGRATE_CHECKPOINT_SIZE) {
+			off_t good;
+			uint32_t good_crc;
+			storeverify_progress(verify, &good, &good_crc);
+			if(good > (off_t)ckpt->offset) {
+				ckpt->offset = good;
+				ckpt->crc = good_crc;
+				if(ckpt_fn(path, *ckpt, ckpt_arg) != 0) {
+					log_msg(LOG_LEVEL_ERROR, "store_migrate: %s, cannot save the checkpoint at %lld\n", path, (long long)good);
+				}
+			}
+		}
+	}
+
+	int verify_ret = storeverify_finish(verify, &crc);
+	if(retstat == 0) {
+		retstat = verify_ret;
+	}
+	if(retstat != 0) {
+		return retstat;
+	}
+
+	ckpt->offset = pos;
+	ckpt->crc = crc;
+	*verified = true;
+	return 0;
+}
+
+// Same file, same data as when the copy started
+static bool store_source_unchanged(int fd_from, const char * fpath_from, const struct stat &before)
+{
+	struct stat now;
+	struct stat named;
+	if(fstat(fd_from, &now) != 0 || lstat(fpath_from, &named) != 0) {
+		return false;
+	}
+	return now.st_size == before.st_size
+		&& now.st_mtim.tv_sec == before.st_mtim.tv_sec
+		&& now.st_mtim.tv_nsec == before.st_mtim.tv_nsec
+		&& named.st_dev == before.st_dev
+		&& named.st_ino == before.st_ino;
+}
+
+int store_migrate(const char *path, const char * from_store, const char * to_store, int keep_source,
+	STORE_MIGRATE_CKPT_T * ckpt, STORE_MIGRATE_CKPT_FN ckpt_fn, void * ckpt_arg,
+	STORE_MIGRATE_COMMIT_FN commit_fn, void * commit_arg)
 {
 	int retstat = 0;
 	int fd_from = -1;
@@ -258,11 +482,10 @@ int store_migrate(const char *path, const char * from_store, const char * to_sto
 	char fpath_from[PATH_MAX];
 	char fpath_to[PATH_MAX];
 	struct stat statbuf;
-
-	char * rdbuf = NULL;
-	
-	int total_bytes_read = 0;
-	int total_bytes_written = 0;
+	struct stat statbuf_to;
+	STORE_COPY_METHOD_T method = STORE_COPY_NONE;
+	STORE_MIGRATE_CKPT_T local_ckpt;
+	bool verified = false;
 
 	log_msg(LOG_LEVEL_DEBUG, "\nstore_migrate(path \"%s\",from \"%s\", to \"%s\")\n",
 		path, from_store, to_store);
@@ -271,81 +494,122 @@ int store_migrate(const char *path, const char * from_store, const char * to_sto
 	strncat(fpath_from, path, PATH_MAX - 1); // ridiculously long paths will break here
 	log_msg(LOG_LEVEL_DEBUG, "\nstore_migrate:read(fpath_from\"%s\")\n", fpath_from);
 
-	// fd_from = open(fpath_from, O_DIRECT|O_RDONLY);
 	fd_from = open(fpath_from, O_RDONLY);
 	if (fd_from < 0) {
 		retstat = store_error("store_migrate open for reading");
 		return retstat;
 	}
 
-	retstat = lstat(fpath_from, &statbuf);
-	log_msg(LOG_LEVEL_DEBUG, "source file %s is size of %ld\n", fpath_from, statbuf.st_size);
+	if (fstat(fd_from, &statbuf) < 0) {
+		retstat = store_error("store_migrate fstat");
+		close(fd_from);
+		return retstat;
+	}
+	log_msg(LOG_LEVEL_DEBUG, "source file %s is size of %lld\n", fpath_from, (long long)statbuf.st_size);
 
 	strcpy(fpath_to, to_store);
 	strncat(fpath_to, path, PATH_MAX - 1); // ridiculously long paths will break here
 	log_msg(LOG_LEVEL_DEBUG, "\nstore_migrate:write(fpath_to\"%s\")\n", fpath_to);
 
-	//fd_to = open(fpath_to, O_CREAT|O_WRONLY|O_DIRECT, S_IRUSR | S_IWUSR);
-	fd_to = open(fpath_to, O_CREAT|O_WRONLY, S_IRUSR | S_IWUSR);
+	bool resumable = (ckpt && ckpt_fn);
+	if (!resumable) {
+		ckpt = &local_ckpt;
+	}
+	// A checkpoint of another version of the file is worthless
+	bool resume = (resumable && ckpt->offset > 0 && ckpt->offset < (uint64_t)statbuf.st_size
+		&& ckpt->source_size == (uint64_t)statbuf.st_size
+		&& ckpt->source_mtime == (uint64_t)statbuf.st_mtim.tv_sec
+		&& ckpt->source_mtime_nsec == (uint32_t)statbuf.st_mtim.tv_nsec);
+
+	if (resume) {
+		fd_to = open(fpath_to, O_WRONLY);
+		// Whatever got past the checkpoint may sit where the source has holes, cut it off
+		if (fd_to < 0 || fstat(fd_to, &statbuf_to) < 0 || (uint64_t)statbuf_to.st_size < ckpt->offset
+			|| ftruncate(fd_to, ckpt->offset) != 0) {
+			log_msg(LOG_LEVEL_ERROR, "store_migrate: %s, partial target lost, starting over\n", path);
+			if (fd_to >= 0) {
+				close(fd_to);
+				fd_to = -1;
+			}
+			resume = false;
+		}
+	}
+	if (!resume) {
+		*ckpt = STORE_MIGRATE_CKPT_T();
+		ckpt->source_size = statbuf.st_size;
+		ckpt->source_mtime = statbuf.st_mtim.tv_sec;
+		ckpt->source_mtime_nsec = statbuf.st_mtim.tv_nsec;
+	}
+	if (fd_to < 0) {
+		fd_to = open(fpath_to, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR | S_IWUSR);
+	}
 	if (fd_to < 0) {
 		retstat = store_error("store_migrate open for writing");
+		close(fd_from);
 		return retstat;
 	}
-	log_msg(LOG_LEVEL_DEBUG, "opened target file %s for writing, with block size of %d\n", fpath_to, DIRECTIO_BLOCK_SIZE);
+	if (resume) {
+		log_msg(LOG_LEVEL_ERROR, "store_migrate: %s, resuming at %llu of %lld\n",
+			path, (unsigned long long)ckpt->offset, (long long)statbuf.st_size);
+	}
 
-	int bytes_left = statbuf.st_size;
-	if((0 != posix_memalign((void **)&rdbuf, sysconf(_SC_PAGESIZE), DIRECTIO_BLOCK_SIZE)) || (rdbuf == NULL)) {
+	retstat = store_migrate_pieces(path, fpath_to, fd_from, fd_to, statbuf, from_store, to_store, &method,
+		ckpt, resumable ? ckpt_fn : NULL, ckpt_arg, &verified);
+	if (retstat == 0 && fstat(fd_to, &statbuf_to) < 0) {
+		retstat = -errno;
+	}
+	if (retstat == 0 && close(fd_to) < 0) {
+		retstat = -errno;
+	} else if (retstat != 0) {
 		close(fd_to);
-		close(fd_from);
-		printf("Failed to allocate aligned memory for size %d with page size%ld\n", DIRECTIO_BLOCK_SIZE, sysconf(_SC_PAGESIZE));
-		return 1;
-	}
-	log_msg(LOG_LEVEL_DEBUG, "Allocated aligned memory for size %d with page size%ld\n", DIRECTIO_BLOCK_SIZE, sysconf(_SC_PAGESIZE));
-	
-	while(bytes_left > 0) {
-		int bytes_read = read(fd_from, rdbuf, DIRECTIO_BLOCK_SIZE);
-		if(bytes_read != -1) total_bytes_read += bytes_read;
-		if(bytes_read != DIRECTIO_BLOCK_SIZE) {
-			// done reading
-			log_msg(LOG_LEVEL_DEBUG, "Done reading, read less than expected: %d vs %d\n", bytes_read, DIRECTIO_BLOCK_SIZE);
-			break;
-		}
+	}
+	// Writes through another fd during the copy would be lost with the source
+	if (retstat == 0 && !store_source_unchanged(fd_from, fpath_from, statbuf)) {
+		log_msg(LOG_LEVEL_ERROR, "store_migrate: %s changed during the copy, not migrated\n", path);
+		retstat = -EAGAIN;
+		ckpt->offset = 0;
+	}
+	close(fd_from);
 
-		bytes_left -= DIRECTIO_BLOCK_SIZE;
-		int bytes_written = write(fd_to, rdbuf, DIRECTIO_BLOCK_SIZE);
-		if(bytes_written != -1) total_bytes_written += bytes_written;
-		if(bytes_written != DIRECTIO_BLOCK_SIZE) {
-			log_msg(LOG_LEVEL_ERROR, "    ERROR writting %s: %s\n", fpath_to, strerror(errno));
-			return 1;
-		}
-		log_msg(LOG_LEVEL_DEBUG, "Written %d bytes\n", bytes_written);
-	}
-	
-	if(bytes_left > 0) {
-		int bytes_written = write(fd_to, rdbuf, bytes_left);
-		if(bytes_written != -1) total_bytes_written += bytes_written;
-		if(bytes_written != bytes_left) {
-			log_msg(LOG_LEVEL_ERROR, "    ERROR writting %s: %s\n", fpath_to, strerror(errno));
-			return 1;
+	if (retstat != 0) {
+		log_msg(LOG_LEVEL_ERROR, "    ERROR store_migrate %s -> %s: %s\n", fpath_from, fpath_to, strerror(-retstat));
+		// Readers only find a partial copy through the objmap, which still
+		// points at the source. Keep it if there is a checkpoint to resume.
+		if (!resumable || ckpt->offset == 0) {
+			unlink(fpath_to);
 		}
-		bytes_left -= bytes_written;
-		log_msg(LOG_LEVEL_DEBUG, "Written %d bytes\n", bytes_written);
+		return retstat;
 	}
 
-	close(fd_to);
-	close(fd_from);
-	
-	if(rdbuf) free(rdbuf);
-	
-	log_msg(LOG_LEVEL_DEBUG, "Total bytes read: %d, total bytes written: %d\n", total_bytes_read, total_bytes_written);
-	
+	if (commit_fn && commit_fn(path, to_store, commit_arg) != 0) {
+		log_msg(LOG_LEVEL_ERROR, "store_migrate: %s went away during the copy, dropping %s\n", path, fpath_to);
+		unlink(fpath_to);
+		return -ECANCELED;
+	}
+
+	log_msg(LOG_LEVEL_ERROR, "store_migrate: %s, %lld bytes from %s to %s via %s%s\n",
+		path, (long long)statbuf.st_size, from_store, to_store, storecopy_method_name(method),
+		verified ? ", verified" : "");
+
+	// The checksum goes with the new copy, a reflink has none
+	if (verified) {
+		STORE_CHECKSUM_T checksum;
+		checksum.crc = ckpt->crc;
+		checksum.size = statbuf_to.st_size;
+		checksum.mtime = statbuf_to.st_mtim.tv_sec;
+		checksum.mtime_nsec = statbuf_to.st_mtim.tv_nsec;
+		storeverify_set(path, checksum);
+	} else {
+		storeverify_del(path);
+	}
+
+	// Only once the objmap points at the target
 	if(!keep_source) {
 		log_msg(LOG_LEVEL_DEBUG, "\nstore_migrate: remove source file %s\n", fpath_from);
-		retstat = unlink(fpath_from);
-		if (retstat < 0)
-			retstat = store_error("store_migrate unlink");
+		if (unlink(fpath_from) < 0) {
+			return store_error("store_migrate unlink");
+		}
 	}
 
 	return 0;
-	
-}
\ No newline at end of file
+}
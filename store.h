@@ -2,6 +2,8 @@
 #define __STORE_H__
 
 #include <sys/types.h>
+#include <dirent.h>
+#include <stdint.h>
 #include <fuse.h>
 #include <map>
 #include <string>
@@ -30,16 +32,103 @@ extern vector<string> STORE_VOL_PATH;
 extern int store_init(const char * root);
 extern int store_mkdir(const char *path, mode_t mode);
 extern int store_rename(const char *path, const char *newpath);
-extern int store_readdir(
-		const char *path,
-		void *buf,
-		fuse_fill_dir_t filler,
-		off_t offset,
-		struct fuse_file_info *fi,
-		map<string, int>& parent_files);
+/*
+ * Directory cursor, kept in fi->fh between readdir calls.
+ * Lists the backing (root) dir first, then the objmap levels merged in name
+ * order, skipping objects the backing dir already returned. Entries are
+ * numbered from 0, that number is the readdir offset.
+ */
+struct STORE_DIR_T;
+// Resolves an object path to its store, i.e. get_realdir()
+typedef const string (*STORE_REALDIR_FN)(const char * path);
+/*
+ * Takes ownership of dp, the backing directory of path.
+ * realdir is only needed for store_dir_stat().
+ */
+extern STORE_DIR_T * store_opendir(DIR * dp, const char *path, STORE_REALDIR_FN realdir = NULL);
+/*
+ * Entry number off. Sequential offsets are streamed, anything else rewinds
+ * and skips forward. 0 when found, 1 past the end.
+ */
+extern int store_dir_entry(STORE_DIR_T * dir, off_t off, string &name);
+/*
+ * Attributes of the entry store_dir_entry() just returned, taken where a
+ * getattr would look: directories in the backing dir, objects in their
+ * store. store is the store the stat came from, empty for the backing dir.
+ * -1 if the entry is gone.
+ */
+extern int store_dir_stat(STORE_DIR_T * dir, struct stat * statbuf, string &store);
+extern void store_closedir(STORE_DIR_T * dir);
 extern int store_rmdir(const char *path);
-extern int store_migrate(const char *path, const char * from_store, const char * to_store, int keep_source);
+/*
+ * Progress of a resumable migration: the first offset bytes of the target
+ * are on disk and crc is their CRC32C. Only good for the source it was
+ * taken from, as told by its size and mtime (to the nanosecond, a write
+ * in the same second as the checkpoint still tells).
+ */
+struct STORE_MIGRATE_CKPT_T {
+	STORE_MIGRATE_CKPT_T():
+		offset(0),
+		crc(0),
+		source_size(0),
+		source_mtime(0),
+		source_mtime_nsec(0)
+	{
+	}
+
+	uint64_t offset;
+	uint32_t crc;
+	uint64_t source_size;
+	uint64_t source_mtime;
+	uint32_t source_mtime_nsec;
+};
+// Nanoseconds of an mtime recorded before they were kept, never matches
+#define STORE_MTIME_NSEC_UNKNOWN 1000000000U
+// A checkpoint is saved every time this much more has been copied and verified
+#define STORE_MIGRATE_CHECKPOINT_SIZE (256LL * 1024 * 1024)
+// Saves a checkpoint, failing to doesn't stop the migration
+typedef int (*STORE_MIGRATE_CKPT_FN)(const char * path, const STORE_MIGRATE_CKPT_T &ckpt, void * arg);
+/*
+ * Makes to_store the object's home, once the target is complete and the
+ * source unchanged. Nonzero when the object went away meanwhile, the
+ * target is dropped then.
+ */
+typedef int (*STORE_MIGRATE_COMMIT_FN)(const char * path, const char * to_store, void * arg);
+/*
+ * The target is read back and checked against the source's CRC32C before
+ * the source goes, see storeverify.h. A source written to during the copy
+ * fails the migration with -EAGAIN. The source is only unlinked after
+ * commit_fn took the target.
+ * With a ckpt_fn, a big file picks up from *ckpt (if it still matches the
+ * source) and leaves the last checkpoint there when it fails, partial
+ * target included, so the next attempt continues from it.
+ */
+extern int store_migrate(const char *path, const char * from_store, const char * to_store, int keep_source,
+	STORE_MIGRATE_CKPT_T * ckpt = NULL, STORE_MIGRATE_CKPT_FN ckpt_fn = NULL, void * ckpt_arg = NULL,
+	STORE_MIGRATE_COMMIT_FN commit_fn = NULL, void * commit_arg = NULL);
 
 extern int store_is_valid_store(const char * store_path);
 
+/*
+ * Where a file's data sits, for ordering bulk reads. physical is the
+ * byte address of its first extent (FIEMAP), 0 when the filesystem can't
+ * tell or hasn't allocated it yet; then the inode number is the next best
+ * guess.
+ */
+struct STORE_LOCATION_T {
+	STORE_LOCATION_T():
+		dev(0),
+		physical(0),
+		ino(0)
+	{
+	}
+
+	uint64_t dev;
+	uint64_t physical;
+	uint64_t ino;
+};
+extern int store_locate(const char * fpath, STORE_LOCATION_T &location);
+// Disk order: by device, then physical address, files without one by inode
+extern bool store_location_before(const STORE_LOCATION_T &a, const STORE_LOCATION_T &b);
+
 #endif
\ No newline at end of file
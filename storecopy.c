@@ -0,0 +1,392 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
+#include "log.h"
+#include "storeuring.h"
+#include "storeverify.h"
+#include "throttle.h"
+
+#include "storecopy.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+static const char * STORE_COPY_METHOD_NAME[STORE_COPY_METHOD_MAX] = {
+	"none",
+	"clone",
+	"io_uring",
+	"copy_file_range",
+	"sendfile",
+	"buffered",
+};
+
+static volatile int _storecopy_uring_depth = STORE_URING_DEPTH_DEFAULT;
+static volatile int _storecopy_uring_direct = 0;
+
+// Stores of a throttled copy, NULL members aren't limited
+struct STORE_COPY_PACE_T
+{
+	const char * from_store;
+	const char * to_store;
+};
+
+static unsigned long _storecopy_files[STORE_COPY_METHOD_MAX];
+static unsigned long long _storecopy_bytes[STORE_COPY_METHOD_MAX];
+// Source holes that were skipped rather than copied
+static unsigned long long _storecopy_hole_bytes = 0;
+
+// Errors that only mean "not this way", the next method may still work
+static bool storecopy_unsupported(int err)
+{
+	return err == EXDEV || err == EINVAL || err == ENOSYS
+		|| err == EOPNOTSUPP || err == ENOTTY || err == EBADF;
+}
+
+static bool storecopy_cross_device(int fd_from, int fd_to)
+{
+	struct stat st_from, st_to;
+	if(fstat(fd_from, &st_from) != 0 || fstat(fd_to, &st_to) != 0) {
+		return false;
+	}
+	return st_from.st_dev != st_to.st_dev;
+}
+
+static void storecopy_pace(void * arg, size_t bytes)
+{
+	STORE_COPY_PACE_T * pace = (STORE_COPY_PACE_T *)arg;
+	if(pace) {
+		throttle_acquire(pace->from_store, pace->to_store, bytes);
+	}
+}
+
+// Largest piece to move at once, throttled copies go chunk by chunk
+static size_t chunk_len(off_t left, size_t max, const STORE_COPY_PACE_T * pace)
+{
+	if(pace && max > THROTTLE_CHUNK_SIZE) {
+		max = THROTTLE_CHUNK_SIZE;
+	}
+	return left > (off_t)max ? max : (size_t)left;
+}
+
+// Whole-file reflink, the filesystem shares the extents
+static int copy_clone(int fd_from, int fd_to, off_t offset, off_t size)
+{
+	if(offset != 0) {
+		return -EINVAL;
+	}
+	if(ioctl(fd_to, FICLONE, fd_from) != 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int copy_range(int fd_from, int fd_to, off_t * offset, off_t end, STORE_COPY_PACE_T * pace)
+{
+#ifdef __NR_copy_file_range
+	while(*offset < end) {
+		loff_t off_in = *offset;
+		loff_t off_out = *offset;
+		size_t len = chunk_len(end - *offset, 0x40000000, pace);
+		storecopy_pace(pace, len);
+		ssize_t copied = syscall(__NR_copy_file_range, fd_from, &off_in, fd_to, &off_out, len, 0);
+		if(copied < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if(copied == 0) {
+			// Source shrank under us
+			return -EIO;
+		}
+		*offset += copied;
+	}
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+// sendfile() writes at the target's file position
+static int copy_sendfile(int fd_from, int fd_to, off_t * offset, off_t end, STORE_COPY_PACE_T * pace)
+{
+	if(lseek(fd_to, *offset, SEEK_SET) == (off_t)-1) {
+		return -errno;
+	}
+
+	while(*offset < end) {
+		off_t off_in = *offset;
+		size_t len = chunk_len(end - *offset, 0x40000000, pace);
+		storecopy_pace(pace, len);
+		ssize_t copied = sendfile(fd_to, fd_from, &off_in, len);
+		if(copied < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if(copied == 0) {
+			return -EIO;
+		}
+		*offset += copied;
+	}
+	return 0;
+}
+
+static int copy_buffered(int fd_from, int fd_to, off_t * offset, off_t end, STORE_COPY_PACE_T * pace, uint32_t * crc)
+{
+	char * buf = NULL;
+	if(posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), STORE_COPY_BLOCK_SIZE) != 0) {
+		return -ENOMEM;
+	}
+
+	int ret = 0;
+	while(*offset < end) {
+		size_t len = chunk_len(end - *offset, STORE_COPY_BLOCK_SIZE, pace);
+		storecopy_pace(pace, len);
+		ssize_t bytes_read = pread(fd_from, buf, len, *offset);
+		if(bytes_read < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ret = -errno;
+			break;
+		}
+		if(bytes_read == 0) {
+			ret = -EIO;
+			break;
+		}
+
+		ssize_t bytes_written = 0;
+		while(bytes_written < bytes_read) {
+			ssize_t n = pwrite(fd_to, buf + bytes_written, bytes_read - bytes_written, *offset + bytes_written);
+			if(n < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				ret = -errno;
+				break;
+			}
+			bytes_written += n;
+		}
+		if(ret != 0) {
+			break;
+		}
+		if(crc) {
+			*crc = storeverify_crc(*crc, buf, bytes_read);
+		}
+		*offset += bytes_read;
+	}
+
+	free(buf);
+	return ret;
+}
+
+static void storecopy_count(STORE_COPY_METHOD_T method, off_t size)
+{
+	__sync_fetch_and_add(&_storecopy_files[method], 1);
+	__sync_fetch_and_add(&_storecopy_bytes[method], (unsigned long long)size);
+}
+
+int storecopy_clone(int fd_from, int fd_to, off_t size)
+{
+	int ret = copy_clone(fd_from, fd_to, 0, size);
+	if(ret == 0) {
+		storecopy_count(STORE_COPY_CLONE, size);
+	}
+	return ret;
+}
+
+/*
+ * One run of data through the first method that takes it, used is where
+ * it ended up. 0, or -errno with the run partly copied.
+ */
+static int copy_data(int fd_from, int fd_to, off_t offset, off_t size, STORE_COPY_METHOD_T * used,
+	STORE_COPY_PACE_T * pace, uint32_t * crc)
+{
+	off_t end = offset + size;
+	off_t pos = offset;
+	int ret = 0;
+	// A failed pipeline starts the range over, and its checksum
+	uint32_t crc_start = crc ? *crc : 0;
+
+	/*
+	 * Across devices the synchronous methods leave one disk idle while
+	 * the other works, pipeline big files. Any failure redoes the range.
+	 * A checksum needs the data in user space, then the pipeline beats
+	 * the buffered copy on one device too.
+	 */
+	if(pos < end && size >= STORE_COPY_URING_MIN_SIZE && _storecopy_uring_depth > 0
+		&& (crc || storecopy_cross_device(fd_from, fd_to))) {
+		ret = storeuring_copy(fd_from, fd_to, offset, size, _storecopy_uring_depth, _storecopy_uring_direct,
+			pace ? storecopy_pace : NULL, pace, crc);
+		if(ret == 0) {
+			*used = STORE_COPY_URING;
+			pos = end;
+		} else {
+			if(ret != -ENOSYS) {
+				log_msg(LOG_LEVEL_ERROR, "storecopy_copy: io_uring failed: %s, copying synchronously\n", strerror(-ret));
+			}
+			if(crc) {
+				*crc = crc_start;
+			}
+		}
+	}
+
+	// The kernel side copies never show us the data
+	if(pos < end && !crc) {
+		*used = STORE_COPY_RANGE;
+		ret = copy_range(fd_from, fd_to, &pos, end, pace);
+	}
+	if(pos < end && !crc && storecopy_unsupported(-ret)) {
+		*used = STORE_COPY_SENDFILE;
+		ret = copy_sendfile(fd_from, fd_to, &pos, end, pace);
+	}
+	if(pos < end && (crc || storecopy_unsupported(-ret))) {
+		*used = STORE_COPY_BUFFERED;
+		ret = copy_buffered(fd_from, fd_to, &pos, end, pace, crc);
+	}
+
+	if(pos == end) {
+		return 0;
+	}
+	log_msg(LOG_LEVEL_ERROR, "storecopy_copy: %s failed at %lld of %lld: %s\n",
+		STORE_COPY_METHOD_NAME[*used], (long long)pos, (long long)end, strerror(-ret));
+	return ret;
+}
+
+/*
+ * The next run of data in [pos, end) is [*data, *hole). 1 if only holes
+ * are left, -errno if the filesystem can't tell.
+ */
+static int next_extent(int fd, off_t pos, off_t end, off_t * data, off_t * hole)
+{
+	*data = lseek(fd, pos, SEEK_DATA);
+	if(*data == (off_t)-1) {
+		// ENXIO: no data past pos
+		return errno == ENXIO ? 1 : -errno;
+	}
+	if(*data >= end) {
+		return 1;
+	}
+	*hole = lseek(fd, *data, SEEK_HOLE);
+	if(*hole == (off_t)-1) {
+		return -errno;
+	}
+	if(*hole > end) {
+		*hole = end;
+	}
+	return 0;
+}
+
+int storecopy_copy(int fd_from, int fd_to, off_t offset, off_t size, STORE_COPY_METHOD_T * method,
+	const char * from_store, const char * to_store, uint32_t * crc)
+{
+	off_t end = offset + size;
+	off_t pos = offset;
+	off_t data_bytes = 0;
+	int ret = 0;
+	STORE_COPY_METHOD_T used = STORE_COPY_NONE;
+
+	STORE_COPY_PACE_T pace_stores;
+	pace_stores.from_store = from_store;
+	pace_stores.to_store = to_store;
+	STORE_COPY_PACE_T * pace = ((from_store || to_store) && throttle_limited(from_store, to_store)) ? &pace_stores : NULL;
+
+	// A failed clone never leaves anything behind, any error falls through
+	if(size > 0 && !crc && copy_clone(fd_from, fd_to, offset, size) == 0) {
+		used = STORE_COPY_CLONE;
+		data_bytes = size;
+		pos = end;
+	}
+
+	// Fewer blocks than bytes: only copy the data, the holes stay holes
+	struct stat st_from;
+	bool sparse = (pos < end && fstat(fd_from, &st_from) == 0 && (off_t)st_from.st_blocks * 512 < st_from.st_size);
+
+	while(pos < end && ret == 0) {
+		off_t data = pos;
+		off_t hole = end;
+		if(sparse) {
+			int found = next_extent(fd_from, pos, end, &data, &hole);
+			if(found == 1) {
+				data = end;
+			} else if(found < 0) {
+				// Can't tell, the rest is data
+				sparse = false;
+				data = pos;
+				hole = end;
+			}
+		}
+
+		if(crc && data > pos) {
+			// Holes read back as zeros, the checksum has to cover them
+			*crc = storeverify_crc_zeros(*crc, data - pos);
+		}
+		pos = data;
+		if(pos >= end) {
+			break;
+		}
+
+		ret = copy_data(fd_from, fd_to, data, hole - data, &used, pace, crc);
+		if(ret == 0) {
+			data_bytes += hole - data;
+			pos = hole;
+		}
+	}
+
+	// A trailing hole is only a file size
+	struct stat st_to;
+	if(ret == 0 && data_bytes < size && fstat(fd_to, &st_to) == 0 && st_to.st_size < end
+		&& ftruncate(fd_to, end) != 0) {
+		ret = -errno;
+	}
+
+	if(ret == 0) {
+		storecopy_count(used, data_bytes);
+		__sync_fetch_and_add(&_storecopy_hole_bytes, (unsigned long long)(size - data_bytes));
+	}
+
+	if(method) {
+		*method = used;
+	}
+	return ret;
+}
+
+const char * storecopy_method_name(STORE_COPY_METHOD_T method)
+{
+	return (method >= 0 && method < STORE_COPY_METHOD_MAX) ? STORE_COPY_METHOD_NAME[method] : "unknown";
+}
+
+int storecopy_in_user_space(int fd_from, int fd_to, off_t size)
+{
+	return size >= STORE_COPY_URING_MIN_SIZE && _storecopy_uring_depth > 0
+		&& storecopy_cross_device(fd_from, fd_to) && storeuring_available();
+}
+
+void storecopy_set_uring(int depth, int direct)
+{
+	_storecopy_uring_depth = depth < 0 ? 0 : (depth > STORE_URING_DEPTH_MAX ? STORE_URING_DEPTH_MAX : depth);
+	_storecopy_uring_direct = direct;
+	log_msg(LOG_LEVEL_ERROR, "storecopy_set_uring: depth %d%s\n", _storecopy_uring_depth, direct ? ", O_DIRECT" : "");
+}
+
+int storecopy_dump_to_log()
+{
+	for(int i = STORE_COPY_CLONE; i < STORE_COPY_METHOD_MAX; i++) {
+		log_msg(LOG_LEVEL_ERROR, "storecopy %s: %lu files, %llu bytes\n",
+			STORE_COPY_METHOD_NAME[i],
+			__sync_fetch_and_add(&_storecopy_files[i], 0),
+			__sync_fetch_and_add(&_storecopy_bytes[i], 0));
+	}
+	log_msg(LOG_LEVEL_ERROR, "storecopy holes: %llu bytes skipped\n", __sync_fetch_and_add(&_storecopy_hole_bytes, 0));
+	return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef __STORE_COPY_H__
+#define __STORE_COPY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Data mover behind store_migrate(). Tries the cheapest way first:
+ * a reflink (same filesystem, whole file), then for large files across
+ * devices the io_uring pipeline, copy_file_range, sendfile, and finally a
+ * plain buffered copy. Offsets are 64-bit throughout.
+ * Given the stores, data moves at the pace throttle.h allows for them
+ * (reflinks don't move any). A sparse source is walked extent by extent
+ * with SEEK_DATA/SEEK_HOLE, holes are skipped and stay holes in the target.
+ */
+enum STORE_COPY_METHOD_T {
+	STORE_COPY_NONE = 0,
+	STORE_COPY_CLONE,
+	STORE_COPY_URING,
+	STORE_COPY_RANGE,
+	STORE_COPY_SENDFILE,
+	STORE_COPY_BUFFERED,
+	STORE_COPY_METHOD_MAX
+};
+
+// Buffered copy block size
+#define STORE_COPY_BLOCK_SIZE (256 * 1024)
+// Smaller files aren't worth a ring
+#define STORE_COPY_URING_MIN_SIZE (4 * 1024 * 1024)
+
+/*
+ * Copies [offset, offset + size) of fd_from to the same range of fd_to,
+ * which must not hold data where the source has holes (a new file, or
+ * one cut back to offset). method is the last way any of the data went.
+ * from_store/to_store pick the rate limits, NULL copies at full speed.
+ * With crc the CRC32C of the range is added to *crc, which rules out the
+ * reflink and the in-kernel copies.
+ * 0, or -errno with the range partly copied.
+ */
+extern int storecopy_copy(int fd_from, int fd_to, off_t offset, off_t size, STORE_COPY_METHOD_T * method,
+	const char * from_store = NULL, const char * to_store = NULL, uint32_t * crc = NULL);
+/*
+ * 1 if copying size bytes between the two goes through the io_uring
+ * pipeline, where a checksum on the way costs no extra reads.
+ */
+extern int storecopy_in_user_space(int fd_from, int fd_to, off_t size);
+// Whole-file reflink of size bytes, 0 or -errno with nothing done
+extern int storecopy_clone(int fd_from, int fd_to, off_t size);
+extern const char * storecopy_method_name(STORE_COPY_METHOD_T method);
+// io_uring queue depth (0 turns the pipeline off) and O_DIRECT on both sides
+extern void storecopy_set_uring(int depth, int direct);
+// Files and bytes per method
+extern int storecopy_dump_to_log();
+
+#endif
@@ -0,0 +1,168 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "leveldb/db.h"
+#include "log.h"
+#include "metadb.h"
+#include "store.h"
+#include "utils.h"
+
+#include "storereg.h"
+
+using namespace std;
+
+static map<string, uint32_t> _storereg_ids;
+static map<uint32_t, string> _storereg_paths;
+static uint32_t _storereg_next_id = STOREREG_INVALID_ID + 1;
+static int _storereg_loaded = 0;
+static pthread_mutex_t _storereg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Keys are the decimal id, values the store root
+static string id_key(uint32_t id)
+{
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%u", id);
+	return buf;
+}
+
+// with _storereg_mutex held
+static int storereg_register(const string &store_path, uint32_t &id)
+{
+	map<string, uint32_t>::const_iterator mit = _storereg_ids.find(store_path);
+	if(mit != _storereg_ids.end()) {
+		id = mit->second;
+		return 0;
+	}
+
+	// On disk before anyone can write the id into the objmap
+	leveldb::Status status = metadb_put(METADB_STOREREG, id_key(_storereg_next_id), store_path);
+	if(false == status.ok()) {
+		log_msg(LOG_LEVEL_ERROR, "storereg_register: %s: %s\n", store_path.c_str(), status.ToString().c_str());
+		return -1;
+	}
+
+	id = _storereg_next_id++;
+	_storereg_ids[store_path] = id;
+	_storereg_paths[id] = store_path;
+	log_msg(LOG_LEVEL_DEBUG, "storereg_register: %s is store %u\n", store_path.c_str(), id);
+	return 0;
+}
+
+int storereg_init()
+{
+	if (metadb_init() != 0)
+	{
+		return -1;
+	}
+
+	AutoLock lock(&_storereg_mutex);
+
+	if(!_storereg_loaded) {
+		leveldb::Iterator* it = metadb_iterator(METADB_STOREREG);
+		for (it->SeekToFirst(); it->Valid(); it->Next())
+		{
+			uint32_t id = strtoul(it->key().ToString().c_str(), NULL, 10);
+			string store_path = it->value().ToString();
+			_storereg_ids[store_path] = id;
+			_storereg_paths[id] = store_path;
+			if(id >= _storereg_next_id) {
+				_storereg_next_id = id + 1;
+			}
+		}
+		leveldb::Status status = it->status();
+		delete it;
+
+		if(false == status.ok()) {
+			log_msg(LOG_LEVEL_ERROR, "storereg_init: %s\n", status.ToString().c_str());
+			return -1;
+		}
+		_storereg_loaded = 1;
+	}
+
+	// Stores seen later (rootmap destinations and such) register on first use
+	vector<string> stores(STORE_STORE_PATH);
+	stores.insert(stores.end(), STORE_VOL_PATH.begin(), STORE_VOL_PATH.end());
+	stores.push_back(STORE_DATA_STAGING_SOURCE.store_name);
+	stores.push_back(STORE_DATA_STAGING_TARGET.store_name);
+
+	uint32_t id;
+	for(size_t i = 0; i < stores.size(); i++) {
+		if(!stores[i].empty() && storereg_register(stores[i], id) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int storereg_id(const char * store_path, uint32_t &id)
+{
+	if(!store_path) {
+		return -1;
+	}
+
+	AutoLock lock(&_storereg_mutex);
+	return storereg_register(store_path, id);
+}
+
+int storereg_path(uint32_t id, string &store_path)
+{
+	AutoLock lock(&_storereg_mutex);
+
+	map<uint32_t, string>::const_iterator mit = _storereg_paths.find(id);
+	if(mit == _storereg_paths.end()) {
+		return -1;
+	}
+
+	store_path = mit->second;
+	return 0;
+}
+
+int storereg_relocate(const char * old_path, const char * new_path)
+{
+	if(!old_path || !new_path) {
+		return -1;
+	}
+
+	AutoLock lock(&_storereg_mutex);
+
+	map<string, uint32_t>::iterator mit = _storereg_ids.find(old_path);
+	if(mit == _storereg_ids.end()) {
+		log_msg(LOG_LEVEL_ERROR, "storereg_relocate: %s is not a registered store\n", old_path);
+		return -1;
+	}
+	if(_storereg_ids.find(new_path) != _storereg_ids.end()) {
+		log_msg(LOG_LEVEL_ERROR, "storereg_relocate: %s is already a store\n", new_path);
+		return -1;
+	}
+
+	uint32_t id = mit->second;
+	leveldb::Status status = metadb_put(METADB_STOREREG, id_key(id), new_path);
+	if(false == status.ok()) {
+		log_msg(LOG_LEVEL_ERROR, "storereg_relocate: %s\n", status.ToString().c_str());
+		return -1;
+	}
+
+	_storereg_ids.erase(mit);
+	_storereg_ids[new_path] = id;
+	_storereg_paths[id] = new_path;
+	log_msg(LOG_LEVEL_ERROR, "storereg_relocate: store %u moved from %s to %s\n", id, old_path, new_path);
+	return 0;
+}
+
+int storereg_dump_to_log()
+{
+	AutoLock lock(&_storereg_mutex);
+
+	map<uint32_t, string>::const_iterator mit;
+	for(mit = _storereg_paths.begin(); mit != _storereg_paths.end(); mit++) {
+		log_msg(LOG_LEVEL_ERROR, "store %u : %s\n", mit->first, mit->second.c_str());
+	}
+	return 0;
+}
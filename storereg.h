@@ -0,0 +1,25 @@
+#ifndef __STORE_REG_H__
+#define __STORE_REG_H__
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+/*
+ * Persistent store registry: every store root gets a small numeric id,
+ * which is what the objmap keeps instead of the full path. Ids are never
+ * reused, moving a store only rewrites its registry entry.
+ */
+#define STOREREG_INVALID_ID 0
+
+// Loads the registry and registers the configured stores
+extern int storereg_init();
+// Id of store_path, registering it on first use
+extern int storereg_id(const char * store_path, uint32_t &id);
+extern int storereg_path(uint32_t id, string &store_path);
+// Points the id of old_path at new_path. -1 if new_path has its own id.
+extern int storereg_relocate(const char * old_path, const char * new_path);
+extern int storereg_dump_to_log();
+
+#endif
@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "storeverify.h"
+
+#include "storeuring.h"
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define STORE_URING_SUPPORTED 1
+#endif
+#endif
+
+#ifdef STORE_URING_SUPPORTED
+
+// Set once a ring could not be set up, no point retrying every file
+static volatile int _storeuring_disabled = 0;
+
+struct STORE_URING_T
+{
+	int fd;
+	struct io_uring_params params;
+
+	void * sq_ring;
+	size_t sq_ring_size;
+	void * cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe * sqes;
+	size_t sqes_size;
+
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+
+	unsigned to_submit;
+};
+
+enum STORE_URING_SLOT_STATE_T {
+	STORE_URING_FREE = 0,
+	STORE_URING_READING,
+	STORE_URING_WRITING,
+	// Written, but the checksum hasn't got to it yet
+	STORE_URING_WRITTEN
+};
+
+struct STORE_URING_SLOT_T
+{
+	enum STORE_URING_SLOT_STATE_T state;
+	char * buf;
+	off_t off;
+	// Data bytes of the chunk, and how much I/O that takes (aligned for O_DIRECT)
+	size_t want;
+	size_t io_len;
+	size_t done;
+	bool summed;
+};
+
+static void ring_close(STORE_URING_T * ring)
+{
+	if(ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if(ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if(ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if(ring->fd >= 0) {
+		close(ring->fd);
+	}
+}
+
+static int ring_open(STORE_URING_T * ring, unsigned entries)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &ring->params);
+	if(ring->fd < 0) {
+		ring->fd = -1;
+		return -errno;
+	}
+
+	struct io_uring_params * p = &ring->params;
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if(p->features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED) {
+		int err = -errno;
+		ring_close(ring);
+		return err;
+	}
+	if(p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq_ring == MAP_FAILED) {
+			int err = -errno;
+			ring_close(ring);
+			return err;
+		}
+	}
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		int err = -errno;
+		ring_close(ring);
+		return err;
+	}
+
+	char * sq = (char *)ring->sq_ring;
+	char * cq = (char *)ring->cq_ring;
+	ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+// One read or write of slot i, queued until the next ring_enter()
+static void ring_prep(STORE_URING_T * ring, int op, int fd, STORE_URING_SLOT_T * slot, unsigned i, bool fixed)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe * sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->off = slot->off + slot->done;
+	sqe->addr = (unsigned long)(slot->buf + slot->done);
+	sqe->len = slot->io_len - slot->done;
+	sqe->user_data = i;
+	if(fixed) {
+		sqe->opcode = (op == STORE_URING_READING) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = i;
+	} else {
+		sqe->opcode = (op == STORE_URING_READING) ? IORING_OP_READ : IORING_OP_WRITE;
+	}
+
+	ring->sq_array[index] = index;
+	__sync_synchronize();
+	*ring->sq_tail = tail + 1;
+	ring->to_submit++;
+}
+
+static int ring_enter(STORE_URING_T * ring, unsigned min_complete)
+{
+	while(1) {
+		int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret >= 0) {
+			ring->to_submit -= ret;
+			return 0;
+		}
+		if(errno != EINTR) {
+			return -errno;
+		}
+	}
+}
+
+int storeuring_available()
+{
+	if(_storeuring_disabled) {
+		return 0;
+	}
+
+	STORE_URING_T ring;
+	int ret = ring_open(&ring, 1);
+	if(ret != 0) {
+		log_msg(LOG_LEVEL_ERROR, "storeuring_available: no io_uring (%s), using the synchronous copy\n", strerror(-ret));
+		_storeuring_disabled = 1;
+		return 0;
+	}
+	ring_close(&ring);
+	return 1;
+}
+
+/*
+ * Reads finish out of order, the checksum has to go in file order: extend
+ * it over every read buffer that is next in line. A written buffer is
+ * only reused once it's summed.
+ */
+static void sum_slots(STORE_URING_SLOT_T * slots, int depth, off_t * sum_off, uint32_t * crc)
+{
+	bool progress = true;
+	while(progress) {
+		progress = false;
+		for(int i = 0; i < depth; i++) {
+			STORE_URING_SLOT_T * slot = &slots[i];
+			if(slot->summed || slot->off != *sum_off
+				|| (slot->state != STORE_URING_WRITING && slot->state != STORE_URING_WRITTEN)) {
+				continue;
+			}
+			*crc = storeverify_crc(*crc, slot->buf, slot->want);
+			*sum_off += slot->want;
+			slot->summed = true;
+			if(slot->state == STORE_URING_WRITTEN) {
+				slot->state = STORE_URING_FREE;
+			}
+			progress = true;
+		}
+	}
+}
+
+int storeuring_copy(int fd_from, int fd_to, off_t offset, off_t size, int depth, int direct,
+	STORE_URING_PACE_FN pace, void * pace_arg, uint32_t * crc)
+{
+	if(depth < 1) {
+		depth = 1;
+	} else if(depth > STORE_URING_DEPTH_MAX) {
+		depth = STORE_URING_DEPTH_MAX;
+	}
+	if(direct && (offset % STORE_URING_ALIGN) != 0) {
+		direct = 0;
+	}
+
+	STORE_URING_T ring;
+	if(_storeuring_disabled || ring_open(&ring, depth) != 0) {
+		_storeuring_disabled = 1;
+		return -ENOSYS;
+	}
+
+	STORE_URING_SLOT_T slots[STORE_URING_DEPTH_MAX];
+	struct iovec iovs[STORE_URING_DEPTH_MAX];
+	int ret = 0;
+	memset(slots, 0, sizeof(slots));
+	for(int i = 0; i < depth; i++) {
+		if(posix_memalign((void **)&slots[i].buf, STORE_URING_ALIGN, STORE_URING_CHUNK_SIZE) != 0) {
+			ret = -ENOMEM;
+			break;
+		}
+		iovs[i].iov_base = slots[i].buf;
+		iovs[i].iov_len = STORE_URING_CHUNK_SIZE;
+	}
+
+	// Pinned buffers skip the per-I/O page mapping, but count against memlock
+	bool fixed = (ret == 0 && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovs, depth) == 0);
+
+	int fl_from = fcntl(fd_from, F_GETFL);
+	int fl_to = fcntl(fd_to, F_GETFL);
+	if(ret == 0 && direct) {
+		if(fcntl(fd_from, F_SETFL, fl_from | O_DIRECT) != 0 || fcntl(fd_to, F_SETFL, fl_to | O_DIRECT) != 0) {
+			fcntl(fd_from, F_SETFL, fl_from);
+			direct = 0;
+		}
+	}
+
+	off_t end = offset + size;
+	off_t next = offset;
+	off_t sum_off = offset;
+	int inflight = 0;
+
+	while(ret == 0 && (next < end || inflight > 0)) {
+		// Start a read on every free buffer
+		for(int i = 0; i < depth && next < end; i++) {
+			STORE_URING_SLOT_T * slot = &slots[i];
+			if(slot->state != STORE_URING_FREE) {
+				continue;
+			}
+			slot->off = next;
+			slot->want = (end - next) > (off_t)STORE_URING_CHUNK_SIZE ? STORE_URING_CHUNK_SIZE : (size_t)(end - next);
+			slot->io_len = direct ? (slot->want + STORE_URING_ALIGN - 1) / STORE_URING_ALIGN * STORE_URING_ALIGN : slot->want;
+			slot->done = 0;
+			slot->summed = false;
+			slot->state = STORE_URING_READING;
+			if(pace) {
+				// Chunks already in flight keep going while we wait
+				pace(pace_arg, slot->want);
+			}
+			ring_prep(&ring, STORE_URING_READING, fd_from, slot, i, fixed);
+			next += slot->want;
+			inflight++;
+		}
+
+		ret = ring_enter(&ring, 1);
+		if(ret != 0) {
+			break;
+		}
+
+		// Reap, a finished read turns straight into a write of the same buffer
+		unsigned head = *ring.cq_head;
+		__sync_synchronize();
+		while(head != *ring.cq_tail) {
+			struct io_uring_cqe * cqe = &ring.cqes[head & *ring.cq_mask];
+			STORE_URING_SLOT_T * slot = &slots[cqe->user_data];
+			int res = cqe->res;
+			head++;
+
+			if(res < 0) {
+				ret = res;
+				inflight--;
+				break;
+			}
+			slot->done += res;
+
+			if(slot->state == STORE_URING_READING) {
+				if(slot->done < slot->want) {
+					if(res == 0) {
+						// Source shrank under us
+						ret = -EIO;
+						inflight--;
+						break;
+					}
+					ring_prep(&ring, STORE_URING_READING, fd_from, slot, cqe->user_data, fixed);
+					continue;
+				}
+				slot->done = 0;
+				slot->state = STORE_URING_WRITING;
+				ring_prep(&ring, STORE_URING_WRITING, fd_to, slot, cqe->user_data, fixed);
+			} else {
+				if(slot->done < slot->io_len) {
+					if(res == 0) {
+						ret = -EIO;
+						inflight--;
+						break;
+					}
+					ring_prep(&ring, STORE_URING_WRITING, fd_to, slot, cqe->user_data, fixed);
+					continue;
+				}
+				slot->state = (crc && !slot->summed) ? STORE_URING_WRITTEN : STORE_URING_FREE;
+				inflight--;
+			}
+		}
+		__sync_synchronize();
+		*ring.cq_head = head;
+
+		if(crc) {
+			sum_slots(slots, depth, &sum_off, crc);
+		}
+	}
+
+	if(ret != 0 && inflight > 0) {
+		// The kernel still owns the buffers, wait them out before freeing
+		while(inflight > 0 && ring_enter(&ring, 1) == 0) {
+			unsigned head = *ring.cq_head;
+			__sync_synchronize();
+			while(head != *ring.cq_tail) {
+				head++;
+				inflight--;
+			}
+			*ring.cq_head = head;
+		}
+	}
+
+	if(direct) {
+		fcntl(fd_from, F_SETFL, fl_from);
+		fcntl(fd_to, F_SETFL, fl_to);
+		// The last block went out rounded up
+		if(ret == 0 && ftruncate(fd_to, end) != 0) {
+			ret = -errno;
+		}
+	}
+
+	ring_close(&ring);
+	for(int i = 0; i < depth; i++) {
+		free(slots[i].buf);
+	}
+
+	return ret;
+}
+
+#else
+
+int storeuring_available()
+{
+	return 0;
+}
+
+int storeuring_copy(int fd_from, int fd_to, off_t offset, off_t size, int depth, int direct,
+	STORE_URING_PACE_FN pace, void * pace_arg, uint32_t * crc)
+{
+	return -ENOSYS;
+}
+
+#endif
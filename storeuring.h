@@ -0,0 +1,36 @@
+#ifndef __STORE_URING_H__
+#define __STORE_URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * io_uring copy pipeline for cross-device migrations, straight on the
+ * syscalls (no liburing). depth buffers of STORE_URING_CHUNK_SIZE are
+ * in flight at once, so reading chunk N+1 overlaps writing chunk N.
+ * Buffers are registered with the ring when the memlock limit allows.
+ */
+#define STORE_URING_CHUNK_SIZE (1024 * 1024)
+#define STORE_URING_DEPTH_DEFAULT 8
+#define STORE_URING_DEPTH_MAX 64
+// O_DIRECT alignment, for both offsets and lengths
+#define STORE_URING_ALIGN 4096
+
+// Called with the size of each chunk before it is read, may block
+typedef void (*STORE_URING_PACE_FN)(void * arg, size_t bytes);
+
+// 1 if this kernel (and seccomp policy) lets us set up a ring
+extern int storeuring_available();
+/*
+ * Copies [offset, offset + size) of fd_from to fd_to with depth chunks
+ * in flight, direct switches both fds to O_DIRECT for the copy.
+ * pace, if given, is called before every chunk is read. crc, if given, is
+ * extended with the CRC32C of the range (in file order).
+ * 0, -ENOSYS if no ring could be set up (nothing was copied), or -errno
+ * with the range in an unknown state.
+ */
+extern int storeuring_copy(int fd_from, int fd_to, off_t offset, off_t size, int depth, int direct,
+	STORE_URING_PACE_FN pace = NULL, void * pace_arg = NULL, uint32_t * crc = NULL);
+
+#endif
@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "leveldb/db.h"
+#include "leveldb/util/crc32c.h"
+#include "leveldb/write_batch.h"
+#include "log.h"
+#include "metadb.h"
+#include "metatxn.h"
+#include "store.h"
+#include "throttle.h"
+#include "utils.h"
+
+#include "storeverify.h"
+
+using namespace std;
+
+struct STORE_VERIFY_PIECE_T
+{
+	off_t end;
+	uint32_t crc;
+};
+
+struct STORE_VERIFY_T
+{
+	int fd;
+	// Source read back along with the target, -1 when the copy checksums it
+	int fd_from;
+	// Buckets the reads are charged to, as the copy's
+	const char * from_store;
+	const char * to_store;
+	char * buf;
+	bool background;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	deque<STORE_VERIFY_PIECE_T> pieces;
+	bool closing;
+
+	// Read back and good up to here, only the verifier moves it
+	off_t offset;
+	uint32_t crc;
+	int error;
+};
+
+// Stats
+static unsigned long long _storeverify_bytes = 0;
+static unsigned long _storeverify_files = 0;
+static unsigned long _storeverify_mismatches = 0;
+
+#if defined(__x86_64__)
+// Same polynomial as leveldb's table version, the instruction just skips the table
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const char * data, size_t n)
+{
+	const unsigned char * p = (const unsigned char *)data;
+	uint64_t l = crc ^ 0xffffffffu;
+
+	while(n > 0 && ((uintptr_t)p & 7) != 0) {
+		l = _mm_crc32_u8((uint32_t)l, *p++);
+		n--;
+	}
+	while(n >= 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		l = _mm_crc32_u64(l, word);
+		p += 8;
+		n -= 8;
+	}
+	while(n > 0) {
+		l = _mm_crc32_u8((uint32_t)l, *p++);
+		n--;
+	}
+
+	return (uint32_t)l ^ 0xffffffffu;
+}
+#endif
+
+uint32_t storeverify_crc(uint32_t crc, const char * data, size_t n)
+{
+#if defined(__x86_64__)
+	static int sse42 = -1;
+	if(sse42 < 0) {
+		sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+	}
+	if(sse42) {
+		return crc_sse42(crc, data, n);
+	}
+#endif
+	return leveldb::crc32c::Extend(crc, data, n);
+}
+
+uint32_t storeverify_crc_zeros(uint32_t crc, off_t n)
+{
+	static const char zeros[64 * 1024] = {0};
+	while(n > 0) {
+		size_t len = n > (off_t)sizeof(zeros) ? sizeof(zeros) : (size_t)n;
+		crc = storeverify_crc(crc, zeros, len);
+		n -= len;
+	}
+	return crc;
+}
+
+// Reads len bytes at pos into verify->buf, 0 or -errno
+static int read_block(STORE_VERIFY_T * verify, int fd, size_t len, off_t pos, const char * what)
+{
+	size_t done = 0;
+	while(done < len) {
+		ssize_t bytes_read = pread(fd, verify->buf + done, len - done, pos + done);
+		if(bytes_read < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if(bytes_read == 0) {
+			log_msg(LOG_LEVEL_ERROR, "storeverify: %s ends at %lld, expected %lld\n", what,
+				(long long)(pos + done), (long long)(pos + len));
+			return -EIO;
+		}
+		done += bytes_read;
+	}
+	return 0;
+}
+
+// Reads the target, and the source with fd_from, from verify->offset to end, 0 or -errno
+static int verify_piece(STORE_VERIFY_T * verify, const STORE_VERIFY_PIECE_T &piece)
+{
+	off_t pos = verify->offset;
+	uint32_t crc = verify->crc;
+	uint32_t crc_from = (verify->fd_from >= 0) ? verify->crc : piece.crc;
+
+	// Synced pages are clean, dropping them makes the reads come from the disk
+	posix_fadvise(verify->fd, pos, piece.end - pos, POSIX_FADV_DONTNEED);
+
+	while(pos < piece.end) {
+		size_t len = (piece.end - pos) > (off_t)STORE_VERIFY_BLOCK_SIZE ? STORE_VERIFY_BLOCK_SIZE : (size_t)(piece.end - pos);
+		int ret;
+		if(verify->fd_from >= 0) {
+			if(verify->from_store) {
+				throttle_acquire(verify->from_store, NULL, len);
+			}
+			if((ret = read_block(verify, verify->fd_from, len, pos, "source")) != 0) {
+				return ret;
+			}
+			crc_from = storeverify_crc(crc_from, verify->buf, len);
+		}
+		if(verify->to_store) {
+			throttle_acquire(NULL, verify->to_store, len);
+		}
+		if((ret = read_block(verify, verify->fd, len, pos, "target")) != 0) {
+			return ret;
+		}
+		crc = storeverify_crc(crc, verify->buf, len);
+		pos += len;
+	}
+
+	if(crc != crc_from) {
+		log_msg(LOG_LEVEL_ERROR, "storeverify: checksum mismatch before %lld, source %08x, target %08x\n",
+			(long long)piece.end, crc_from, crc);
+		__sync_fetch_and_add(&_storeverify_mismatches, 1);
+		return -EIO;
+	}
+
+	__sync_fetch_and_add(&_storeverify_bytes, (unsigned long long)(piece.end - verify->offset));
+	AutoLock _lock(&verify->mutex);
+	verify->offset = piece.end;
+	verify->crc = crc;
+	return 0;
+}
+
+static void * storeverify_threadmain(void * arg)
+{
+	STORE_VERIFY_T * verify = (STORE_VERIFY_T *)arg;
+
+	while(1) {
+		pthread_mutex_lock(&verify->mutex);
+		while(verify->pieces.empty() && !verify->closing) {
+			pthread_cond_wait(&verify->cond, &verify->mutex);
+		}
+		if(verify->pieces.empty()) {
+			pthread_mutex_unlock(&verify->mutex);
+			break;
+		}
+		STORE_VERIFY_PIECE_T piece = verify->pieces.front();
+		verify->pieces.pop_front();
+		int error = verify->error;
+		pthread_mutex_unlock(&verify->mutex);
+
+		// After a failure the rest is only drained
+		if(error == 0) {
+			error = verify_piece(verify, piece);
+			if(error != 0) {
+				AutoLock _lock(&verify->mutex);
+				verify->error = error;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+STORE_VERIFY_T * storeverify_start(const char * fpath, int fd_from, off_t offset, uint32_t crc, bool background,
+	const char * from_store, const char * to_store)
+{
+	int fd = open(fpath, O_RDONLY);
+	if(fd < 0) {
+		log_msg(LOG_LEVEL_ERROR, "storeverify_start: cannot open %s: %s\n", fpath, strerror(errno));
+		return NULL;
+	}
+
+	STORE_VERIFY_T * verify = new STORE_VERIFY_T();
+	verify->fd = fd;
+	verify->fd_from = fd_from;
+	verify->from_store = from_store;
+	verify->to_store = to_store;
+	verify->buf = NULL;
+	verify->background = background;
+	verify->closing = false;
+	verify->offset = offset;
+	verify->crc = crc;
+	verify->error = 0;
+	pthread_mutex_init(&verify->mutex, NULL);
+	pthread_cond_init(&verify->cond, NULL);
+
+	if(posix_memalign((void **)&verify->buf, sysconf(_SC_PAGESIZE), STORE_VERIFY_BLOCK_SIZE) != 0) {
+		verify->buf = NULL;
+		verify->error = -ENOMEM;
+		verify->background = false;
+	}
+	if(verify->background && pthread_create(&verify->thread, NULL, storeverify_threadmain, verify) != 0) {
+		// Still verified, just not in parallel
+		verify->background = false;
+	}
+
+	return verify;
+}
+
+void storeverify_add(STORE_VERIFY_T * verify, off_t end, uint32_t crc)
+{
+	STORE_VERIFY_PIECE_T piece;
+	piece.end = end;
+	piece.crc = crc;
+
+	if(verify->background) {
+		AutoLock _lock(&verify->mutex);
+		verify->pieces.push_back(piece);
+		pthread_cond_signal(&verify->cond);
+		return;
+	}
+
+	if(verify->error == 0) {
+		verify->error = verify_piece(verify, piece);
+	}
+}
+
+void storeverify_progress(STORE_VERIFY_T * verify, off_t * offset, uint32_t * crc)
+{
+	AutoLock _lock(&verify->mutex);
+	*offset = verify->offset;
+	*crc = verify->crc;
+}
+
+int storeverify_finish(STORE_VERIFY_T * verify, uint32_t * crc)
+{
+	if(verify->background) {
+		{
+			AutoLock _lock(&verify->mutex);
+			verify->closing = true;
+			pthread_cond_signal(&verify->cond);
+		}
+		pthread_join(verify->thread, NULL);
+	}
+
+	int error = verify->error;
+	if(error == 0) {
+		__sync_fetch_and_add(&_storeverify_files, 1);
+		*crc = verify->crc;
+	}
+
+	close(verify->fd);
+	free(verify->buf);
+	pthread_cond_destroy(&verify->cond);
+	pthread_mutex_destroy(&verify->mutex);
+	delete verify;
+
+	return error;
+}
+
+int storeverify_set(const char * obj, const STORE_CHECKSUM_T &checksum)
+{
+	if(metadb_init() != 0) {
+		return -1;
+	}
+
+	string value(1, STORE_CHECKSUM_VERSION);
+	put_varint32(value, checksum.crc);
+	put_varint64(value, checksum.size);
+	put_varint64(value, checksum.mtime);
+	put_varint32(value, checksum.mtime_nsec);
+
+	leveldb::Status status = metadb_put(METADB_CHECKSUM, obj, value);
+	if (false == status.ok())
+	{
+		log_msg(LOG_LEVEL_ERROR, "storeverify_set: %s\n", status.ToString().c_str());
+		return -1;
+	}
+	return 0;
+}
+
+static int checksum_decode(const string &value, STORE_CHECKSUM_T &checksum)
+{
+	const char * p = value.data();
+	const char * limit = value.data() + value.size();
+
+	if(value.empty() || *p++ != STORE_CHECKSUM_VERSION
+		|| !get_varint32(p, limit, checksum.crc)
+		|| !get_varint64(p, limit, checksum.size)
+		|| !get_varint64(p, limit, checksum.mtime)) {
+		return -1;
+	}
+	checksum.mtime_nsec = STORE_MTIME_NSEC_UNKNOWN;
+	if(p < limit && !get_varint32(p, limit, checksum.mtime_nsec)) {
+		return -1;
+	}
+	return 0;
+}
+
+int storeverify_get(const char * obj, STORE_CHECKSUM_T &checksum)
+{
+	if(metadb_init() != 0) {
+		return -1;
+	}
+
+	string value;
+	if(false == metadb_get(METADB_CHECKSUM, obj, &value).ok()) {
+		return -1;
+	}
+	return checksum_decode(value, checksum);
+}
+
+int storeverify_del(const char * obj, META_TXN_T * txn)
+{
+	if(txn) {
+		metadb_batch_delete(metatxn_batch(txn), METADB_CHECKSUM, obj);
+		return 0;
+	}
+
+	metadb_delete(METADB_CHECKSUM, obj);
+	return 0;
+}
+
+int storeverify_rename(const char * obj, const char * newobj, META_TXN_T * txn)
+{
+	string value;
+	if(metadb_get(METADB_CHECKSUM, obj, &value).ok()) {
+		metadb_batch_put(metatxn_batch(txn), METADB_CHECKSUM, newobj, value);
+		metadb_batch_delete(metatxn_batch(txn), METADB_CHECKSUM, obj);
+	} else {
+		// Whatever newobj was is gone
+		metadb_batch_delete(metatxn_batch(txn), METADB_CHECKSUM, newobj);
+	}
+	return 0;
+}
+
+int storeverify_dump_to_log()
+{
+	unsigned long checksums = 0;
+	unsigned long long bytes = 0;
+
+	leveldb::Iterator* it = metadb_iterator(METADB_CHECKSUM);
+	for (it->SeekToFirst(); it->Valid(); it->Next())
+	{
+		STORE_CHECKSUM_T checksum;
+		if(checksum_decode(it->value().ToString(), checksum) == 0) {
+			checksums++;
+			bytes += checksum.size;
+		}
+	}
+	delete it;
+
+	log_msg(LOG_LEVEL_ERROR, "storeverify: %lu files verified, %llu bytes read back, %lu mismatches; %lu checksums kept for %llu bytes\n",
+		__sync_fetch_and_add(&_storeverify_files, 0),
+		__sync_fetch_and_add(&_storeverify_bytes, 0),
+		__sync_fetch_and_add(&_storeverify_mismatches, 0),
+		checksums, bytes);
+	return 0;
+}
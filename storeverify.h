@@ -0,0 +1,75 @@
+#ifndef __STORE_VERIFY_H__
+#define __STORE_VERIFY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+using namespace std;
+
+struct META_TXN_T;
+
+/*
+ * End-to-end checks for migrated data.
+ *
+ * Every piece that is copied and synced is read back from the target and
+ * checksummed (CRC32C, same values as leveldb's crc32c::Extend(), with
+ * SSE4.2 when the CPU has it); with a background verifier that happens
+ * while the next piece is being copied. When the copy passes the data
+ * through user space anyway it checksums the source on the way. Otherwise
+ * the copy stays in the kernel (copy_file_range, sendfile) and the
+ * verifier reads the source range too: a second read of the source,
+ * mostly from the page cache the copy just filled, from the disk after a
+ * server-side or reflinked copy. Only a target that matches takes the
+ * place of the source, and its checksum is kept in the metadata DB.
+ */
+// Pieces handed to the verifier
+#define STORE_VERIFY_PIECE_SIZE (32LL * 1024 * 1024)
+#define STORE_VERIFY_BLOCK_SIZE (1024 * 1024)
+
+extern uint32_t storeverify_crc(uint32_t crc, const char * data, size_t n);
+// As if n zero bytes were added
+extern uint32_t storeverify_crc_zeros(uint32_t crc, off_t n);
+
+/*
+ * Reads back a target whose first offset bytes are already known to be
+ * good, with crc their checksum. With fd_from (not -1) the source is read
+ * back too, and must stay open until storeverify_finish(). background
+ * verifies on its own thread, otherwise storeverify_add() verifies before
+ * it returns. The reads are throttled like the copy between from_store
+ * and to_store (either may be NULL), both must outlive verify.
+ */
+struct STORE_VERIFY_T;
+extern STORE_VERIFY_T * storeverify_start(const char * fpath, int fd_from, off_t offset, uint32_t crc, bool background,
+	const char * from_store = NULL, const char * to_store = NULL);
+/*
+ * Everything up to end is copied and synced. crc is the source's checksum
+ * up to there, unused when the verifier reads the source itself.
+ */
+extern void storeverify_add(STORE_VERIFY_T * verify, off_t end, uint32_t crc);
+// How far the target has been read back and found good
+extern void storeverify_progress(STORE_VERIFY_T * verify, off_t * offset, uint32_t * crc);
+// Waits for the rest and frees verify. 0 with *crc the whole checksum, -EIO on a mismatch, or -errno.
+extern int storeverify_finish(STORE_VERIFY_T * verify, uint32_t * crc);
+
+// Checksum of a migrated object, valid while size and mtime still match
+struct STORE_CHECKSUM_T
+{
+	uint32_t crc;
+	uint64_t size;
+	uint64_t mtime;
+	// STORE_MTIME_NSEC_UNKNOWN in records written before it was kept
+	uint32_t mtime_nsec;
+};
+#define STORE_CHECKSUM_VERSION '\x01'
+
+extern int storeverify_set(const char * obj, const STORE_CHECKSUM_T &checksum);
+extern int storeverify_get(const char * obj, STORE_CHECKSUM_T &checksum);
+extern int storeverify_del(const char * obj, META_TXN_T * txn = NULL);
+// A rename keeps the data and the mtime, the checksum moves along
+extern int storeverify_rename(const char * obj, const char * newobj, META_TXN_T * txn);
+extern int storeverify_dump_to_log();
+
+#endif
@@ -0,0 +1,376 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "log.h"
+#include "store.h"
+#include "utils.h"
+
+#include "throttle.h"
+
+using namespace std;
+
+struct THROTTLE_BUCKET_T
+{
+	// Own rate, 0 falls back to the default
+	unsigned long long rate;
+	double tokens;
+	unsigned long long last_us;
+
+	// Stats
+	unsigned long long bytes;
+	unsigned long long wait_us;
+
+	// Bytes per second while unlimited, what adaptive mode backs off from
+	unsigned long long measured;
+	// bytes at the last refresh
+	unsigned long long window_bytes;
+};
+
+static pthread_mutex_t _throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<string, THROTTLE_BUCKET_T> _throttle_buckets;
+static unsigned long long _throttle_default_rate = 0;
+static unsigned long _throttle_target_us = 0;
+// Rates are divided by this, 1 unless adaptive mode backs off
+static int _throttle_backoff = 1;
+static unsigned long long _throttle_next_reload_us = 0;
+static unsigned long long _throttle_window_us = 0;
+static struct timespec _throttle_file_mtime;
+
+// Foreground side, updated without the mutex
+static volatile unsigned long long _throttle_latency_us = 0;
+static volatile unsigned long long _throttle_latency_time_us = 0;
+static volatile unsigned long long _throttle_read_sample_us = 0;
+
+static unsigned long long now_us()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Small state files are replaced whole, readers never see half a file
+static int write_file(const string &path, const string &content)
+{
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path.c_str(), (int)getpid());
+
+	FILE * file = fopen(tmp_path, "w");
+	if(!file) {
+		return -1;
+	}
+	size_t written = fwrite(content.data(), 1, content.size(), file);
+	if(fclose(file) != 0 || written != content.size() || rename(tmp_path, path.c_str()) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+// with _throttle_mutex held
+static THROTTLE_BUCKET_T * get_bucket(const string &store)
+{
+	map<string, THROTTLE_BUCKET_T>::iterator mit = _throttle_buckets.find(store);
+	if(mit == _throttle_buckets.end()) {
+		THROTTLE_BUCKET_T bucket;
+		memset(&bucket, 0, sizeof(bucket));
+		mit = _throttle_buckets.insert(make_pair(store, bucket)).first;
+	}
+	return &mit->second;
+}
+
+// with _throttle_mutex held
+static unsigned long long get_rate(const THROTTLE_BUCKET_T * bucket)
+{
+	unsigned long long rate = bucket->rate ? bucket->rate : _throttle_default_rate;
+	if(rate == 0 && _throttle_backoff > 1) {
+		rate = bucket->measured;
+	}
+	return rate / _throttle_backoff;
+}
+
+// with _throttle_mutex held, re-reads THROTTLE_FILE if it changed
+static void throttle_load(bool force)
+{
+	struct stat statbuf;
+	if(stat(THROTTLE_FILE.c_str(), &statbuf) != 0) {
+		return;
+	}
+	if(!force && statbuf.st_mtim.tv_sec == _throttle_file_mtime.tv_sec
+		&& statbuf.st_mtim.tv_nsec == _throttle_file_mtime.tv_nsec) {
+		return;
+	}
+	_throttle_file_mtime = statbuf.st_mtim;
+
+	ifstream file;
+	file.open(THROTTLE_FILE.c_str());
+	if(file.fail()) {
+		return;
+	}
+
+	for(map<string, THROTTLE_BUCKET_T>::iterator mit = _throttle_buckets.begin(); mit != _throttle_buckets.end(); mit++) {
+		mit->second.rate = 0;
+	}
+	_throttle_default_rate = 0;
+	_throttle_target_us = 0;
+
+	string line;
+	while(getline(file, line)) {
+		size_t pos1 = line.find(',');
+		if(pos1 == string::npos) {
+			continue;
+		}
+		string key = line.substr(0, pos1);
+		unsigned long long value = strtoull(line.substr(pos1 + 1).c_str(), NULL, 10);
+		if(key == "adaptive") {
+			_throttle_target_us = value;
+		} else if(key == THROTTLE_DEFAULT_STORE) {
+			_throttle_default_rate = value;
+		} else {
+			get_bucket(key)->rate = value;
+		}
+	}
+
+	log_msg(LOG_LEVEL_ERROR, "throttle_load: default %llu B/s, adaptive target %lu us\n",
+		_throttle_default_rate, _throttle_target_us);
+}
+
+// with _throttle_mutex held
+static int throttle_save()
+{
+	string content;
+	char line[PATH_MAX + 64];
+
+	snprintf(line, sizeof(line), "%s,%llu\n", THROTTLE_DEFAULT_STORE, _throttle_default_rate);
+	content += line;
+	snprintf(line, sizeof(line), "adaptive,%lu\n", _throttle_target_us);
+	content += line;
+	for(map<string, THROTTLE_BUCKET_T>::iterator mit = _throttle_buckets.begin(); mit != _throttle_buckets.end(); mit++) {
+		if(mit->second.rate) {
+			snprintf(line, sizeof(line), "%s,%llu\n", mit->first.c_str(), mit->second.rate);
+			content += line;
+		}
+	}
+
+	if(write_file(THROTTLE_FILE, content) != 0) {
+		log_msg(LOG_LEVEL_ERROR, "throttle_save: cannot write %s\n", THROTTLE_FILE.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+// Newest foreground latency, 0 when there was no I/O lately
+static unsigned long long get_latency(unsigned long long now)
+{
+	unsigned long long latency = _throttle_latency_us;
+	unsigned long long time = _throttle_latency_time_us;
+
+	return (time + THROTTLE_LATENCY_STALE_US < now) ? 0 : latency;
+}
+
+// with _throttle_mutex held, throughput of the stores that weren't limited since the last refresh
+static void throttle_measure(unsigned long long now)
+{
+	unsigned long long elapsed = now - _throttle_window_us;
+	bool first = (_throttle_window_us == 0);
+	_throttle_window_us = now;
+
+	for(map<string, THROTTLE_BUCKET_T>::iterator mit = _throttle_buckets.begin(); mit != _throttle_buckets.end(); mit++) {
+		THROTTLE_BUCKET_T * bucket = &mit->second;
+		unsigned long long moved = bucket->bytes - bucket->window_bytes;
+		bucket->window_bytes = bucket->bytes;
+		// An idle store would only drag the estimate down
+		if(first || elapsed == 0 || moved < THROTTLE_CHUNK_SIZE || get_rate(bucket) != 0) {
+			continue;
+		}
+		// Follows a rise at once, a window that was partly idle only pulls it down slowly
+		unsigned long long rate = moved * 1000000 / elapsed;
+		if(rate >= bucket->measured) {
+			bucket->measured = rate;
+		} else {
+			bucket->measured -= (bucket->measured - rate) >> THROTTLE_EWMA_SHIFT;
+		}
+	}
+}
+
+// with _throttle_mutex held
+static void throttle_refresh(unsigned long long now)
+{
+	if(now < _throttle_next_reload_us) {
+		return;
+	}
+	_throttle_next_reload_us = now + THROTTLE_RELOAD_INTERVAL_US;
+
+	throttle_load(false);
+	throttle_measure(now);
+
+	// Back off fast, recover slowly
+	int backoff = 1;
+	if(_throttle_target_us) {
+		unsigned long long latency = get_latency(now);
+		backoff = _throttle_backoff;
+		if(latency > _throttle_target_us) {
+			backoff = backoff * 2 > THROTTLE_ADAPTIVE_MAX_BACKOFF ? THROTTLE_ADAPTIVE_MAX_BACKOFF : backoff * 2;
+		} else if(latency < _throttle_target_us * 3 / 4 && backoff > 1) {
+			backoff--;
+		}
+	}
+	if(backoff != _throttle_backoff) {
+		log_msg(LOG_LEVEL_ERROR, "throttle_refresh: backoff 1/%d -> 1/%d\n", _throttle_backoff, backoff);
+		_throttle_backoff = backoff;
+	}
+}
+
+// with _throttle_mutex held, how long to wait for the tokens
+static unsigned long long take_tokens(const char * store, size_t bytes, unsigned long long now)
+{
+	if(!store) {
+		return 0;
+	}
+
+	THROTTLE_BUCKET_T * bucket = get_bucket(store);
+	unsigned long long rate = get_rate(bucket);
+	bucket->bytes += bytes;
+	if(rate == 0) {
+		return 0;
+	}
+
+	double burst = (double)rate * THROTTLE_BURST_US / 1000000;
+	if(burst < THROTTLE_CHUNK_SIZE) {
+		burst = THROTTLE_CHUNK_SIZE;
+	}
+	bucket->tokens += (double)(now - bucket->last_us) * rate / 1000000;
+	if(bucket->tokens > burst) {
+		bucket->tokens = burst;
+	}
+	bucket->last_us = now;
+
+	// Going negative reserves the tokens, later callers queue up behind
+	bucket->tokens -= bytes;
+	if(bucket->tokens >= 0) {
+		return 0;
+	}
+	unsigned long long wait = (unsigned long long)(-bucket->tokens * 1000000 / rate);
+	bucket->wait_us += wait;
+	return wait;
+}
+
+int throttle_limited(const char * from_store, const char * to_store)
+{
+	AutoLock _lock(&_throttle_mutex);
+	throttle_refresh(now_us());
+
+	// Adaptive mode may limit any store mid-copy, and needs the bytes counted
+	return _throttle_target_us
+		|| (from_store && get_rate(get_bucket(from_store)) > 0)
+		|| (to_store && get_rate(get_bucket(to_store)) > 0);
+}
+
+void throttle_acquire(const char * from_store, const char * to_store, size_t bytes)
+{
+	unsigned long long wait = 0;
+	{
+		AutoLock _lock(&_throttle_mutex);
+		unsigned long long now = now_us();
+		throttle_refresh(now);
+
+		unsigned long long wait_from = take_tokens(from_store, bytes, now);
+		unsigned long long wait_to = take_tokens(to_store, bytes, now);
+		wait = wait_from > wait_to ? wait_from : wait_to;
+	}
+
+	while(wait > 0) {
+		unsigned long long step = wait > 1000000 ? 1000000 : wait;
+		usleep(step);
+		wait -= step;
+	}
+}
+
+int throttle_set_rate(const char * store, unsigned long long bytes_per_sec)
+{
+	if(!store || !*store) {
+		return -1;
+	}
+
+	AutoLock _lock(&_throttle_mutex);
+	throttle_load(true);
+
+	if(strcmp(store, THROTTLE_DEFAULT_STORE) == 0) {
+		_throttle_default_rate = bytes_per_sec;
+	} else {
+		get_bucket(store)->rate = bytes_per_sec;
+	}
+	log_msg(LOG_LEVEL_ERROR, "throttle_set_rate: %s -> %llu B/s\n", store, bytes_per_sec);
+
+	// Applies to the next chunk in this process too
+	_throttle_next_reload_us = 0;
+	return throttle_save();
+}
+
+int throttle_set_adaptive(unsigned long target_us)
+{
+	AutoLock _lock(&_throttle_mutex);
+	throttle_load(true);
+
+	_throttle_target_us = target_us;
+	log_msg(LOG_LEVEL_ERROR, "throttle_set_adaptive: target %lu us\n", target_us);
+
+	_throttle_next_reload_us = 0;
+	return throttle_save();
+}
+
+unsigned long long throttle_clock_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void throttle_sample(unsigned long long latency_us)
+{
+	unsigned long long old, ewma;
+	do {
+		old = _throttle_latency_us;
+		ewma = old ? old - (old >> THROTTLE_EWMA_SHIFT) + (latency_us >> THROTTLE_EWMA_SHIFT) : latency_us;
+	} while(!__sync_bool_compare_and_swap(&_throttle_latency_us, old, ewma));
+
+	_throttle_latency_time_us = now_us();
+}
+
+int throttle_want_sample()
+{
+	// Read without the mutex, a stale value only costs a sample
+	if(!_throttle_target_us) {
+		return 0;
+	}
+
+	unsigned long long now = throttle_clock_us();
+	unsigned long long last = _throttle_read_sample_us;
+	return now >= last + THROTTLE_READ_SAMPLE_US
+		&& __sync_bool_compare_and_swap(&_throttle_read_sample_us, last, now);
+}
+
+int throttle_dump_to_log()
+{
+	AutoLock _lock(&_throttle_mutex);
+	unsigned long long now = now_us();
+	throttle_refresh(now);
+
+	log_msg(LOG_LEVEL_ERROR, "throttle: default %llu B/s, adaptive target %lu us, latency %llu us, backoff 1/%d\n",
+		_throttle_default_rate, _throttle_target_us, get_latency(now), _throttle_backoff);
+	for(map<string, THROTTLE_BUCKET_T>::iterator mit = _throttle_buckets.begin(); mit != _throttle_buckets.end(); mit++) {
+		log_msg(LOG_LEVEL_ERROR, "throttle %s: %llu B/s, measured %llu B/s, %llu bytes, waited %llu us\n",
+			mit->first.c_str(), get_rate(&mit->second), mit->second.measured, mit->second.bytes, mit->second.wait_us);
+	}
+	return 0;
+}
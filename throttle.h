@@ -0,0 +1,59 @@
+#ifndef __THROTTLE_H__
+#define __THROTTLE_H__
+
+#include <sys/types.h>
+
+/*
+ * Bandwidth limits for background data movement (migration and promotion).
+ *
+ * Every store has a token bucket refilled at its configured rate, a copy
+ * takes tokens from both its source and its target bucket before moving a
+ * chunk. Stores without a rate of their own use the "*" rate, 0 means
+ * unlimited.
+ *
+ * In adaptive mode the rates are scaled down (halved, to at most
+ * 1/THROTTLE_ADAPTIVE_MAX_BACKOFF) while the foreground read/write latency
+ * is above the target, and recover step by step once it drops again. A
+ * store without any rate backs off from the throughput it reached while
+ * it was unlimited.
+ */
+// "store,bytes per second" per line, "*,rate" for the default, "adaptive,target latency in us"
+#define THROTTLE_FILE (STORE_ROOT + "/.migrate.throttle")
+#define THROTTLE_DEFAULT_STORE "*"
+
+// Throttled copies move data in chunks of this size
+#define THROTTLE_CHUNK_SIZE (1024 * 1024)
+// A bucket holds this much time worth of tokens (but at least a chunk)
+#define THROTTLE_BURST_US 250000
+#define THROTTLE_RELOAD_INTERVAL_US 1000000
+// Latency newer than this is still the foreground's, older means idle
+#define THROTTLE_LATENCY_STALE_US 5000000
+// EWMA weight of a new sample, 1/2^shift
+#define THROTTLE_EWMA_SHIFT 3
+// Reads are spliced untimed, one every this long is timed instead
+#define THROTTLE_READ_SAMPLE_US 10000
+#define THROTTLE_ADAPTIVE_MAX_BACKOFF 16
+
+// 1 if moving data between these stores is rate limited (either may be NULL)
+extern int throttle_limited(const char * from_store, const char * to_store);
+// Blocks until bytes may be moved from from_store to to_store
+extern void throttle_acquire(const char * from_store, const char * to_store, size_t bytes);
+
+/*
+ * Runtime changes, persisted to THROTTLE_FILE. For a store, rate 0 drops
+ * its own limit so the "*" rate applies again; "*" at 0 is unlimited.
+ */
+extern int throttle_set_rate(const char * store, unsigned long long bytes_per_sec);
+// target_us 0 turns adaptive mode off
+extern int throttle_set_adaptive(unsigned long target_us);
+
+// Monotonic clock for timing foreground I/O
+extern unsigned long long throttle_clock_us();
+// Latency of one foreground read or write
+extern void throttle_sample(unsigned long long latency_us);
+// 1 if the caller should time its next read for throttle_sample()
+extern int throttle_want_sample();
+
+extern int throttle_dump_to_log();
+
+#endif
@@ -2,6 +2,7 @@
 #define __UTILS_H__
 
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
 #include <string>
@@ -35,6 +36,63 @@ static bool abs_to_relative_path(const char * prefix, std::string abs_path, std:
 	return false;
 }
 
+// Base-128 varints, same encoding as LevelDB's
+static inline void put_varint32(string &dst, uint32_t v)
+{
+	while(v >= 0x80) {
+		dst += (char)(v | 0x80);
+		v >>= 7;
+	}
+	dst += (char)v;
+}
+
+// Advances p past the varint, false if it runs past limit
+static inline bool get_varint32(const char * &p, const char * limit, uint32_t &v)
+{
+	v = 0;
+	for(uint32_t shift = 0; shift <= 28 && p < limit; shift += 7) {
+		uint32_t byte = (unsigned char)*p++;
+		v |= (byte & 0x7f) << shift;
+		if(!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline void put_varint64(string &dst, uint64_t v)
+{
+	while(v >= 0x80) {
+		dst += (char)(v | 0x80);
+		v >>= 7;
+	}
+	dst += (char)v;
+}
+
+static inline bool get_varint64(const char * &p, const char * limit, uint64_t &v)
+{
+	v = 0;
+	for(uint32_t shift = 0; shift <= 63 && p < limit; shift += 7) {
+		uint64_t byte = (unsigned char)*p++;
+		v |= (byte & 0x7f) << shift;
+		if(!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// FNV-1a, for picking shards and buckets, not for anything persisted
+static inline uint32_t hash_fnv1a(const char * s)
+{
+	uint32_t hash = 2166136261U;
+	for(const unsigned char * p = (const unsigned char *)s; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
 class AutoLock
 {
 public: